@@ -0,0 +1,106 @@
+#!/bin/sh
+# Benchmark of every vfs command on images of each block size and FAT type.
+# Each image is populated with FANOUT directories of FILES files, with sizes
+# taken from FILE_SIZES, and the latency of every command is measured with
+# the batch mode timing (-t), with the page faults taken per operation.
+#
+# Usage: bench/bench.sh [VFS_BINARY]
+# Environment:
+#   BLOCK_SIZES  block sizes to test            (default: "128 256 512 1024")
+#   FAT_TYPES    FAT types to test              (default: "12 16 20")
+#   FANOUT       directories per image          (default: 8)
+#   FILES        files per directory            (default: 32)
+#   FILE_SIZES   sizes of the files, in bytes   (default: "100 1000 10000")
+#   FORMAT       csv or json                    (default: csv)
+#   LABEL        version label of the results   (default: git commit)
+#   OPTIONS      other vfs options, e.g. "-dsync -jgroup" (default: none)
+
+VFS=${1:-./vfs}
+BLOCK_SIZES=${BLOCK_SIZES:-"128 256 512 1024"}
+FAT_TYPES=${FAT_TYPES:-"12 16 20"}
+FANOUT=${FANOUT:-8}
+FILES=${FILES:-32}
+FILE_SIZES=${FILE_SIZES:-"100 1000 10000"}
+FORMAT=${FORMAT:-csv}
+LABEL=${LABEL:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+OPTIONS=${OPTIONS:-}
+
+DIR=$(mktemp -d /tmp/vfs_bench.XXXXXX)
+trap 'rm -rf "$DIR"' EXIT
+
+# host files with the requested sizes
+for size in $FILE_SIZES; do
+  head -c "$size" /dev/urandom | base64 -w 0 | head -c "$size" > "$DIR/src$size"
+done
+
+# script exercising every command: populate, read, copy, move and tear down
+awk -v fanout="$FANOUT" -v files="$FILES" -v sizes="$FILE_SIZES" -v dir="$DIR" 'BEGIN {
+  n_sizes = split(sizes, size, " ")
+  srand(1)
+  for (d = 0; d < fanout; d++) {
+    print "mkdir d" d
+    print "cd d" d
+    for (f = 0; f < files; f++)
+      print "get " dir "/src" size[int(rand() * n_sizes) + 1] " f" f
+    for (f = 0; f < files; f++) {
+      print "ls"
+      print "cat f" f
+      print "put f" f " " dir "/out"
+      print "cp f" f " c" f
+      print "mv c" f " m" f
+    }
+    print "cd .."
+  }
+  for (d = 0; d < fanout; d++) {
+    print "cd d" d
+    for (f = 0; f < files; f++) {
+      print "rm f" f
+      print "rm m" f
+    }
+    print "cd .."
+    print "rmdir d" d
+  }
+}' > "$DIR/script"
+
+# space needed by the files of the script (and a copy of each one)
+need=$(awk -v fanout="$FANOUT" -v files="$FILES" -v sizes="$FILE_SIZES" 'BEGIN {
+  n = split(sizes, size, " "); for (i = 1; i <= n; i++) sum += size[i]
+  print int(2 * fanout * files * sum / n)
+}')
+
+[ "$FORMAT" = json ] && printf "[\n" || printf "label,block_size,fat_type,command,ops,ops_per_s,p50_us,p99_us,minor_faults_per_op,major_faults_per_op\n"
+first=1
+for bs in $BLOCK_SIZES; do
+  for ft in $FAT_TYPES; do
+    # skips the images that are too small for the files
+    if [ $((bs * (1 << ft))) -lt $((2 * need)) ]; then
+      echo "skipping -b$bs -f$ft (image too small)" >&2
+      continue
+    fi
+
+    rm -f "$DIR/img"
+    "$VFS" -t $OPTIONS -b"$bs" -f"$ft" -s "$DIR/script" "$DIR/img" 2> "$DIR/times" > /dev/null
+
+    # "time: COMMAND US us MINOR minor MAJOR major" lines, sorted by command and latency
+    awk '$1 == "time:" { print $2, $3, $5, $7 }' "$DIR/times" | sort -k1,1 -k2,2n |
+      awk -v label="$LABEL" -v bs="$bs" -v ft="$ft" -v format="$FORMAT" -v first="$first" '
+        function flush() {
+          if (n == 0)
+            return
+          p50 = t[int((n - 1) * 0.50) + 1]
+          p99 = t[int((n - 1) * 0.99) + 1]
+          if (format == "json") {
+            printf "%s  {\"label\": \"%s\", \"block_size\": %d, \"fat_type\": %d, \"command\": \"%s\", \"ops\": %d, \"ops_per_s\": %.0f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"minor_faults_per_op\": %.2f, \"major_faults_per_op\": %.2f}",
+              (first ? "" : ",\n"), label, bs, ft, cmd, n, n / (sum / 1e6), p50, p99, minor / n, major / n
+            first = 0
+          } else
+            printf "%s,%d,%d,%s,%d,%.0f,%.1f,%.1f,%.2f,%.2f\n", label, bs, ft, cmd, n, n / (sum / 1e6), p50, p99, minor / n, major / n
+        }
+        $1 != cmd { flush(); cmd = $1; n = 0; sum = 0; minor = 0; major = 0 }
+        { t[++n] = $2; sum += $2; minor += $3; major += $4 }
+        END { flush() }'
+    first=0
+  done
+done
+[ "$FORMAT" = json ] && printf "\n]\n"
+exit 0
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Write system calls of cat/put: one per block (the original loop) against the
+# writev batches, for a contiguous file and for a file fragmented in
+# single-block runs.
+# Usage: bench/cat_syscalls.sh [VFS_BINARY] [BLOCKS]
+
+VFS=${1:-./vfs}
+N=${2:-8192}
+BS=128
+FAT_TYPE=16
+IMG=$(mktemp /tmp/vfs_bench.XXXXXX)
+
+rm -f "$IMG"
+head -c $((N * BS)) /dev/urandom > "$IMG.src"
+
+# the image is filled with pairs of single-block files and the first of each
+# pair is removed, so the only free space left is single-block holes
+printf 'x' > "$IMG.one"
+awk -v n=$((1 << FAT_TYPE)) -v one="$IMG.one" -v src="$IMG.src" 'BEGIN {
+  print "get " src " contiguous"
+  for (i = 0; i < n / 2; i++) { print "get " one " a" i; print "get " one " b" i }
+  for (i = 0; i < n / 2; i++) print "rm a" i
+  print "get " src " fragmented"
+}' | "$VFS" -b$BS -f$FAT_TYPE "$IMG" > /dev/null
+
+printf "file,bytes,per_block_writes,write_calls\n"
+for f in contiguous fragmented; do
+  calls=$(printf 'cat %s\n' "$f" | "$VFS" -t "$IMG" 2>&1 > /dev/null | sed -n 's/.*, \([0-9]*\) write calls.*/\1/p')
+  printf "%s,%d,%d,%d\n" "$f" $((N * BS)) "$N" "$calls"
+done
+
+rm -f "$IMG" "$IMG.src" "$IMG.one"
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Space and throughput of files stored plain and compressed (get -z): text (the
+# sources of the repository repeated), random data (which does not compress and
+# is stored plain) and a log-like file (short repeated lines with a counter).
+# Each input is copied to a new image with get, then read with put and cat;
+# blocks is the number of blocks in use after the get, as reported by fsck.
+# Usage: bench/compress.sh [VFS_BINARY] [FILE_MB]
+
+VFS=${1:-./vfs}
+FILE_MB=${2:-16}
+BS=1024
+IMG=$(mktemp "${TMPDIR:-/tmp}/vfs_bench.XXXXXX")
+SIZE=$((FILE_MB * 1024 * 1024))
+
+# room for the largest input stored plain
+FAT_TYPE=7
+while [ $((1 << FAT_TYPE)) -lt $((2 * FILE_MB * 1024)) ]; do
+  FAT_TYPE=$((FAT_TYPE + 1))
+done
+
+SRC=$(dirname "$0")/..
+: > "$IMG.text"
+while [ $(wc -c < "$IMG.text") -lt $SIZE ]; do
+  cat "$SRC"/*.c "$SRC"/*.h >> "$IMG.text"
+done
+truncate -s $SIZE "$IMG.text"
+head -c $SIZE /dev/urandom > "$IMG.random"
+awk -v size=$SIZE 'BEGIN {
+  for (i = 0; n < size; i++) {
+    line = sprintf("2026-10-16 12:%02d:%02d worker %d: request %d served in %d us\n", i / 60 % 60, i % 60, i % 8, i, i * 7 % 1000)
+    printf "%s", line
+    n += length(line)
+  }
+}' | head -c $SIZE > "$IMG.log"
+
+printf "input,mode,size_mb,blocks,ratio,get_mbs,put_mbs,cat_mbs\n"
+for input in text random log; do
+  for mode in plain -z; do
+    [ "$mode" = plain ] && option= || option="$mode "
+    rm -f "$IMG"
+    printf 'get %s%s f\nput f %s\ncat f\nfsck\n' "$option" "$IMG.$input" "$IMG.out" |
+      "$VFS" -t -b$BS -f$FAT_TYPE "$IMG" 2> "$IMG.times" > "$IMG.stdout"
+    blocks=$(grep -ao 'files, [0-9]* blocks in use' "$IMG.stdout" | cut -d' ' -f2)
+    awk -v input=$input -v mode=$mode -v size=$SIZE -v blocks=$blocks -v bs=$BS '
+      $1 == "time:" { us[$2] = $3 }
+      END {
+        printf "%s,%s,%.1f,%d,%.2f,%.1f,%.1f,%.1f\n", input, mode, size / 1048576, blocks,
+          size / (blocks * bs), size / us["get"], size / us["put"], size / us["cat"]
+      }' "$IMG.times"
+    cmp -s "$IMG.$input" "$IMG.out" || echo "put of $input ($mode) differs" >&2
+  done
+done
+
+rm -f "$IMG" "$IMG.text" "$IMG.random" "$IMG.log" "$IMG.out" "$IMG.times" "$IMG.stdout"
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Directory lookup benchmark: time name lookups in directories of growing size.
+# Usage: bench/dir_lookup.sh [VFS_BINARY] [LOOKUPS]
+
+VFS=${1:-./vfs}
+LOOKUPS=${2:-20000}
+IMG=$(mktemp /tmp/vfs_bench.XXXXXX)
+
+now_ns() {
+  date +%s%N
+}
+
+printf "entries,lookups,total_ms,ns_per_lookup\n"
+for N in 16 64 256 1024 4096 16384; do
+  rm -f "$IMG"
+
+  # populate the directory 'big' with N subdirectories (a block each, 2^15 blocks fit the largest)
+  awk -v n="$N" 'BEGIN { print "mkdir big"; print "cd big"; for (i = 0; i < n; i++) print "mkdir d" i }' |
+    "$VFS" -b1024 -f15 "$IMG" > /dev/null
+
+  # each lookup is a 'cd' into a random entry of 'big' (and a 'cd ..' back)
+  awk -v n="$N" -v m="$LOOKUPS" 'BEGIN { srand(1); print "cd big"; for (i = 0; i < m; i++) { print "cd d" int(rand() * n); print "cd .." } }' > "$IMG.cmds"
+
+  start=$(now_ns)
+  "$VFS" "$IMG" < "$IMG.cmds" > /dev/null
+  end=$(now_ns)
+
+  awk -v n="$N" -v m="$LOOKUPS" -v t=$((end - start)) 'BEGIN { printf "%d,%d,%.1f,%.0f\n", n, m, t / 1e6, t / m }'
+done
+
+rm -f "$IMG" "$IMG.cmds"
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Throughput of the recursive import (get -r) of a host directory tree with
+# 1, 2, 4, ... worker threads, up to the number of processors (or MAX_WORKERS).
+# Usage: bench/get_tree.sh [VFS_BINARY] [DIRS] [FILES_PER_DIR] [FILE_SIZE]
+
+VFS=${1:-./vfs}
+DIRS=${2:-16}
+FILES=${3:-64}
+SIZE=${4:-65536}
+BS=1024
+FAT_TYPE=20
+IMG=$(mktemp /tmp/vfs_bench.XXXXXX)
+SRC=$(mktemp -d /tmp/vfs_bench_tree.XXXXXX)
+
+for d in $(seq 1 $DIRS); do
+  mkdir "$SRC/d$d"
+  for f in $(seq 1 $FILES); do
+    head -c $SIZE /dev/urandom > "$SRC/d$d/f$f"
+  done
+done
+BYTES=$((DIRS * FILES * SIZE))
+
+printf "workers,files,bytes,seconds,MB/s\n"
+w=1
+max=${MAX_WORKERS:-$(nproc)}
+while [ $w -le $max ]; do
+  rm -f "$IMG"
+  echo exit | "$VFS" -b$BS -f$FAT_TYPE "$IMG" > /dev/null
+  sync
+  t=$(printf 'get -r %s tree\n' "$SRC" | "$VFS" -t -w$w "$IMG" 2>&1 > /dev/null | sed -n 's/^time: get \([0-9.]*\) us .*/\1/p')
+  awk -v w=$w -v n=$((DIRS * FILES)) -v b=$BYTES -v t=$t 'BEGIN { printf "%d,%d,%d,%.3f,%.1f\n", w, n, b, t / 1e6, b / t }'
+  w=$((w * 2))
+done
+
+rm -rf "$IMG" "$SRC"
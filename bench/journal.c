@@ -0,0 +1,160 @@
+///////////////////////////////////////////////////////////////////
+//                                                               //
+// Throughput of operations that change the image, with the      //
+// journal off, a flush per operation and group commit (a new    //
+// image for each), shared by 1, 2, 4, ... threads (up to        //
+// MAX_THREADS, 8 by default). Each thread replaces files of its //
+// own directory (get and rm).                                   //
+//                                                               //
+// Usage: bench/journal [FILES_PER_DIR] [SECONDS]                //
+//                                                               //
+///////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include "../vfs.h"
+
+#define FILE_SIZE 4096
+#define BLOCK_SIZE 1024
+#define FAT_TYPE 18
+
+typedef struct bench_thread {
+  pthread_t thread;
+  vfs_t *vfs;
+  int id;
+  long n_ops;
+} bench_thread;
+
+static int n_files, max_threads;
+static atomic_int stop;
+static char host_file[] = "/tmp/vfs_bench_file.XXXXXX";
+static const char *mode_names[] = { "off", "op", "group" };
+
+static void fail(const char *what, int status){
+  fprintf(stderr, "%s: %s\n", what, vfs_strerror(status));
+  exit(1);
+}
+
+//remove a file of the directory of the thread and get it again
+static void *bench_run(void *arg){
+  bench_thread *t = (bench_thread *)arg;
+  unsigned int seed = t->id + 1;
+  char name[16];
+
+  while(!atomic_load(&stop)) {
+    sprintf(name, "f%d", rand_r(&seed) % n_files);
+    if(vfs_rm(t->vfs, name) == VFS_OK)
+      vfs_get(t->vfs, host_file, name);
+    t->n_ops += 2;
+  }
+
+  return NULL;
+}
+
+//format an image with a directory of n_files files for each thread
+static vfs_t *create_image(char *image){
+  char name[16];
+  int status, fd;
+  vfs_t *vfs;
+
+  // the image must not exist, the name is only reserved
+  if((fd = mkstemp(image)) == -1 || close(fd) == -1 || unlink(image) == -1) {
+    perror(image);
+    exit(1);
+  }
+  if((status = vfs_format(image, BLOCK_SIZE, FAT_TYPE)) != VFS_OK)
+    fail(image, status);
+  if((status = vfs_open(image, &vfs)) != VFS_OK)
+    fail(image, status);
+
+  for(int d = 0; d < max_threads; d++) {
+    sprintf(name, "d%d", d);
+    if((status = vfs_mkdir(vfs, name)) != VFS_OK)
+      fail("mkdir", status);
+    vfs_cd(vfs, name);
+    for(int f = 0; f < n_files; f++) {
+      sprintf(name, "f%d", f);
+      if((status = vfs_get(vfs, host_file, name)) != VFS_OK)
+        fail("get", status);
+    }
+    vfs_cd(vfs, "..");
+  }
+
+  return vfs;
+}
+
+int main(int argc, char *argv[]){
+  char buf[FILE_SIZE], name[16];
+  int seconds, status, fd;
+
+  n_files = argc > 1 ? atoi(argv[1]) : 64;
+  seconds = argc > 2 ? atoi(argv[2]) : 2;
+  max_threads = getenv("MAX_THREADS") != NULL ? atoi(getenv("MAX_THREADS")) : 8;
+
+  if((fd = mkstemp(host_file)) == -1) {
+    perror(host_file);
+    return 1;
+  }
+  memset(buf, 'x', FILE_SIZE);
+  if(write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+    perror(host_file);
+    return 1;
+  }
+  close(fd);
+
+  // each mode starts with a new image, so that a mode doesn't run on the files left by the previous one
+  printf("journal,threads,ops,seconds,ops/s,commits,flushes\n");
+  for(int mode = VFS_JOURNAL_OFF; mode <= VFS_JOURNAL_GROUP; mode++) {
+    char image[] = "/tmp/vfs_bench.XXXXXX";
+    vfs_t *vfs = create_image(image);
+
+    if((status = vfs_journal(vfs, mode)) != VFS_OK)
+      fail("journal", status);
+
+    for(int n = 1; n <= max_threads; n *= 2) {
+      bench_thread *threads = (bench_thread *)calloc(n, sizeof(bench_thread));
+      struct timespec start, end;
+      vfs_info_t before, after;
+
+      vfs_info(vfs, &before);
+      atomic_store(&stop, 0);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for(int i = 0; i < n; i++) {
+        threads[i].id = i;
+        vfs_dup(vfs, &threads[i].vfs);
+        sprintf(name, "d%d", i);
+        vfs_cd(threads[i].vfs, name);
+        pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]);
+      }
+
+      sleep(seconds);
+      atomic_store(&stop, 1);
+
+      long n_ops = 0;
+      for(int i = 0; i < n; i++) {
+        pthread_join(threads[i].thread, NULL);
+        vfs_close(threads[i].vfs);
+        n_ops += threads[i].n_ops;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      vfs_info(vfs, &after);
+
+      double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      printf("%s,%d,%ld,%.3f,%.0f,%ld,%ld\n", mode_names[mode], n, n_ops, elapsed, n_ops / elapsed,
+             after.n_commits - before.n_commits, after.n_flushes - before.n_flushes);
+      free(threads);
+    }
+
+    vfs_close(vfs);
+    unlink(image);
+  }
+
+  unlink(host_file);
+
+  return 0;
+}
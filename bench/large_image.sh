@@ -0,0 +1,41 @@
+#!/bin/sh
+# Large image stress benchmark: fill a multi-GiB image with big files, free
+# half of them and fill it again, timing every phase.
+# Usage: bench/large_image.sh [VFS_BINARY] [FAT_TYPE] [FILE_MB]
+
+VFS=${1:-./vfs}
+FAT_TYPE=${2:-22}
+FILE_MB=${3:-256}
+IMG=$(mktemp /tmp/vfs_bench.XXXXXX)
+SRC=$IMG.src
+
+now_ns() {
+  date +%s%N
+}
+
+# runs the vfs commands read from stdin and prints a CSV line for the phase
+# usage: run PHASE FILES
+run() {
+  start=$(now_ns)
+  "$VFS" -b1024 -f"$FAT_TYPE" "$IMG" > /dev/null
+  end=$(now_ns)
+  awk -v phase="$1" -v files="$2" -v mb="$FILE_MB" -v t=$((end - start)) \
+    'BEGIN { printf "%s,%d,%.1f,%.1f\n", phase, files, t / 1e6, files * mb / (t / 1e9) }'
+}
+
+rm -f "$IMG"
+head -c $((FILE_MB * 1024 * 1024 * 3 / 4)) /dev/urandom | base64 -w 1023 | head -c $((FILE_MB * 1024 * 1024)) > "$SRC"
+
+# number of copies of the source file that fit in the image
+N=$(((1 << FAT_TYPE) / (FILE_MB * 1024) - 1))
+
+printf "phase,files,total_ms,mb_per_s\n"
+echo ls | run format 0
+echo ls | run open 0
+awk -v n="$N" -v src="$SRC" 'BEGIN { for (i = 0; i < n; i++) print "get " src " f" i }' | run fill "$N"
+echo ls | run open_full 0
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i += 2) print "rm f" i }' | run rm_half $(((N + 1) / 2))
+awk -v n="$N" -v src="$SRC" 'BEGIN { for (i = 0; i < n; i += 2) print "get " src " g" i }' | run refill $(((N + 1) / 2))
+printf 'cat g0\ncat f1\n' | run cat 2
+
+rm -f "$IMG" "$SRC"
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Page faults and time of put on a cold image (its pages dropped from the page
+# cache), for a contiguous file and for a file fragmented in single-block runs,
+# with the prefetch off, at a few distances and with the whole image read when
+# it is opened (-mpopulate, whose reads are in total_ms but not in put_ms).
+# The image is created in TMPDIR, which must be on a disk file system (on tmpfs
+# there are no major faults to save).
+# Usage: bench/prefetch.sh [VFS_BINARY] [FILE_MB]
+# Environment:
+#   RUNS  options of vfs for each run (default: "-p0 -p64 -p256 default -mpopulate")
+
+VFS=${1:-./vfs}
+FILE_MB=${2:-32}
+RUNS=${RUNS:-"-p0 -p64 -p256 default -mpopulate"}
+BS=1024
+IMG=$(mktemp "${TMPDIR:-/tmp}/vfs_bench.XXXXXX")
+
+# room for both files and the single-block files between the blocks of the fragmented one
+FAT_TYPE=7
+while [ $((1 << FAT_TYPE)) -lt $((6 * FILE_MB * 1024)) ]; do
+  FAT_TYPE=$((FAT_TYPE + 1))
+done
+
+now_ns() {
+  date +%s%N
+}
+
+rm -f "$IMG"
+head -c $((FILE_MB * 1024 * 1024)) /dev/urandom > "$IMG.src"
+
+# the free space of the image is cut in single-block holes (pairs of single-block
+# files, the first of each pair removed) before the fragmented file is added
+printf 'x' > "$IMG.one"
+awk -v n=$((2 * FILE_MB * 1024)) -v one="$IMG.one" -v src="$IMG.src" 'BEGIN {
+  print "get " src " contiguous"
+  for (i = 0; i < n / 2; i++) { print "get " one " a" i; print "get " one " b" i }
+  for (i = 0; i < n / 2; i++) print "rm a" i
+  print "get " src " fragmented"
+}' | "$VFS" -b$BS -f$FAT_TYPE "$IMG" > /dev/null
+
+printf "file,options,put_ms,minor_faults,major_faults,prefetches,total_ms\n"
+for f in contiguous fragmented; do
+  for run in $RUNS; do
+    [ "$run" = default ] && options= || options=$run
+    sync "$IMG"
+    dd if="$IMG" iflag=nocache count=0 2> /dev/null
+    start=$(now_ns)
+    printf 'put %s %s\n' "$f" "$IMG.out" | "$VFS" -t $options "$IMG" 2> "$IMG.times" > /dev/null
+    end=$(now_ns)
+    awk -v f="$f" -v run="$run" -v t=$((end - start)) '
+      $1 == "time:" && $2 == "put" { us = $3; minor = $5; major = $7 }
+      $1 == "total:" { prefetches = $(NF - 1) }
+      END { printf "%s,%s,%.1f,%d,%d,%d,%.1f\n", f, run, us / 1e3, minor, major, prefetches, t / 1e6 }' "$IMG.times"
+  done
+done
+
+rm -f "$IMG" "$IMG.src" "$IMG.one" "$IMG.out" "$IMG.times"
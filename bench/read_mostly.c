@@ -0,0 +1,159 @@
+///////////////////////////////////////////////////////////////////
+//                                                               //
+// Throughput of a read-mostly workload on one image shared by   //
+// 1, 2, 4, ... threads, up to the number of processors (or      //
+// MAX_THREADS). Each thread has its own handle and directory,   //
+// and about 5% of its operations change the directory.          //
+//                                                               //
+// Usage: bench/read_mostly [DIRS] [FILES_PER_DIR] [SECONDS]     //
+//                                                               //
+///////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include "../vfs.h"
+
+#define FILE_SIZE 4096
+#define BLOCK_SIZE 1024
+#define FAT_TYPE 18
+
+typedef struct bench_thread {
+  pthread_t thread;
+  vfs_t *vfs;
+  int id;
+  long n_ops;
+} bench_thread;
+
+static int n_dirs, n_files;
+static atomic_int stop;
+static char host_file[] = "/tmp/vfs_bench_file.XXXXXX";
+
+static void fail(const char *what, int status){
+  fprintf(stderr, "%s: %s\n", what, vfs_strerror(status));
+  exit(1);
+}
+
+//stat, read and list the files of the directory, replacing a file of its own once in 20 operations
+static void *bench_run(void *arg){
+  bench_thread *t = (bench_thread *)arg;
+  unsigned int seed = t->id + 1;
+  char dir[16], name[16], own[16], buf[FILE_SIZE];
+  vfs_entry_t entries[16];
+  int n, have_own = 0;
+
+  sprintf(dir, "d%d", t->id % n_dirs);
+  sprintf(own, "t%d", t->id);
+  vfs_cd(t->vfs, dir);
+
+  while(!atomic_load(&stop)) {
+    int op = rand_r(&seed) % 20;
+    sprintf(name, "f%d", rand_r(&seed) % n_files);
+
+    if(op == 0) {
+      if(have_own)
+        vfs_rm(t->vfs, own);
+      else
+        vfs_get(t->vfs, host_file, own);
+      have_own = !have_own;
+    }
+    else if(op < 9)
+      vfs_stat(t->vfs, name, &entries[0]);
+    else if(op < 17)
+      vfs_read(t->vfs, name, 0, buf, FILE_SIZE, &n);
+    else
+      vfs_list(t->vfs, ".", rand_r(&seed) % n_files, entries, 16, &n);
+
+    t->n_ops++;
+  }
+
+  if(have_own)
+    vfs_rm(t->vfs, own);
+
+  return NULL;
+}
+
+int main(int argc, char *argv[]){
+  char image[] = "/tmp/vfs_bench.XXXXXX";
+  char buf[FILE_SIZE], name[16];
+  int seconds, max_threads, status, fd;
+  vfs_t *vfs;
+
+  n_dirs = argc > 1 ? atoi(argv[1]) : 64;
+  n_files = argc > 2 ? atoi(argv[2]) : 256;
+  seconds = argc > 3 ? atoi(argv[3]) : 2;
+  max_threads = getenv("MAX_THREADS") != NULL ? atoi(getenv("MAX_THREADS")) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  // the image must not exist, the name is only reserved
+  if((fd = mkstemp(image)) == -1 || close(fd) == -1 || unlink(image) == -1) {
+    perror(image);
+    return 1;
+  }
+  if((status = vfs_format(image, BLOCK_SIZE, FAT_TYPE)) != VFS_OK)
+    fail(image, status);
+  if((status = vfs_open(image, &vfs)) != VFS_OK)
+    fail(image, status);
+
+  if((fd = mkstemp(host_file)) == -1) {
+    perror(host_file);
+    return 1;
+  }
+  memset(buf, 'x', FILE_SIZE);
+  if(write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+    perror(host_file);
+    return 1;
+  }
+  close(fd);
+
+  for(int d = 0; d < n_dirs; d++) {
+    sprintf(name, "d%d", d);
+    if((status = vfs_mkdir(vfs, name)) != VFS_OK)
+      fail("mkdir", status);
+    vfs_cd(vfs, name);
+    for(int f = 0; f < n_files; f++) {
+      sprintf(name, "f%d", f);
+      if((status = vfs_get(vfs, host_file, name)) != VFS_OK)
+        fail("get", status);
+    }
+    vfs_cd(vfs, "..");
+  }
+
+  printf("threads,ops,seconds,ops/s\n");
+  for(int n = 1; n <= max_threads; n *= 2) {
+    bench_thread *threads = (bench_thread *)calloc(n, sizeof(bench_thread));
+    struct timespec start, end;
+
+    atomic_store(&stop, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < n; i++) {
+      threads[i].id = i;
+      vfs_dup(vfs, &threads[i].vfs);
+      pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]);
+    }
+
+    sleep(seconds);
+    atomic_store(&stop, 1);
+
+    long n_ops = 0;
+    for(int i = 0; i < n; i++) {
+      pthread_join(threads[i].thread, NULL);
+      vfs_close(threads[i].vfs);
+      n_ops += threads[i].n_ops;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d,%ld,%.3f,%.0f\n", n, n_ops, elapsed, n_ops / elapsed);
+    free(threads);
+  }
+
+  vfs_close(vfs);
+  unlink(image);
+  unlink(host_file);
+
+  return 0;
+}
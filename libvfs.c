@@ -0,0 +1,6350 @@
+///////////////////////////////////////////////////////////////////
+//                                                               //
+//                Project II: File System Manager                //
+//                                                               //
+// libvfs: the file system operations behind the vfs shell.      //
+// Every image is used through a handle (vfs_t) and all its      //
+// state lives in the image structure, so several images can be  //
+// open at once. Each directory has a reader/writer lock, and    //
+// the free space a lock of its own, so that the readers of an   //
+// image run in parallel (see vfs.h for the status codes).       //
+//                                                               //
+///////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE  // mremap
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "vfs.h"
+
+#define CHECK_NUMBER 9999
+#define TYPE_DIR VFS_TYPE_DIR
+#define TYPE_FILE VFS_TYPE_FILE
+#define MAX_NAME_LENGHT VFS_MAX_NAME
+#define FAT_FREE 0
+#define DIR_SORTED VFS_DIR_SORTED  // flag of a directory, in the size field of its entry '..'
+#define FS_VERSION 1
+#define MIN_FAT_TYPE VFS_MIN_FAT_TYPE
+#define MAX_FAT_TYPE VFS_MAX_FAT_TYPE
+
+#define FAT_ENTRIES(TYPE) (1 << (TYPE))
+#define FAT_SIZE(ENTRIES) ((long)(ENTRIES) * sizeof(int))
+#define FILESYSTEM_SIZE(BLOCK_SIZE, ENTRIES) ((BLOCK_SIZE) + FAT_SIZE(ENTRIES) + (long)(ENTRIES) * (BLOCK_SIZE))
+#define BLOCK(N) (fs->blocks + (long)(N) * fs->sb->block_size)
+#define DIR_ENTRIES_PER_BLOCK (fs->sb->block_size / sizeof(dir_entry))
+#define N_BLOCKS (fs->sb->n_blocks)
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+#define IMPORT_RESERVATION 1024
+#define JOURNAL_MAGIC 0x4a524e4c  // "JRNL"
+#define JOURNAL_MIN_BLOCKS 64     // size of the journal: 1/64 of the blocks, at least JOURNAL_MIN_BLOCKS
+#define JOURNAL_MAX_BYTES (16 << 20)  // and at most JOURNAL_MAX_BYTES
+#define JREC_SIZE(REC) ((long)sizeof(journal_record) + ((REC)->type == JREC_BYTES ? ((REC)->len + 7) & ~7 : 0))
+// bytes of the record of a directory entry (the largest one, but for the records of whole blocks)
+#define JREC_ENTRY ((long)sizeof(journal_record) + (((long)sizeof(dir_entry) + 7) & ~7))
+// room of the journal kept for each transaction when it starts: the changes of two directories (blocks and
+// entries of each, and the blocks taken or freed by them) and its commit (see txn_reserve for the others)
+#define TXN_RESERVE(FS) (4 * ((long)sizeof(journal_record) + (FS)->sb->block_size) + 16 * JREC_ENTRY)
+#define JREC_BYTES 1   // old contents of a range of the image
+#define JREC_FREE 2    // a run of FAT entries that were free
+#define JREC_RUN 3     // a run of FAT entries that were a linked run of a chain
+#define JREC_SHARE 4   // change of the number of copies of a chain (counted again if rolled back, see journal_recount)
+#define JREC_COMMIT 5  // end of a transaction
+#undef LOCK_READ   // flags of flock with _GNU_SOURCE, not used here
+#undef LOCK_WRITE
+#define LOCK_READ 0    // operations that only read the directory of their path
+#define LOCK_WRITE 1   // operations that change it
+#define LOCK_RENAME 2  // operations that lock other directories too
+#define FSCK_END 0     // ends of a chain checked by fsck: the end of the chain
+#define FSCK_LONG 1    // more blocks than its size needs
+#define FSCK_BAD 2     // a block out of the image, free or the root
+#define FSCK_CROSS 3   // a block of another chain
+#define FSCK_FILES_CHUNK 256  // file entries taken at a time by the workers of fsck
+#define PREFETCH_BYTES (1 << 20)  // default distance of the prefetch of the blocks of a file (see vfs_prefetch)
+#define PREFETCH_GAP 8            // pages between two runs of a file that the prefetch asks for at once
+#define HUGE_PAGE_SIZE (2 << 20)  // alignment of the mapping, so that huge pages can back it (VFS_MAP_HUGE)
+#define FILE_SPARSE 0x80         // flag of a sparse file (see sparse_header), in the high bits of the month of its entry
+#define MONTH_MASK 0x0f          // bits of the month itself
+#define SPARSE_TABLE_BLOCKS(RUNS) ((sizeof(sparse_header) + (long)(RUNS) * sizeof(sparse_run) + fs->sb->block_size - 1) / fs->sb->block_size)
+#define ZERO_BYTES (64 << 10)     // zeros written at a time for a hole of a sparse file
+#define FILE_COMPRESSED 0x40     // flag of a compressed file (see frame_header), in the high bits of the month too
+#define FRAME_TABLE_BLOCKS(FRAMES) ((sizeof(frame_header) + (long)(FRAMES) * sizeof(int) + fs->sb->block_size - 1) / fs->sb->block_size)
+#define FRAME_BYTES (64 << 10)    // most bytes of a file in a frame (so that the distances of the matches fit in 16 bits)
+#define LZ_MIN_MATCH 4            // shortest match of the compressor
+#define LZ_HASH_BITS 12           // the compressor finds matches in a table of the last position of 2^LZ_HASH_BITS hashes
+#define OUTPUT_BYTES (256 << 10)  // bytes of a compressed file decompressed before they are written (cat and put)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct superblock_entry {
+  int check_number;   // number that allows to identify the system as valid
+  int block_size;     // block size {128, 256 (default), 512 or 1024 bytes}
+  int fat_type;       // FAT type {7, 8 (default), ..., 28}: the FAT has 2^fat_type entries
+  int root_block;     // number of the first block for the root directory
+  int free_block;     // block where the search for free blocks starts
+  int n_free_blocks;  // total number of free blocks
+  int version;        // layout version (0: free blocks kept in a linked list)
+  int n_blocks;       // number of FAT entries and data blocks (0 in older filesystems)
+  int high_water;     // blocks from here on were never used, and are free (0 in older filesystems)
+  int share_table;    // first block of the table of shared chains (0 if there is none yet)
+  int dir_flags;      // flags of the new directories (DIR_SORTED), 0 in older filesystems
+  int journal_block;  // first block of the journal, a run of journal_blocks blocks (0 if there is none)
+  int journal_blocks;
+  long fat_offset;    // where the FAT and the data blocks start, from the start of the image (0 in the ones that were
+  long data_offset;   // never resized, whose FAT follows the superblock and is followed by the blocks)
+} superblock;
+
+typedef struct directory_entry {
+  char type;                   // entry type (TYPE_DIR or TYPE_FILE)
+  char name[MAX_NAME_LENGHT];  // entry name
+  unsigned char day;           // day where it was created (between 1 and 31)
+  unsigned char month;         // month where it was created (between 1 and 12, and FILE_SPARSE or FILE_COMPRESSED in the high bits)
+  unsigned char year;          // year where it was created (between 0 and 255 - 0 representa o ano de 1900)
+  int size;                    // size in bytes (0 if TYPE_DIR)
+  int first_block;             // first data block
+} dir_entry;
+
+// start of the chain of a sparse file: its first table_blocks blocks hold this header and the runs of the blocks of
+// the file with data, which follow in the chain in file order (the other blocks of the file are holes, read as zeros)
+typedef struct sparse_header {
+  int n_runs;        // runs after the header, sorted by offset
+  int table_blocks;  // blocks of the chain taken by the header and the runs
+} sparse_header;
+
+typedef struct sparse_run {
+  int offset;  // position of the run in the file (in blocks)
+  int length;  // number of blocks in the run
+} sparse_run;
+
+// start of the chain of a compressed file: its first table_blocks blocks hold this header and the end (in the file) of
+// each frame, and each of the blocks that follow holds a frame, the next bytes of the file compressed (see lz_compress)
+typedef struct frame_header {
+  int n_frames;      // frames after the table, in file order
+  int table_blocks;  // blocks of the chain taken by the header and the ends
+} frame_header;
+
+// how the blocks of a host file are stored in its chain (see plan_layout)
+typedef struct file_layout {
+  int flags;          // FILE_SPARSE or FILE_COMPRESSED (0 for a block of the chain for each block of the file)
+  int n_blocks;       // blocks of the chain
+  sparse_run *runs;   // runs of blocks with data of a sparse file
+  int n_runs;
+  char *frames;       // blocks of a compressed file, a frame each
+  int *ends;          // end of each frame in the file
+  int n_frames;
+} file_layout;
+
+// bytes compared at once by zero_block
+typedef unsigned long long zero_vec __attribute__((vector_size(16)));
+
+// start of the journal, the records follow it
+typedef struct journal_header {
+  int magic;             // JOURNAL_MAGIC
+  unsigned int epoch;    // the records of older epochs are not part of the journal
+  long flushed;          // the transactions with commits up to this number are on disk
+} journal_header;
+
+// record of the journal, followed by len bytes (JREC_BYTES) and padded to 8 bytes
+typedef struct journal_record {
+  unsigned int epoch;    // epoch of the journal when it was written (set last, so a torn record ends the journal)
+  int type;              // JREC_BYTES, JREC_FREE, JREC_RUN, JREC_SHARE or JREC_COMMIT
+  int txn;               // transaction that wrote it
+  int len;               // bytes (JREC_BYTES) or blocks (JREC_FREE, JREC_RUN) of the record
+  long offset;           // offset of the range in the image (JREC_BYTES), or first block
+  long arg;              // last FAT entry (JREC_RUN), change (JREC_SHARE) or number of the commit (JREC_COMMIT)
+  unsigned int check;    // hash of the fields from type on and of the bytes (the bytes of an older record that look
+                         // like one of the current epoch, or a record torn by a power loss, end the journal too)
+} journal_record;
+
+// undo journal of the changes to the FAT, the directories and the share table (the count of free blocks
+// in the superblock is recomputed on open, and so are the counts of copies changed by the transactions rolled back)
+// every operation that changes the image is a transaction, which logs the old contents of what it
+// changes and writes the records to the disk before changing it (the kernel can write a changed page
+// of the mapping back at any time), and a commit while it still holds its locks; the changes reach the
+// disk in flushes, and on open the transactions not covered by the last flush are rolled back
+typedef struct journal {
+  int mode;                // VFS_JOURNAL_OFF, VFS_JOURNAL_OP (a flush per commit) or VFS_JOURNAL_GROUP
+  journal_header *header;  // start of the journal in the mapping (NULL if the image has none)
+  long size;               // bytes of the journal
+  long head;               // where the next record is written
+  long synced;             // the records before it are on disk
+  long reserved;           // bytes kept for the records of the transactions in progress, not written yet
+  int next_txn;            // number of the next transaction
+  int n_active;            // transactions in progress
+  long n_commits;          // commits since the image was opened (the number of the last one)
+  long flushed;            // last commit on disk (header->flushed)
+  int flushing;            // a flush is in progress
+  int n_overflows;         // operations that failed, without changing anything, because the journal had no room
+  int n_rolled_back;       // transactions rolled back when the image was opened
+  pthread_mutex_t lock;    // all of the above, and the records
+  pthread_cond_t cond;     // end of a flush, or room in the journal
+} journal;
+
+// writing of the changes to the disk (see vfs_durability)
+typedef struct durability {
+  int mode;                   // VFS_DURABILITY_NONE, VFS_DURABILITY_BATCH or VFS_DURABILITY_SYNC
+  int batch_ops;              // operations between the flushes of the background thread (VFS_DURABILITY_BATCH)
+  int batch_ms;               // longest time between them, in milliseconds
+  long n_ops;                 // operations since the last flush of the background thread
+  int running;                // the background thread is running (cleared to stop it)
+  pthread_t thread;
+  long n_flushes;             // flushes since the image was opened (of the journal too)
+  long flush_ns;              // time spent in them
+  long max_flush_ns;          // longest one
+  pthread_mutex_t lock;       // all of the above
+  pthread_cond_t cond;        // enough operations for a flush, or end of the background thread
+  pthread_mutex_t flush_lock; // held while the dirty pages are written, so that a flush ends after the ones in progress
+} durability;
+
+// operations that change the image, which wait while defrag moves blocks (see vfs_defrag)
+typedef struct layout_gate {
+  int n_changing;        // operations in progress
+  int moving;            // defrag is moving blocks (the operations that start wait for it to end)
+  pthread_mutex_t lock;  // changes of moving, and the waits on cond
+  pthread_cond_t cond;   // end of the last operation in progress, or of defrag
+} layout_gate;
+
+// pages of the mapping changed by the operation of the calling thread (VFS_DURABILITY_SYNC)
+typedef struct page_run {
+  long first;  // first page of the run
+  long last;   // last page of the run
+} page_run;
+
+typedef struct dirty_list {
+  struct vfs_image *fs;  // image of the pages (NULL if there are none)
+  page_run *runs;
+  int n_runs;
+  int max_runs;
+} dirty_list;
+
+// transaction of the calling thread (an operation that changes the image)
+typedef struct journal_txn {
+  struct vfs_image *fs;  // image of the transaction (NULL if there is none)
+  int id;                // number of the transaction
+  int n_records;         // records written
+  long reserved;         // bytes kept in the journal for its records, not written yet
+  int logged;            // the runs being freed need no records: they are logged already (see free_chain), or were
+                         // taken by the transaction itself (see free_own_chain)
+  long commit;           // number of its commit (0 if it is not committed)
+  struct extent *freed;  // runs freed by the transaction, returned to the free space by its commit
+  int n_freed;
+  int max_freed;
+} journal_txn;
+
+typedef struct int_map {
+  int capacity;   // number of slots (power of two)
+  int count;      // number of keys in use
+  int *keys;      // slot keys (-1 if empty)
+  void **values;  // slot values
+} int_map;
+
+typedef struct directory_index {
+  int n_blocks;            // number of blocks in the directory chain
+  int max_blocks;          // capacity of the chain array
+  int *chain;              // blocks of the directory chain, in order
+  int *fill;               // entries in each block of the chain (sorted directories only, NULL otherwise)
+  int *order;              // positions in the chain of its blocks, in the order of their names (sorted directories)
+  int n_slots;             // capacity of the hash table (power of two)
+  int *slots;              // position of the entry in the directory (-1 if empty)
+  unsigned int *hashes;    // hash of the name of the entry in each slot
+  int block;               // first block of the directory
+  int parent_pos;          // position of the entry of the directory in its parent (-1 if not known yet)
+  int refs;                // handles and operations using the index (see pin_dir)
+  int removed;             // the directory was removed (the index is freed with its last reference)
+  pthread_rwlock_t lock;   // readers of the directory, or its only writer
+} dir_index;
+
+typedef struct block_name {
+  const char *name;  // first name of a block of a sorted directory
+  int pos;           // position of the block in the chain
+} block_name;
+
+typedef struct extent {
+  int start;   // first block of the run
+  int length;  // number of blocks in the run
+  int offset;  // position of the run in the file (in blocks, negative for the table of a sparse or compressed file)
+} extent;
+
+typedef struct extent_map {
+  int n_extents;     // number of runs of the file
+  int max_extents;   // room in extents
+  extent *extents;   // runs of contiguous blocks, in file order (with gaps for the holes of a sparse file)
+  int n_frames;      // frames of a compressed file (0 for the other files), a block each
+  int *frame_ends;   // end of each frame in the file
+} extent_map;
+
+typedef struct layout_chain {
+  int first_block;  // first block of the chain
+  int n_blocks;     // number of blocks of the chain
+  char type;        // TYPE_DIR or TYPE_FILE
+  int refs;         // first entry of the chain in the list of entries (-1 for the root)
+} layout_chain;
+
+typedef struct layout_ref {
+  int dir;   // chain of the directory with the entry
+  int pos;   // position of the entry in the directory
+  int next;  // next entry of the same chain (a copy made by cp), -1 at the end
+} layout_ref;
+
+// chains of the tree, numbered in the order defrag lays them out from the first block: each directory,
+// then its files and then its subdirectories (and their contents)
+typedef struct layout {
+  layout_chain *chains;
+  int n_chains;
+  int max_chains;
+  layout_ref *refs;     // entries of the chains
+  int n_refs;
+  int max_refs;
+  int *owner;           // chain of each block plus 1 (0 for a free block, -1 for a block in use out of the tree or
+                        // of a chain that stays where it is)
+  dir_index **locked;   // directories locked by the move in progress
+  int n_locked;
+  int max_locked;
+} layout;
+
+typedef struct vfs_image {
+  superblock *sb;            // superblock of the file system (start of the mapping)
+  int *fat;                  // pointer to the FAT table
+  char *blocks;              // pointer to data region
+  long size;                 // size of the image
+  long reserved;             // address space kept for the mapping, so that the image can grow in place (see vfs_resize)
+  int fd;                    // descriptor of the image file
+  unsigned long *block_map;  // bitmap of the blocks in use
+  int_map dir_indexes;       // name indexes of the directories, by first block
+  int_map file_extents;      // extent maps of the files, by first block
+  long n_write_calls;        // number of system calls used to write file data (cat and put)
+  int n_handles;             // handles open on the image
+  journal jnl;               // journal of the changes to the metadata
+  durability dur;            // when the changes are written to the disk
+  long page_size;            // size of the pages of the mapping
+  int map_flags;             // VFS_MAP_POPULATE and VFS_MAP_HUGE (see vfs_open_flags)
+  int prefetch_blocks;       // blocks of a file read ahead of the ones being read (see vfs_prefetch)
+  long n_prefetches;         // requests to read them (madvise calls)
+  long compress_in;          // bytes of the files imported with VFS_FILE_COMPRESSED
+  long compress_out;         // bytes of the blocks they take
+  long compress_ns;          // time spent compressing them
+  long decompress_bytes;     // bytes of compressed files decompressed
+  long decompress_ns;        // time spent decompressing them
+  unsigned long *dirty_pages;  // bitmap of the pages of the mapping changed since they were last written
+  layout_gate gate;          // operations that change the image, and defrag
+
+  // lock order: gate, rename_lock, directories (parents before children), alloc_lock, extent_lock
+  pthread_mutex_t rename_lock;   // held by the operations that lock more than one directory
+  pthread_mutex_t alloc_lock;    // superblock, block map, allocation of chains and share table
+  pthread_rwlock_t index_lock;   // map of directory indexes
+  pthread_rwlock_t extent_lock;  // map of extent maps
+} vfs_image;
+
+static __thread journal_txn txn;
+static __thread dirty_list dirty;
+static const char zeros[ZERO_BYTES];  // written for the holes of sparse files (see write_file_range)
+
+// a handle is used by one thread at a time, the threads that share an image use a handle each
+struct vfs {
+  vfs_image *fs;     // image of the handle (shared by vfs_dup)
+  dir_index *cwd;    // index of current directory (referenced, so it stays valid if another handle removes it)
+};
+
+typedef struct import_job {
+  char *path;                      // path of the host file or directory
+  char name[MAX_NAME_LENGHT + 1];  // name of the entry in our file system
+  char type;                       // TYPE_DIR or TYPE_FILE
+  int parent;                      // job of the parent directory (-1 for the destination directory)
+  int size;                        // size of the file in bytes
+  dir_index *index;                // index of the directory, pinned once it is created (NULL before)
+} import_job;
+
+typedef struct import_state {
+  vfs_image *fs;
+  import_job *jobs;      // files and directories found in the host tree
+  int n_jobs;
+  int max_jobs;
+  int next_job;          // next job to be taken by a worker
+  int n_workers;
+  long pending;          // blocks still needed by the files that were not allocated yet
+  dir_index *dest;       // directory that receives the tree, pinned (NULL while it doesn't exist)
+  int status;            // last error (VFS_OK if every entry was imported)
+  int compress;          // the files are compressed (VFS_FILE_COMPRESSED)
+  vfs_error_fn report;   // called for each entry that is not imported (may be NULL)
+  void *arg;
+  pthread_mutex_t lock;  // reports of the workers
+} import_state;
+
+typedef struct import_worker {
+  pthread_t thread;
+  import_state *state;
+  int res_start;   // first block reserved by the worker and not used yet
+  int res_length;  // number of blocks reserved by the worker and not used yet
+} import_worker;
+
+// directory reached by fsck
+typedef struct fsck_dir {
+  int block;     // first block
+  int parent;    // first block of its parent
+  char *path;    // path from the root ("/" for the root)
+  int *removed;  // positions of the entries removed by a repair
+  int n_removed;
+  int max_removed;
+} fsck_dir;
+
+// entry of a file, whose chain is checked once the tree is listed (with the other entries of the chain, see vfs_cp)
+typedef struct fsck_file {
+  int first_block;
+  dir_entry *entry;  // NULL once the entry is removed
+  fsck_dir *dir;
+  int pos;           // position of the entry in dir
+} fsck_file;
+
+// entry of a directory, sorted by name to find the duplicates
+typedef struct fsck_name {
+  dir_entry *entry;
+  int pos;
+} fsck_name;
+
+typedef struct fsck_state {
+  vfs_image *fs;
+  int repair;               // repair the problems (the image is not open)
+  unsigned long *reached;   // bitmap of the blocks reached from the root, the table of shared chains and the journal
+  fsck_dir **dirs;          // directories reached, in the order they are checked
+  int n_dirs;
+  int max_dirs;
+  int next_dir;             // next directory to be checked by a worker
+  int n_busy;               // workers checking a directory
+  fsck_file *files;         // file entries, sorted by first block once the tree is listed
+  long n_files;
+  long max_files;
+  long next_file;           // next file entry whose chain is checked by a worker
+  vfs_fsck_t *result;
+  vfs_fsck_fn report;       // called for each problem (may be NULL)
+  void *arg;
+  pthread_mutex_t lock;     // all of the above, and the reports
+  pthread_cond_t cond;      // new directories, or the end of the walk
+} fsck_state;
+
+// auxiliary functions
+static void init_superblock(vfs_image *, int, int, int);
+static void init_fat(vfs_image *);
+static void init_block_map(vfs_image *);
+static void init_dir_block(vfs_image *, int, int, int);
+static void init_dir_entry(dir_entry *, char, const char *, int, int);
+static void copy_entry(vfs_image *, dir_entry *, vfs_entry_t *);
+
+// block and directory entry management functions
+static int get_free_block(vfs_image *);
+static void free_block(vfs_image *, int);
+static int alloc_run(vfs_image *, int, int, int *);
+static int reserve_run(vfs_image *, int, int, int *);
+static int find_run(vfs_image *, int, int, int, int *);
+static void take_run(vfs_image *, int, int);
+static void link_run(vfs_image *, int, int);
+static void unreserve_run(vfs_image *, int, int);
+static int alloc_chain(vfs_image *, int, int);
+static int link_runs(vfs_image *, extent *, int);
+static void free_chain(vfs_image *, int);
+static void free_own_chain(vfs_image *, int);
+static int reserve_release(vfs_image *, int);
+static void release_chain(vfs_image *, int);
+static unsigned short *block_shares(vfs_image *, int, int);
+static void free_run(vfs_image *, int, int);
+static void set_bits(vfs_image *, int, int, int);
+static int find_bit(vfs_image *, int, int, int);
+static dir_entry *find_dir_entry(vfs_image *, dir_index *, const char *, int *);
+static int dir_add_entry(vfs_image *, dir_index *, dir_entry *);
+static void dir_remove_entry(vfs_image *, dir_index *, int);
+static int dir_append_block(vfs_image *, dir_index *);
+static int dir_next_pos(vfs_image *, dir_index *, int);
+static int dir_add_blocks(vfs_image *, dir_index *, const char *);
+
+// sorted directory functions (the entries of each block are sorted and packed at its start, and
+// the names of a block are all before the ones of the next block in index->order)
+static int sorted_block(vfs_image *, dir_index *, const char *);
+static int sorted_add_entry(vfs_image *, dir_index *, dir_entry *);
+static void sorted_remove_entry(vfs_image *, dir_index *, int);
+static void sorted_move_entry(vfs_image *, dir_index *, int, int);
+static void sorted_order(vfs_image *, dir_index *);
+static int block_name_cmp(const void *, const void *);
+static int sorted_pos(vfs_image *, dir_index *, int);
+
+// journal functions
+static int journal_create(vfs_image *);
+static void journal_open(vfs_image *);
+static void journal_replay(vfs_image *);
+static void journal_undo(vfs_image *, journal_record *);
+static void journal_recount(vfs_image *, int_map *);
+static unsigned int journal_check(journal_record *);
+static void journal_append(vfs_image *, int, long, int, long, const void *);
+static void journal_bytes(vfs_image *, void *, long);
+static void journal_free_runs(vfs_image *, extent *, int);
+static void journal_run(vfs_image *, int, int);
+static void journal_share(vfs_image *, int, int);
+static void journal_sync(vfs_image *);
+static void journal_flush(vfs_image *, long);
+static void msync_range(vfs_image *, void *, long);
+static void txn_begin(vfs_image *);
+static void txn_start(vfs_image *);
+static int txn_reserve(vfs_image *, long);
+static void txn_commit(vfs_image *);
+static void txn_end(vfs_image *);
+static void txn_finish(vfs_image *);
+
+// durability functions
+static void mark_dirty(vfs_image *, void *, long);
+static int flush_dirty(vfs_image *);
+static void sync_end(vfs_image *);
+static int page_run_cmp(const void *, const void *);
+static void *flush_thread_run(void *);
+static void stop_flush_thread(vfs_image *);
+static void note_flush(vfs_image *, struct timespec *);
+
+// file extent functions
+static extent_map *get_extent_map(vfs_image *, int, int);
+static void add_extent(extent_map *, int, int);
+static void drop_extent_map(vfs_image *, int);
+static char *file_run(vfs_image *, extent_map *, int, int *);
+static long prefetch_file(vfs_image *, extent_map *, int, int, int *);
+static int write_file_range(vfs_image *, int, dir_entry *, int, int, int);
+static void copy_to_chain(vfs_image *, int, const char *, int);
+static char *map_input(const char *, int);
+static void plan_layout(vfs_image *, const char *, const char *, int, int, file_layout *);
+static void copy_layout(vfs_image *, int, const char *, int, file_layout *);
+
+// sparse file functions
+static int find_data_runs(vfs_image *, const char *, const char *, int, sparse_run **, int *);
+static int zero_block(const char *, int);
+static void copy_to_sparse_chain(vfs_image *, int, const char *, int, sparse_run *, int);
+static int chain_blocks(vfs_image *, int, int);
+
+// compressed file functions
+static int lz_compress(const char *, int, char *, int, int *, int *, int);
+static unsigned char *lz_sequence(unsigned char *, const unsigned char *, int, int, int);
+static int lz_extra(int);
+static int lz_decompress(const char *, int, char *, int);
+static int lz_length(const unsigned char **, const unsigned char *, int);
+static int compress_input(vfs_image *, const char *, int, int, char **, int **);
+static void copy_to_compressed_chain(vfs_image *, int, char *, int *, int);
+static int load_frame_ends(vfs_image *, int, extent_map *);
+static int find_frame(extent_map *, int);
+static int decode_frame(vfs_image *, extent_map *, int, char *);
+static int read_frames(vfs_image *, extent_map *, int, int, char *);
+static int write_frames(vfs_image *, int, extent_map *, int, int);
+static long elapsed_ns(struct timespec *);
+
+// recursive import functions
+static int make_dir(vfs_image *, dir_index *, const char *, int);
+static int import_dest(import_state *, dir_index *, const char *);
+static int import_walk(import_state *, const char *, int, long *);
+static void import_error(import_state *, const char *, int);
+static void *import_worker_run(void *);
+static int import_alloc(import_worker *, int);
+
+// directory index functions
+static void *int_map_get(int_map *, int);
+static void int_map_put(int_map *, int, void *);
+static void int_map_del(int_map *, int);
+static unsigned int name_hash(const char *);
+static dir_index *get_dir_index(vfs_image *, int);
+static void drop_dir_index(vfs_image *, dir_index *);
+static dir_entry *dir_index_entry(vfs_image *, dir_index *, int);
+static int dir_index_find(vfs_image *, dir_index *, const char *);
+static void dir_index_insert(vfs_image *, dir_index *, int);
+static void dir_index_remove(vfs_image *, dir_index *, int);
+static void dir_index_move(vfs_image *, dir_index *, int, int);
+static void note_parent_pos(vfs_image *, dir_entry *, int);
+static dir_entry *find_subdir_entry(vfs_image *, dir_index *, int);
+static void free_dir_index(dir_index *);
+
+// locking functions
+static dir_index *pin_dir(vfs_image *, int);
+static void unpin_dir(vfs_image *, dir_index *);
+static int lock_index(dir_index *, int);
+static dir_index *lock_dir(vfs_image *, int, int);
+static void unlock_dir(vfs_image *, dir_index *);
+static int lock_path(vfs_t *, const char *, int, dir_index **, char *);
+static void unlock_path(vfs_t *, dir_index *, int);
+static int lock_paths(vfs_t *, const char *, const char *, dir_index **, char *, dir_index **, char *);
+static void unlock_paths(vfs_t *, dir_index *, dir_index *);
+static dir_index *lock_target(vfs_image *, int, dir_index *, dir_index *);
+static void unlock_target(vfs_image *, dir_index *, dir_index *, dir_index *);
+
+// defragmentation functions
+static void gate_enter(vfs_image *);
+static void gate_leave(vfs_image *);
+static void gate_close(vfs_image *);
+static void gate_open(vfs_image *);
+static void layout_scan(vfs_image *, layout *);
+static int layout_add(vfs_image *, layout *, char, int, int, int);
+static double layout_score(vfs_image *, layout *);
+static int layout_target(vfs_image *, layout *, int, int, int);
+static int layout_in_place(vfs_image *, int, int, int);
+static dir_index *layout_lock(vfs_image *, layout *, int);
+static int move_chain(vfs_image *, layout *, int, int, int, int);
+static int alloc_outside(vfs_image *, int, int, int);
+static void copy_chain(vfs_image *, int, int, int);
+static void free_layout(layout *);
+
+// consistency check functions
+static void *fsck_walk_run(void *);
+static void fsck_check_dir(fsck_state *, fsck_dir *);
+static void *fsck_files_run(void *);
+static void fsck_check_file(fsck_state *, fsck_file *, int);
+static int fsck_chain(fsck_state *, int, int, int, int **, int *);
+static int fsck_sparse_table(vfs_image *, int, int, int **);
+static void fsck_trim_runs(vfs_image *, int *, int);
+static int fsck_frame_table(vfs_image *, int, int, int **, int *);
+static int fsck_trim_frames(vfs_image *, int *, int);
+static int fsck_claim(fsck_state *, int);
+static int fsck_valid_block(vfs_image *, int);
+static int fsck_valid_name(dir_entry *);
+static const char *fsck_problem(int);
+static int fsck_name_cmp(const void *, const void *);
+static int fsck_file_cmp(const void *, const void *);
+static int fsck_pos_cmp(const void *, const void *);
+static void fsck_add_dir(fsck_state *, fsck_dir *, dir_entry *);
+static char *fsck_path(const char *, const char *);
+static void fsck_remove(fsck_state *, fsck_dir *, int);
+static void fsck_report(fsck_state *, fsck_dir *, const char *, const char *, int);
+static void fsck_shares(fsck_state *, int *, int);
+static void fsck_compact(fsck_state *, fsck_dir *);
+static void fsck_blocks(fsck_state *);
+static void fsck_run(fsck_state *, void *(*)(void *), int);
+
+// path resolution functions
+static int path_step(vfs_image *, dir_index **, const char *);
+static int resolve_path(vfs_t *, const char *, dir_index **, char *);
+static int resolve_dir(vfs_t *, const char *, dir_index **);
+
+// directory manipulation functions (called with the current directory locked, see the functions of the API)
+static int do_list(vfs_t *, dir_index *, int, vfs_entry_t *, int, int *);
+static int do_stat(vfs_t *, dir_index *, const char *, vfs_entry_t *);
+static int do_mkdir(vfs_t *, dir_index *, const char *, int);
+static int do_cd(vfs_t *, const char *);
+static int do_pwd(vfs_t *, char *, size_t);
+static int do_rmdir(vfs_t *, dir_index *, const char *);
+
+// file manipulation functions (called with the current directory locked, see the functions of the API)
+static int do_get(vfs_t *, const char *, dir_index *, const char *, int);
+static int do_get_tree(vfs_t *, const char *, const char *, int, int, vfs_error_fn, void *);
+static int do_put(vfs_t *, dir_index *, const char *, const char *);
+static int do_read(vfs_t *, dir_index *, const char *, int, char *, int, int *);
+static int do_cat(vfs_t *, dir_index *, const char *, int, int, int);
+static int do_cp(vfs_t *, dir_index *, const char *, dir_index *, const char *);
+static int cp_chain(vfs_image *, dir_index *, const char *, int, int, int);
+static int take_chain_copy(vfs_image *, int, int, int, int);
+static int do_mv(vfs_t *, dir_index *, const char *, dir_index *, const char *);
+static int is_subdir(vfs_image *, int, int);
+static int do_rm(vfs_t *, dir_index *, const char *);
+
+// image maintenance functions (called with the operations that change the image stopped, see the functions of the API)
+static int do_defrag(vfs_t *, int, vfs_defrag_t *);
+static int do_fsck(vfs_image *, int, int, vfs_fsck_fn, void *, vfs_fsck_t *);
+static int do_resize(vfs_image *, int);
+static int resize_shares(vfs_image *, int);
+static void move_fat(vfs_image *, long, int);
+static int map_image(vfs_image *, long);
+static long image_end(long, long, int, int);
+static int open_image(const char *, int, vfs_image **);
+static int close_image(vfs_image *);
+
+static void init_superblock(vfs_image *fs, int block_size, int fat_type, int flags) {
+  fs->sb->check_number = CHECK_NUMBER;
+  fs->sb->block_size = block_size;
+  fs->sb->fat_type = fat_type;
+  fs->sb->root_block = 0;
+  fs->sb->free_block = 1;
+  fs->sb->n_free_blocks = FAT_ENTRIES(fat_type) - 1;
+  fs->sb->version = FS_VERSION;
+  fs->sb->n_blocks = FAT_ENTRIES(fat_type);
+  fs->sb->high_water = 1;
+  fs->sb->dir_flags = flags & DIR_SORTED;
+  return;
+}
+
+
+static void init_fat(vfs_image *fs) {
+  // the entries above the high water mark are never read, and the new file is already zeroed (FAT_FREE)
+  fs->fat[0] = -1;
+  return;
+}
+
+
+static void init_block_map(vfs_image *fs) {
+  int i, block;
+
+  // older filesystems keep the free blocks in a list linked through the FAT
+  if (fs->sb->version == 0) {
+    for (i = 0, block = fs->sb->free_block; i < fs->sb->n_free_blocks; i++) {
+      int next_block = fs->fat[block];
+      fs->fat[block] = FAT_FREE;
+      block = next_block;
+    }
+    fs->sb->free_block = 1;
+    fs->sb->version = FS_VERSION;
+    mark_dirty(fs, fs->fat, FAT_SIZE(N_BLOCKS));
+  }
+
+  // older filesystems initialized every FAT entry
+  if (fs->sb->high_water == 0)
+    fs->sb->high_water = N_BLOCKS;
+
+  // the count of free blocks is not journaled, nor are the blocks reserved and not linked yet
+  fs->block_map = (unsigned long *) calloc((N_BLOCKS + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+  fs->sb->n_free_blocks = N_BLOCKS;
+  for (i = 0; i < fs->sb->high_water; i++)
+    if (fs->fat[i] != FAT_FREE) {
+      fs->block_map[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+      fs->sb->n_free_blocks--;
+    }
+  return;
+}
+
+
+static void init_dir_block(vfs_image *fs, int block, int parent_block, int flags) {
+  dir_entry *dir = (dir_entry *) BLOCK(block);
+  // the number of entries in the directory (initially 2) is saved in the size field of the entry "."
+  // and its flags in the one of the entry ".." (the free slots of a sorted directory are zeroed)
+  memset(dir, 0, fs->sb->block_size);
+  init_dir_entry(&dir[0], TYPE_DIR, ".", 2, block);
+  init_dir_entry(&dir[1], TYPE_DIR, "..", flags & DIR_SORTED, parent_block);
+  mark_dirty(fs, dir, fs->sb->block_size);
+  return;
+}
+
+
+static void init_dir_entry(dir_entry *dir, char type, const char *name, int size, int first_block) {
+  time_t cur_time = time(NULL);
+  struct tm cur_tm;
+
+  localtime_r(&cur_time, &cur_tm);
+  dir->type = type;
+  strcpy(dir->name, name);
+  dir->day = cur_tm.tm_mday;
+  dir->month = cur_tm.tm_mon + 1;
+  dir->year = cur_tm.tm_year;
+  dir->size = size;
+  dir->first_block = first_block;
+  return;
+}
+
+static int get_free_block(vfs_image *fs){
+  pthread_mutex_lock(&fs->alloc_lock);
+  int block = alloc_chain(fs, 1, fs->sb->free_block);
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  return block;
+}
+
+static void free_block(vfs_image *fs, int block){
+  pthread_mutex_lock(&fs->alloc_lock);
+  free_run(fs, block, 1);
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  return;
+}
+
+//return a run of contiguous blocks to the free space (called with alloc_lock held, as the other allocation functions)
+static void free_run(vfs_image *fs, int start, int length){
+  if(!txn.logged) {
+    journal_run(fs, start, length);
+    journal_sync(fs);
+  }
+  memset(&fs->fat[start], FAT_FREE, length * sizeof(int));
+  mark_dirty(fs, &fs->fat[start], length * sizeof(int));
+
+  // in a transaction the blocks can only be taken after its commit, by transactions that commit after it
+  if(txn.fs == fs) {
+    if(txn.n_freed == txn.max_freed) {
+      txn.max_freed = txn.max_freed ? txn.max_freed * 2 : 8;
+      txn.freed = (extent *)realloc(txn.freed, txn.max_freed * sizeof(extent));
+    }
+    txn.freed[txn.n_freed++] = (extent){ .start = start, .length = length };
+  }
+  else
+    unreserve_run(fs, start, length);
+
+  return;
+}
+
+//return a run of reserved blocks, whose FAT entries are still free, to the free space
+static void unreserve_run(vfs_image *fs, int start, int length){
+  set_bits(fs, start, length, 0);
+  fs->sb->n_free_blocks += length;
+
+  return;
+}
+
+//set the bits of the blocks [start, start + length) in the block map to used
+static void set_bits(vfs_image *fs, int start, int length, int used){
+  int i = start, end = start + length;
+
+  for(; i < end && i % BITS_PER_WORD != 0; i++)
+    if(used)
+      fs->block_map[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+    else
+      fs->block_map[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+
+  for(; i + (int)BITS_PER_WORD <= end; i += BITS_PER_WORD)
+    fs->block_map[i / BITS_PER_WORD] = used ? ~0UL : 0UL;
+
+  for(; i < end; i++)
+    if(used)
+      fs->block_map[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+    else
+      fs->block_map[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+
+  return;
+}
+
+//first block in [from, to) whose bit in the block map is equal to used (to if there is none)
+static int find_bit(vfs_image *fs, int from, int to, int used){
+  int i = from;
+
+  while(i < to) {
+    unsigned long word = fs->block_map[i / BITS_PER_WORD];
+    if(!used)
+      word = ~word;
+    word &= ~0UL << (i % BITS_PER_WORD);
+
+    if(word != 0) {
+      i = i - i % BITS_PER_WORD + __builtin_ctzl(word);
+      return i < to ? i : to;
+    }
+
+    i = i - i % BITS_PER_WORD + BITS_PER_WORD;
+  }
+
+  return to;
+}
+
+//allocate a run of up to want free blocks as a chain of its own (see reserve_run, returns its length)
+static int alloc_run(vfs_image *fs, int want, int hint, int *start){
+  int length = reserve_run(fs, want, hint, start);
+
+  if(length > 0) {
+    journal_free_runs(fs, &(extent){ .start = *start, .length = length }, 1);
+    link_run(fs, *start, length);
+  }
+
+  return length;
+}
+
+//link the FAT entries of a run of reserved blocks into a chain (logged by the caller, see journal_free_runs)
+static void link_run(vfs_image *fs, int start, int length){
+  for(int i = start; i < start + length - 1; i++)
+    fs->fat[i] = i + 1;
+  fs->fat[start + length - 1] = -1;
+  mark_dirty(fs, &fs->fat[start], length * sizeof(int));
+
+  return;
+}
+
+//reserve a run of up to want free blocks in the block map, starting as close after hint as possible
+//the first run with want blocks is taken, otherwise the longest one (returns its length)
+static int reserve_run(vfs_image *fs, int want, int hint, int *start){
+  int best_start = -1, best_len, run_start, run_len;
+
+  if(hint <= 0 || hint >= N_BLOCKS)
+    hint = 1;
+
+  best_len = find_run(fs, want, hint, N_BLOCKS, &best_start);
+  if(best_len < want && (run_len = find_run(fs, want, 1, hint, &run_start)) > best_len) {
+    best_start = run_start;
+    best_len = run_len;
+  }
+
+  if(best_len == 0)
+    return 0;
+
+  take_run(fs, best_start, best_len);
+
+  *start = best_start;
+  return best_len;
+}
+
+//first run of want free blocks in [from, to), otherwise the longest one (returns its length, 0 if there is none)
+static int find_run(vfs_image *fs, int want, int from, int to, int *start){
+  int best_len = 0;
+
+  while(from < to) {
+    int run_start = find_bit(fs, from, to, 0);
+    if(run_start == to)
+      break;
+
+    int limit = run_start + want < to ? run_start + want : to;
+    int run_end = find_bit(fs, run_start, limit, 1);
+
+    if(run_end - run_start > best_len) {
+      *start = run_start;
+      best_len = run_end - run_start;
+      if(best_len == want)
+        break;
+    }
+
+    from = find_bit(fs, run_end, to, 0);
+  }
+
+  return best_len;
+}
+
+//take the free blocks [start, start + length) from the free space (reserved, with their FAT entries still free)
+static void take_run(vfs_image *fs, int start, int length){
+  set_bits(fs, start, length, 1);
+
+  fs->sb->n_free_blocks -= length;
+  fs->sb->free_block = start + length;
+  if(fs->sb->high_water < fs->sb->free_block)
+    fs->sb->high_water = fs->sb->free_block;
+
+  return;
+}
+
+//allocate a chain of n blocks, as contiguous as possible and near hint (returns its first block or -1)
+static int alloc_chain(vfs_image *fs, int n, int hint){
+  int n_runs = 0, max_runs = 0, start;
+  extent *runs = NULL;
+
+  if(n > fs->sb->n_free_blocks)
+    return -1;
+
+  // the runs are only reserved until the journal has room for their records
+  while(n > 0) {
+    int len = reserve_run(fs, n, hint, &start);
+
+    if(n_runs == max_runs) {
+      max_runs = max_runs ? max_runs * 2 : 8;
+      runs = (extent *)realloc(runs, max_runs * sizeof(extent));
+    }
+    runs[n_runs++] = (extent){ .start = start, .length = len };
+    hint = start + len;
+    n -= len;
+  }
+
+  int first_block = link_runs(fs, runs, n_runs);
+  free(runs);
+
+  return first_block;
+}
+
+//link runs of reserved blocks into a chain, in order (returns its first block, or -1 if the journal has no room
+//for their records, and the runs are returned to the free space)
+static int link_runs(vfs_image *fs, extent *runs, int n_runs){
+  if(txn_reserve(fs, (long)n_runs * sizeof(journal_record)) == -1) {
+    for(int i = 0; i < n_runs; i++)
+      unreserve_run(fs, runs[i].start, runs[i].length);
+    return -1;
+  }
+
+  // the link from a run to the next one is in the run, whose record frees it if the transaction is rolled back
+  journal_free_runs(fs, runs, n_runs);
+  for(int i = 0; i < n_runs; i++) {
+    link_run(fs, runs[i].start, runs[i].length);
+    if(i > 0)
+      fs->fat[runs[i - 1].start + runs[i - 1].length - 1] = runs[i].start;
+  }
+
+  return n_runs > 0 ? runs[0].start : -1;
+}
+
+//return all the blocks of a chain to the free space
+static void free_chain(vfs_image *fs, int block){
+  extent_map *map = get_extent_map(fs, block, 0);
+  int logged = txn.logged;
+
+  // the records of the runs reach the disk together, before the first one is freed
+  // (the map of a sparse file, when there is one, has the blocks of its table too)
+  if(!logged) {
+    for(int i = 0; i < map->n_extents; i++)
+      journal_run(fs, map->extents[i].start, map->extents[i].length);
+    journal_sync(fs);
+  }
+  txn.logged = 1;
+  for(int i = 0; i < map->n_extents; i++)
+    free_run(fs, map->extents[i].start, map->extents[i].length);
+  txn.logged = logged;
+
+  drop_extent_map(fs, block);
+
+  return;
+}
+
+//return the blocks of a chain taken by the transaction of the calling thread to the free space (as free_chain),
+//without records: the ones of its runs free them if the transaction is rolled back
+static void free_own_chain(vfs_image *fs, int block){
+  txn.logged = 1;
+  free_chain(fs, block);
+  txn.logged = 0;
+
+  return;
+}
+
+//reserve room in the journal for the records of release_chain (returns -1 if there is none)
+static int reserve_release(vfs_image *fs, int first_block){
+  if(txn.fs != fs)
+    return 0;
+
+  return txn_reserve(fs, (long)get_extent_map(fs, first_block, 0)->n_extents * sizeof(journal_record));
+}
+
+//drop one reference to the chain starting at first_block, freeing it with the last one
+//(the caller reserved the room of its records in the journal, see reserve_release)
+static void release_chain(vfs_image *fs, int first_block){
+  pthread_mutex_lock(&fs->alloc_lock);
+  unsigned short *shares = block_shares(fs, first_block, 0);
+
+  if(shares != NULL && *shares > 0) {
+    journal_share(fs, first_block, -1);
+    (*shares)--;
+    mark_dirty(fs, shares, sizeof(unsigned short));
+  }
+  else
+    free_chain(fs, first_block);
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  return;
+}
+
+//number of extra references to the chain starting at block (copies made by cp)
+//the table is kept in a chain of its own, created when create is set (NULL if it doesn't exist)
+static unsigned short *block_shares(vfs_image *fs, int block, int create){
+  if(fs->sb->share_table == 0) {
+    int n_blocks = ((long)N_BLOCKS * sizeof(unsigned short) + fs->sb->block_size - 1) / fs->sb->block_size;
+
+    // keeps a block for the directory entry of the copy
+    if(!create || n_blocks + 1 > fs->sb->n_free_blocks)
+      return NULL;
+
+    // the table is not part of the transaction, so that it stays if the transaction is rolled back
+    journal_txn saved = txn;
+    txn.fs = NULL;
+
+    int old_high_water = fs->sb->high_water;
+    int first_block = alloc_chain(fs, n_blocks, old_high_water);
+    extent_map *map = get_extent_map(fs, first_block, 0);
+
+    // the blocks above the old high water mark were never written, the others must be cleared
+    for(int i = 0; i < map->n_extents; i++) {
+      extent *run = &map->extents[i];
+      if(run->start < old_high_water)
+        memset(BLOCK(run->start), 0, (long)(run->start + run->length < old_high_water ? run->length : old_high_water - run->start) * fs->sb->block_size);
+      mark_dirty(fs, BLOCK(run->start), (long)run->length * fs->sb->block_size);
+    }
+
+    fs->sb->share_table = first_block;
+    txn = saved;
+  }
+
+  int n;
+  return (unsigned short *)file_run(fs, get_extent_map(fs, fs->sb->share_table, 0), block * sizeof(unsigned short), &n);
+}
+
+//create the journal of the image (if it has none), in a run of contiguous blocks of its own
+static int journal_create(vfs_image *fs){
+  long want = N_BLOCKS / 64;
+  int start, length = 0;
+
+  if(want < JOURNAL_MIN_BLOCKS)
+    want = JOURNAL_MIN_BLOCKS;
+  if(want > JOURNAL_MAX_BYTES / fs->sb->block_size)
+    want = JOURNAL_MAX_BYTES / fs->sb->block_size;
+
+  // the blocks are taken before jnl.lock, which is taken with alloc_lock held by the transactions
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(fs->sb->journal_block > 0)
+    length = fs->sb->journal_blocks;
+  else if(want < fs->sb->n_free_blocks && (length = alloc_run(fs, want, fs->sb->high_water, &start)) < want && length > 0) {
+    free_run(fs, start, length);
+    length = 0;
+  }
+  else if(length > 0) {
+    fs->sb->journal_block = start;
+    fs->sb->journal_blocks = length;
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  if(length == 0)
+    return VFS_ENOSPC;
+
+  // the old contents of the blocks could be taken for records
+  pthread_mutex_lock(&fs->jnl.lock);
+  if(fs->jnl.header == NULL || fs->jnl.header->magic != JOURNAL_MAGIC) {
+    memset(BLOCK(fs->sb->journal_block), 0, (long)fs->sb->journal_blocks * fs->sb->block_size);
+    journal_open(fs);
+    fs->jnl.header->magic = JOURNAL_MAGIC;
+    fs->jnl.header->epoch = 1;
+    msync(fs->sb, fs->size, MS_SYNC);
+  }
+  pthread_mutex_unlock(&fs->jnl.lock);
+
+  return VFS_OK;
+}
+
+//find the journal of the image (if it has one) and roll back the transactions not covered by its last flush
+static void journal_open(vfs_image *fs){
+  journal *jnl = &fs->jnl;
+
+  if(fs->sb->journal_block <= 0 || fs->sb->journal_blocks <= 0 || (long)fs->sb->journal_block + fs->sb->journal_blocks > N_BLOCKS)
+    return;
+
+  jnl->header = (journal_header *)BLOCK(fs->sb->journal_block);
+  jnl->size = (long)fs->sb->journal_blocks * fs->sb->block_size;
+  jnl->head = jnl->synced = sizeof(journal_header);
+  jnl->n_commits = jnl->flushed = 0;
+
+  if(jnl->header->magic == JOURNAL_MAGIC)
+    journal_replay(fs);
+
+  return;
+}
+
+static void journal_replay(vfs_image *fs){
+  journal *jnl = &fs->jnl;
+  journal_header *header = jnl->header;
+  int_map kept = { 0 }, rolled_back = { 0 }, shared = { 0 };
+  long pos, *undo = NULL;
+  int n_undo = 0, max_undo = 0;
+
+  // the records of the current epoch are the ones written since the journal was last emptied
+  for(int pass = 0; pass < 2; pass++)
+    for(pos = sizeof(journal_header); pos + (long)sizeof(journal_record) <= jnl->size; ) {
+      journal_record *rec = (journal_record *)((char *)header + pos);
+
+      if(rec->epoch != header->epoch || rec->len < 0 || pos + JREC_SIZE(rec) > jnl->size || rec->check != journal_check(rec))
+        break;
+
+      // the transactions whose commit was flushed are kept, the changes of the others are undone
+      if(pass == 0 && rec->type == JREC_COMMIT && rec->arg <= header->flushed)
+        int_map_put(&kept, rec->txn, rec);
+      else if(pass == 1 && rec->type != JREC_COMMIT && int_map_get(&kept, rec->txn) == NULL) {
+        if(n_undo == max_undo) {
+          max_undo = max_undo ? max_undo * 2 : 64;
+          undo = (long *)realloc(undo, max_undo * sizeof(long));
+        }
+        undo[n_undo++] = pos;
+        int_map_put(&rolled_back, rec->txn, rec);
+        if(rec->type == JREC_SHARE && rec->offset >= 0 && rec->offset < N_BLOCKS)
+          int_map_put(&shared, rec->offset, rec);
+      }
+
+      pos += JREC_SIZE(rec);
+    }
+
+  for(int i = n_undo - 1; i >= 0; i--)
+    journal_undo(fs, (journal_record *)((char *)header + undo[i]));
+  if(shared.count > 0)
+    journal_recount(fs, &shared);
+  jnl->n_rolled_back = rolled_back.count;
+
+  // the journal is emptied once the image is as it was at the last flush
+  if(n_undo > 0)
+    msync(fs->sb, fs->size, MS_SYNC);
+  header->epoch++;
+  header->flushed = 0;
+  msync_range(fs, header, sizeof(journal_header));
+
+  free(undo);
+  free(kept.keys);
+  free(kept.values);
+  free(rolled_back.keys);
+  free(rolled_back.values);
+  free(shared.keys);
+  free(shared.values);
+
+  return;
+}
+
+//restore what a record describes
+static void journal_undo(vfs_image *fs, journal_record *rec){
+  switch(rec->type) {
+    case JREC_BYTES:
+      if(rec->offset >= 0 && rec->offset + rec->len <= fs->size)
+        memcpy((char *)fs->sb + rec->offset, rec + 1, rec->len);
+      break;
+    case JREC_FREE:
+      memset(&fs->fat[rec->offset], FAT_FREE, (long)rec->len * sizeof(int));
+      break;
+    case JREC_RUN:
+      for(long i = rec->offset; i < rec->offset + rec->len - 1; i++)
+        fs->fat[i] = i + 1;
+      fs->fat[rec->offset + rec->len - 1] = rec->arg;
+      break;
+  }
+
+  return;
+}
+
+//count again the copies of the chains starting at the keys of shared, whose counts were changed by the transactions
+//rolled back: a change is logged before it is made, and the transaction may have ended between the two (so undoing
+//the change could take it from a count it never reached), and the old count may have been changed since by a
+//transaction that was kept (so it can't be restored either); the directories are read as the undo left them
+static void journal_recount(vfs_image *fs, int_map *shared){
+  int *refs = (int *)calloc(shared->capacity, sizeof(int));
+  int_map seen = { 0 };
+  int n_dirs = 0, max_dirs = 64;
+  int *dirs = (int *)malloc(max_dirs * sizeof(int));
+
+  for(int i = 0; i < shared->capacity; i++)
+    if(shared->keys[i] != -1)
+      shared->values[i] = &refs[i];
+
+  dirs[n_dirs++] = fs->sb->root_block;
+  int_map_put(&seen, fs->sb->root_block, dirs);
+  while(n_dirs > 0) {
+    int dir_block = dirs[--n_dirs], *n;
+    int n_entries = ((dir_entry *)BLOCK(dir_block))[0].size, sorted = ((dir_entry *)BLOCK(dir_block))[1].size & DIR_SORTED;
+    long pos = 0;
+
+    // the entries of a sorted directory are packed at the start of each block, the others fill its blocks in order
+    // (a chain that loops ends after as many blocks as the image has)
+    for(int b = dir_block, n_blocks = 0; b >= 0 && b < N_BLOCKS && n_blocks < N_BLOCKS && (sorted || pos < n_entries); b = fs->fat[b], n_blocks++) {
+      dir_entry *entries = (dir_entry *)BLOCK(b);
+
+      for(int i = b == dir_block ? 2 : 0; i < DIR_ENTRIES_PER_BLOCK && (sorted ? entries[i].type != 0 : pos + i < n_entries); i++) {
+        int first_block = entries[i].first_block;
+
+        if(entries[i].type == TYPE_FILE && (n = (int *)int_map_get(shared, first_block)) != NULL)
+          (*n)++;
+        else if(entries[i].type == TYPE_DIR && first_block > 0 && first_block < N_BLOCKS && int_map_get(&seen, first_block) == NULL) {
+          if(n_dirs == max_dirs) {
+            max_dirs *= 2;
+            dirs = (int *)realloc(dirs, max_dirs * sizeof(int));
+          }
+          dirs[n_dirs++] = first_block;
+          int_map_put(&seen, first_block, dirs);
+        }
+      }
+      pos += DIR_ENTRIES_PER_BLOCK;
+    }
+  }
+
+  // as fsck counts them, the copies of a chain are the entries that start at it but one
+  for(int i = 0; i < shared->capacity; i++) {
+    unsigned short *shares;
+    if(shared->keys[i] != -1 && (shares = block_shares(fs, shared->keys[i], 0)) != NULL)
+      *shares = refs[i] > USHRT_MAX ? USHRT_MAX : refs[i] > 0 ? refs[i] - 1 : 0;
+  }
+
+  free(refs);
+  free(dirs);
+  free(seen.keys);
+  free(seen.values);
+
+  return;
+}
+
+//hash of a record (FNV-1a, as name_hash), from its type to its arg and then its bytes
+static unsigned int journal_check(journal_record *rec){
+  const unsigned char *fields = (const unsigned char *)&rec->type, *bytes = (const unsigned char *)(rec + 1);
+  long n_fields = (const unsigned char *)&rec->check - fields, n_bytes = rec->type == JREC_BYTES ? rec->len : 0;
+  unsigned int hash = 2166136261u;
+
+  for(long i = 0; i < n_fields + n_bytes; i++) {
+    hash ^= i < n_fields ? fields[i] : bytes[i - n_fields];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+//write a record for the transaction of the calling thread, in the room it reserved
+//(every change reserves the room of its records before it is made, see txn_start and txn_reserve)
+static void journal_append(vfs_image *fs, int type, long offset, int len, long arg, const void *data){
+  journal *jnl = &fs->jnl;
+  long size = sizeof(journal_record) + (type == JREC_BYTES ? (len + 7) & ~7 : 0);
+
+  if(txn.fs != fs)
+    return;
+
+  pthread_mutex_lock(&jnl->lock);
+  long used = size < txn.reserved ? size : txn.reserved;
+  txn.reserved -= used;
+  jnl->reserved -= used;
+  if(jnl->head + size > jnl->size) {
+    pthread_mutex_unlock(&jnl->lock);
+    return;
+  }
+
+  journal_record *rec = (journal_record *)((char *)jnl->header + jnl->head);
+  rec->type = type;
+  rec->txn = txn.id;
+  rec->len = len;
+  rec->offset = offset;
+  rec->arg = type == JREC_COMMIT ? ++jnl->n_commits : arg;
+  if(type == JREC_BYTES)
+    memcpy(rec + 1, data, len);
+  rec->check = journal_check(rec);
+  __sync_synchronize();
+  rec->epoch = jnl->header->epoch;
+
+  jnl->head += size;
+  txn.n_records++;
+  if(type == JREC_COMMIT)
+    txn.commit = rec->arg;
+  pthread_mutex_unlock(&jnl->lock);
+
+  return;
+}
+
+//log the old contents of a range of the image, before it is changed (the caller notes it dirty once changed)
+static void journal_bytes(vfs_image *fs, void *addr, long len){
+  if(txn.fs == fs) {
+    journal_append(fs, JREC_BYTES, (char *)addr - (char *)fs->sb, len, 0, addr);
+    journal_sync(fs);
+  }
+
+  return;
+}
+
+//log that the FAT entries of runs were free, before they are linked
+static void journal_free_runs(vfs_image *fs, extent *runs, int n_runs){
+  if(txn.fs != fs)
+    return;
+
+  for(int i = 0; i < n_runs; i++)
+    journal_append(fs, JREC_FREE, runs[i].start, runs[i].length, 0, NULL);
+  journal_sync(fs);
+
+  return;
+}
+
+//log the FAT entries of a run, before it is freed (as the last entry if the run was linked in order)
+//(the caller writes the record to the disk, see journal_sync)
+static void journal_run(vfs_image *fs, int start, int length){
+  int i = start;
+
+  if(txn.fs != fs)
+    return;
+
+  while(i < start + length - 1 && fs->fat[i] == i + 1)
+    i++;
+
+  if(i == start + length - 1)
+    journal_append(fs, JREC_RUN, start, length, fs->fat[i], NULL);
+  else
+    journal_append(fs, JREC_BYTES, (char *)&fs->fat[start] - (char *)fs->sb, length * sizeof(int), 0, &fs->fat[start]);
+
+  return;
+}
+
+//log a change of the number of copies of the chain starting at block
+static void journal_share(vfs_image *fs, int block, int change){
+  if(txn.fs == fs) {
+    journal_append(fs, JREC_SHARE, block, 0, change, NULL);
+    journal_sync(fs);
+  }
+
+  return;
+}
+
+//write the records of the journal that are not on the disk yet, before the changes they log are made (the kernel
+//can write a changed page of the mapping back at any time, and the change could not be undone without its record)
+//the records written by other transactions until then go along, so the transactions that log together share it
+static void journal_sync(vfs_image *fs){
+  journal *jnl = &fs->jnl;
+
+  if(txn.fs != fs)
+    return;
+
+  pthread_mutex_lock(&jnl->lock);
+  long synced = jnl->synced, head = jnl->head;
+  pthread_mutex_unlock(&jnl->lock);
+  if(head <= synced)
+    return;
+
+  msync_range(fs, (char *)jnl->header + synced, head - synced);
+  pthread_mutex_lock(&jnl->lock);
+  if(jnl->synced < head)
+    jnl->synced = head;
+  pthread_mutex_unlock(&jnl->lock);
+
+  return;
+}
+
+//write the records (the commits), then the image, then the number of the last commit they cover
+static void journal_flush(vfs_image *fs, long upto){
+  journal *jnl = &fs->jnl;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  journal_sync(fs);
+  flush_dirty(fs);
+  jnl->header->flushed = upto;
+  msync_range(fs, jnl->header, sizeof(journal_header));
+  note_flush(fs, &start);
+
+  return;
+}
+
+//write the pages of a range of the mapping to the disk
+static void msync_range(vfs_image *fs, void *addr, long len){
+  char *start = (char *)((unsigned long)addr & ~(fs->page_size - 1));
+  msync(start, (char *)addr + len - start, MS_SYNC);
+
+  return;
+}
+
+//start a transaction for the calling thread (before it takes any lock), once defrag is not moving blocks
+static void txn_begin(vfs_image *fs){
+  gate_enter(fs);
+  txn_start(fs);
+
+  return;
+}
+
+//start the transaction of the calling thread in the journal (defrag starts one for each chain it moves)
+//the journal is emptied when no transaction is in progress, and the new ones wait for that once it is half full
+//(or without room for the records of their directories, kept here since the transaction holds no lock yet)
+static void txn_start(vfs_image *fs){
+  journal *jnl = &fs->jnl;
+
+  if(__atomic_load_n(&jnl->mode, __ATOMIC_RELAXED) == VFS_JOURNAL_OFF)
+    return;
+
+  pthread_mutex_lock(&jnl->lock);
+  while(jnl->n_active > 0 && (jnl->head > jnl->size / 2 || jnl->head + jnl->reserved + TXN_RESERVE(fs) > jnl->size))
+    pthread_cond_wait(&jnl->cond, &jnl->lock);
+
+  if(jnl->mode != VFS_JOURNAL_OFF) {
+    // (the new epoch is on disk before the records that overwrite the ones of the old one)
+    if(jnl->n_active == 0 && jnl->head > (long)sizeof(journal_header)) {
+      jnl->header->epoch++;
+      msync_range(fs, jnl->header, sizeof(journal_header));
+      jnl->head = jnl->synced = sizeof(journal_header);
+    }
+    jnl->n_active++;
+    txn.fs = fs;
+    txn.id = ++jnl->next_txn;
+    txn.n_records = txn.logged = 0;
+    txn.commit = 0;
+    txn.n_freed = 0;
+    txn.reserved = TXN_RESERVE(fs);
+    jnl->reserved += txn.reserved;
+  }
+  pthread_mutex_unlock(&jnl->lock);
+
+  return;
+}
+
+//reserve room in the journal for len more bytes of records of the transaction of the calling thread, before
+//the changes they log are made: it holds locks, so it doesn't wait, and the operation fails (returns -1) without
+//changing anything if there is no room, instead of making changes that could not be rolled back
+static int txn_reserve(vfs_image *fs, long len){
+  journal *jnl = &fs->jnl;
+  int status = 0;
+
+  if(txn.fs != fs || len <= 0)
+    return 0;
+
+  pthread_mutex_lock(&jnl->lock);
+  if(jnl->head + jnl->reserved + len > jnl->size) {
+    jnl->n_overflows++;
+    status = -1;
+  }
+  else {
+    txn.reserved += len;
+    jnl->reserved += len;
+  }
+  pthread_mutex_unlock(&jnl->lock);
+
+  return status;
+}
+
+//commit the transaction of the calling thread (while it still holds the locks of what it changed)
+static void txn_commit(vfs_image *fs){
+  if(txn.fs != fs)
+    return;
+
+  if(txn.n_records > 0 && txn.commit == 0)
+    journal_append(fs, JREC_COMMIT, 0, 0, 0, NULL);
+
+  if(txn.n_freed > 0) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    for(int i = 0; i < txn.n_freed; i++)
+      unreserve_run(fs, txn.freed[i].start, txn.freed[i].length);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    txn.n_freed = 0;
+  }
+
+  return;
+}
+
+//end the transaction of the calling thread (after it released its locks)
+static void txn_end(vfs_image *fs){
+  txn_finish(fs);
+  gate_leave(fs);
+
+  return;
+}
+
+//end the transaction of the calling thread once its commit is on disk
+//with VFS_JOURNAL_OP every commit is flushed by its own transaction, with VFS_JOURNAL_GROUP by the first one
+//that finds no flush in progress, for all the commits written until then
+static void txn_finish(vfs_image *fs){
+  journal *jnl = &fs->jnl;
+
+  sync_end(fs);
+  if(txn.fs != fs)
+    return;
+
+  pthread_mutex_lock(&jnl->lock);
+  if(txn.commit > 0) {
+    int done = 0;
+
+    while(!done && (jnl->mode == VFS_JOURNAL_OP || jnl->flushed < txn.commit)) {
+      if(jnl->flushing) {
+        pthread_cond_wait(&jnl->cond, &jnl->lock);
+        continue;
+      }
+
+      long upto = jnl->n_commits;
+      jnl->flushing = 1;
+      pthread_mutex_unlock(&jnl->lock);
+      journal_flush(fs, upto);
+      pthread_mutex_lock(&jnl->lock);
+
+      jnl->flushing = 0;
+      if(jnl->flushed < upto)
+        jnl->flushed = upto;
+      done = 1;
+      pthread_cond_broadcast(&jnl->cond);
+    }
+  }
+
+  // the room reserved and not used is returned
+  jnl->reserved -= txn.reserved;
+  jnl->n_active--;
+  if(jnl->n_active == 0 || txn.reserved > 0)
+    pthread_cond_broadcast(&jnl->cond);
+  pthread_mutex_unlock(&jnl->lock);
+
+  free(txn.freed);
+  txn = (journal_txn){ 0 };
+
+  return;
+}
+
+//note that a range of the mapping has changed, so that it is written by the next flush (called after the change: a
+//flush clears the marks before it writes the pages, so a mark taken before the change could be cleared without it)
+static void mark_dirty(vfs_image *fs, void *addr, long len){
+  if(fs->dirty_pages == NULL || len <= 0)
+    return;
+
+  // the change is seen by the flushes before the mark is (and before it is found set, and left to them)
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long first = ((char *)addr - (char *)fs->sb) / fs->page_size;
+  long last = ((char *)addr + len - 1 - (char *)fs->sb) / fs->page_size;
+
+  for(long page = first; page <= last; page++) {
+    unsigned long bit = 1UL << (page % BITS_PER_WORD);
+    if((__atomic_load_n(&fs->dirty_pages[page / BITS_PER_WORD], __ATOMIC_RELAXED) & bit) == 0)
+      __atomic_fetch_or(&fs->dirty_pages[page / BITS_PER_WORD], bit, __ATOMIC_RELAXED);
+  }
+
+  // the operations of a thread run one at a time, the list has the pages of the current one
+  if(__atomic_load_n(&fs->dur.mode, __ATOMIC_RELAXED) != VFS_DURABILITY_SYNC)
+    return;
+
+  if(dirty.fs != fs) {
+    dirty.fs = fs;
+    dirty.n_runs = 0;
+  }
+
+  page_run *prev = dirty.n_runs > 0 ? &dirty.runs[dirty.n_runs - 1] : NULL;
+  if(prev != NULL && first <= prev->last + 1 && last >= prev->first - 1) {
+    prev->first = first < prev->first ? first : prev->first;
+    prev->last = last > prev->last ? last : prev->last;
+    return;
+  }
+
+  if(dirty.n_runs == dirty.max_runs) {
+    dirty.max_runs = dirty.max_runs ? dirty.max_runs * 2 : 16;
+    dirty.runs = (page_run *)realloc(dirty.runs, dirty.max_runs * sizeof(page_run));
+  }
+  dirty.runs[dirty.n_runs++] = (page_run){ .first = first, .last = last };
+
+  return;
+}
+
+//write the pages changed since the last flush (and the superblock) to the disk, a run of pages at a time
+static int flush_dirty(vfs_image *fs){
+  pthread_mutex_lock(&fs->dur.flush_lock);
+  long n_pages = (fs->size + fs->page_size - 1) / fs->page_size;
+  long n_words = (n_pages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  long start = 0, end = 1;
+  int status = 0;
+
+  for(long w = 0; w < n_words; w++) {
+    if(__atomic_load_n(&fs->dirty_pages[w], __ATOMIC_RELAXED) == 0)
+      continue;
+
+    unsigned long word = __atomic_exchange_n(&fs->dirty_pages[w], 0UL, __ATOMIC_ACQ_REL);
+    while(word != 0) {
+      long page = w * BITS_PER_WORD + __builtin_ctzl(word);
+      word &= word - 1;
+
+      if(page > end) {
+        if(msync((char *)fs->sb + start * fs->page_size, (end - start) * fs->page_size, MS_SYNC) == -1)
+          status = -1;
+        start = page;
+      }
+      end = page + 1;
+    }
+  }
+
+  if(end > n_pages)
+    end = n_pages;
+  if(msync((char *)fs->sb + start * fs->page_size, (end - start) * fs->page_size, MS_SYNC) == -1)
+    status = -1;
+  pthread_mutex_unlock(&fs->dur.flush_lock);
+
+  return status;
+}
+
+//end of an operation that changed the image: write the pages it changed (VFS_DURABILITY_SYNC),
+//or count it for the background thread (VFS_DURABILITY_BATCH)
+static void sync_end(vfs_image *fs){
+  durability *dur = &fs->dur;
+  int mode = __atomic_load_n(&dur->mode, __ATOMIC_RELAXED);
+
+  if(mode == VFS_DURABILITY_SYNC && dirty.fs == fs) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the superblock is part of every flush, the runs are merged once they are in order
+    qsort(dirty.runs, dirty.n_runs, sizeof(page_run), page_run_cmp);
+    page_run run = { 0, 0 };
+    for(int i = 0; i <= dirty.n_runs; i++) {
+      if(i < dirty.n_runs && dirty.runs[i].first <= run.last + 1) {
+        if(dirty.runs[i].last > run.last)
+          run.last = dirty.runs[i].last;
+        continue;
+      }
+
+      msync((char *)fs->sb + run.first * fs->page_size, (run.last - run.first + 1) * fs->page_size, MS_SYNC);
+      if(i < dirty.n_runs)
+        run = dirty.runs[i];
+    }
+
+    free(dirty.runs);
+    dirty = (dirty_list){ 0 };
+    note_flush(fs, &start);
+  }
+  else if(mode == VFS_DURABILITY_BATCH) {
+    pthread_mutex_lock(&dur->lock);
+    if(++dur->n_ops >= dur->batch_ops)
+      pthread_cond_signal(&dur->cond);
+    pthread_mutex_unlock(&dur->lock);
+  }
+
+  return;
+}
+
+static int page_run_cmp(const void *a, const void *b){
+  long first_a = ((const page_run *)a)->first, first_b = ((const page_run *)b)->first;
+
+  return first_a < first_b ? -1 : first_a > first_b;
+}
+
+//background thread of VFS_DURABILITY_BATCH: a flush after batch_ops operations, or batch_ms milliseconds
+//after the previous one if there were any changes (and a last one when it is stopped)
+static void *flush_thread_run(void *arg){
+  vfs_image *fs = (vfs_image *)arg;
+  durability *dur = &fs->dur;
+
+  pthread_mutex_lock(&dur->lock);
+  while(dur->running || dur->n_ops > 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += dur->batch_ms / 1000;
+    deadline.tv_nsec += (dur->batch_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    while(dur->running && dur->n_ops < dur->batch_ops)
+      if(pthread_cond_timedwait(&dur->cond, &dur->lock, &deadline) == ETIMEDOUT)
+        break;
+
+    if(dur->n_ops == 0)
+      continue;
+
+    struct timespec start;
+    dur->n_ops = 0;
+    pthread_mutex_unlock(&dur->lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    flush_dirty(fs);
+    note_flush(fs, &start);
+    pthread_mutex_lock(&dur->lock);
+  }
+  pthread_mutex_unlock(&dur->lock);
+
+  return NULL;
+}
+
+//stop the background thread (if it is running), after its last flush
+static void stop_flush_thread(vfs_image *fs){
+  durability *dur = &fs->dur;
+
+  pthread_mutex_lock(&dur->lock);
+  int running = dur->running;
+  dur->running = 0;
+  pthread_cond_signal(&dur->cond);
+  pthread_mutex_unlock(&dur->lock);
+
+  if(running)
+    pthread_join(dur->thread, NULL);
+
+  return;
+}
+
+//count a flush that started at start
+static void note_flush(vfs_image *fs, struct timespec *start){
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long ns = (end.tv_sec - start->tv_sec) * 1000000000L + (end.tv_nsec - start->tv_nsec);
+
+  pthread_mutex_lock(&fs->dur.lock);
+  fs->dur.n_flushes++;
+  fs->dur.flush_ns += ns;
+  if(ns > fs->dur.max_flush_ns)
+    fs->dur.max_flush_ns = ns;
+  pthread_mutex_unlock(&fs->dur.lock);
+
+  return;
+}
+
+//get the extent map of the chain starting at first_block, building it on first access
+//(the chain of a file doesn't change while the directory of one of its entries is locked, so the map stays valid)
+//the blocks of a sparse file are placed by the table of its runs, and the blocks of the table at negative offsets
+//(layout is the flag of the file, FILE_SPARSE or FILE_COMPRESSED, or 0)
+static extent_map *get_extent_map(vfs_image *fs, int first_block, int layout){
+  pthread_rwlock_rdlock(&fs->extent_lock);
+  extent_map *map = (extent_map *)int_map_get(&fs->file_extents, first_block);
+  pthread_rwlock_unlock(&fs->extent_lock);
+  if(map != NULL)
+    return map;
+
+  pthread_rwlock_wrlock(&fs->extent_lock);
+  if((map = (extent_map *)int_map_get(&fs->file_extents, first_block)) != NULL) {
+    pthread_rwlock_unlock(&fs->extent_lock);
+    return map;
+  }
+
+  map = (extent_map *)malloc(sizeof(extent_map));
+  map->n_extents = 0;
+  map->max_extents = 4;
+  map->extents = (extent *)malloc(map->max_extents * sizeof(extent));
+  map->n_frames = 0;
+  map->frame_ends = NULL;
+
+  // the frame of a compressed file is at the offset of its block, after the ones of its table
+  if(layout != FILE_SPARSE) {
+    int offset = layout == FILE_COMPRESSED ? -load_frame_ends(fs, first_block, map) : 0;
+    for(int cur = first_block; cur != -1; cur = fs->fat[cur])
+      add_extent(map, cur, offset++);
+  }
+  else {
+    sparse_header *header = (sparse_header *)BLOCK(first_block);
+    int n_table = header->table_blocks > 0 ? header->table_blocks : 1, cur = first_block;
+    long max_runs = ((long)n_table * fs->sb->block_size - sizeof(sparse_header)) / sizeof(sparse_run);
+    int n_runs = header->n_runs < max_runs ? header->n_runs : max_runs;
+    int *table = (int *)malloc(n_table * sizeof(int));
+
+    for(int i = 0; i < n_table && cur != -1; i++, cur = fs->fat[cur]) {
+      table[i] = cur;
+      add_extent(map, cur, i - n_table);
+    }
+
+    for(int i = 0; i < n_runs && cur != -1; i++) {
+      long pos = sizeof(sparse_header) + (long)i * sizeof(sparse_run);
+      sparse_run *run = (sparse_run *)(BLOCK(table[pos / fs->sb->block_size]) + pos % fs->sb->block_size);
+
+      for(int k = 0; k < run->length && cur != -1; k++, cur = fs->fat[cur])
+        add_extent(map, cur, run->offset + k);
+    }
+
+    free(table);
+  }
+
+  int_map_put(&fs->file_extents, first_block, map);
+  pthread_rwlock_unlock(&fs->extent_lock);
+
+  return map;
+}
+
+//append the block at offset (in blocks) of the file to the map, in the last run if it follows it
+static void add_extent(extent_map *map, int block, int offset){
+  extent *last = &map->extents[map->n_extents - 1];
+
+  if(map->n_extents > 0 && block == last->start + last->length && offset == last->offset + last->length) {
+    last->length++;
+    return;
+  }
+
+  if(map->n_extents == map->max_extents) {
+    map->max_extents *= 2;
+    map->extents = (extent *)realloc(map->extents, map->max_extents * sizeof(extent));
+  }
+  map->extents[map->n_extents].start = block;
+  map->extents[map->n_extents].length = 1;
+  map->extents[map->n_extents].offset = offset;
+  map->n_extents++;
+
+  return;
+}
+
+//discard the extent map of a chain (when its blocks are freed)
+static void drop_extent_map(vfs_image *fs, int first_block){
+  pthread_rwlock_wrlock(&fs->extent_lock);
+  extent_map *map = (extent_map *)int_map_get(&fs->file_extents, first_block);
+  if(map != NULL)
+    int_map_del(&fs->file_extents, first_block);
+  pthread_rwlock_unlock(&fs->extent_lock);
+
+  if(map == NULL)
+    return;
+
+  free(map->extents);
+  free(map->frame_ends);
+  free(map);
+
+  return;
+}
+
+//pointer to the byte at offset of the file, n gets the number of contiguous bytes from there
+//(NULL in a hole of a sparse file, and n gets the number of bytes up to its end)
+static char *file_run(vfs_image *fs, extent_map *map, int offset, int *n){
+  int file_block = offset / fs->sb->block_size;
+  int low = 0, high = map->n_extents - 1;
+
+  // binary search for the last run starting at or before file_block
+  while(low < high) {
+    int mid = (low + high + 1) / 2;
+    if(map->extents[mid].offset <= file_block)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+
+  extent *run = &map->extents[low];
+  if(map->n_extents == 0 || file_block < run->offset || file_block >= run->offset + run->length) {
+    extent *next = map->n_extents == 0 ? NULL : file_block < run->offset ? run : low + 1 < map->n_extents ? run + 1 : NULL;
+    long hole_bytes = next == NULL ? INT_MAX : (long)next->offset * fs->sb->block_size - offset;
+
+    *n = hole_bytes > INT_MAX ? INT_MAX : hole_bytes;
+    return NULL;
+  }
+
+  long run_offset = offset - (long)run->offset * fs->sb->block_size;
+  long run_bytes = (long)run->length * fs->sb->block_size - run_offset;
+
+  *n = run_bytes > INT_MAX ? INT_MAX : run_bytes;
+  return BLOCK(run->start) + run_offset;
+}
+
+//ask the kernel to read the blocks of the file from pos up to prefetch_blocks ahead (before end), once at most half
+//of them were asked for (*ahead is the end of the ones asked for, an offset in the file, 0 at first)
+//the runs whose pages are close together are asked for at once, with the pages between them
+//(returns the distance of the prefetch in bytes, 0 if it is off)
+static long prefetch_file(vfs_image *fs, extent_map *map, int pos, int end, int *ahead){
+  long window = (long)__atomic_load_n(&fs->prefetch_blocks, __ATOMIC_RELAXED) * fs->sb->block_size;
+  int to = pos + window < end ? pos + window : end;
+  char *first = NULL, *last = NULL;
+  long n_calls = 0;
+
+  // a read within a page gets nothing from it (its fault reads the page)
+  if(window == 0 || to - pos <= fs->page_size || *ahead - pos > window / 2 || *ahead >= to)
+    return window;
+
+  for(int offset = *ahead > pos ? *ahead : pos; offset < to; ) {
+    int n;
+    char *data = file_run(fs, map, offset, &n);
+    char *start = (char *)((unsigned long)data & ~(fs->page_size - 1));
+
+    if(n > to - offset)
+      n = to - offset;
+
+    if(data == NULL) {
+      offset += n;
+      continue;
+    }
+
+    if(first != NULL && (start > last + PREFETCH_GAP * fs->page_size || data + n < first - PREFETCH_GAP * fs->page_size)) {
+      madvise(first, last - first, MADV_WILLNEED);
+      n_calls++;
+      first = NULL;
+    }
+
+    if(first == NULL || start < first)
+      first = start;
+    if(last == NULL || data + n > last)
+      last = data + n;
+    offset += n;
+  }
+
+  if(first != NULL) {
+    madvise(first, last - first, MADV_WILLNEED);
+    n_calls++;
+  }
+  __sync_fetch_and_add(&fs->n_prefetches, n_calls);
+  *ahead = to;
+
+  return window;
+}
+
+//write the bytes [offset, end) of the file to fd, straight from the mapped runs
+//the runs are gathered in batches of up to IOV_MAX and written with a single writev (returns VFS_EHOST on error)
+//the holes of a sparse file are written as zeros, or skipped with seek_holes (fd a regular file, left with holes)
+static int write_file_range(vfs_image *fs, int fd, dir_entry *entry, int offset, int end, int seek_holes){
+  extent_map *map = get_extent_map(fs, entry->first_block, entry->month & ~MONTH_MASK);
+  struct iovec iov[IOV_MAX];
+  int ahead = 0;
+
+  if(entry->month & FILE_COMPRESSED)
+    return write_frames(fs, fd, map, offset, end);
+
+  while(offset < end) {
+    int n_iov = 0;
+
+    // with the prefetch, a writev takes half of the blocks asked for while the kernel reads the next ones
+    long window = prefetch_file(fs, map, offset, end, &ahead);
+    int batch_end = window > 0 && offset + window / 2 < end ? offset + window / 2 : end;
+
+    for(int pos = offset; pos < batch_end && n_iov < IOV_MAX; ) {
+      int n;
+      char *data = file_run(fs, map, pos, &n);
+
+      if(n > batch_end - pos)
+        n = batch_end - pos;
+
+      // a hole is skipped once the data before it is written
+      if(data == NULL && seek_holes) {
+        if(n_iov > 0)
+          break;
+        if(lseek(fd, n, SEEK_CUR) == -1)
+          return VFS_EHOST;
+        offset = pos += n;
+        continue;
+      }
+
+      if(data == NULL && n > ZERO_BYTES)
+        n = ZERO_BYTES;
+      iov[n_iov].iov_base = data != NULL ? data : (char *)zeros;
+      iov[n_iov].iov_len = n;
+      pos += n;
+      n_iov++;
+    }
+
+    if(n_iov == 0)
+      continue;
+
+    ssize_t written = writev(fd, iov, n_iov);
+    __sync_fetch_and_add(&fs->n_write_calls, 1);
+    if(written == -1 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      return VFS_EHOST;
+
+    offset += written;
+  }
+
+  return VFS_OK;
+}
+
+//fill the chain starting at first_block with size bytes of data, following the FAT
+//(doesn't use the extent maps, so it can run in the workers of get -r)
+static void copy_to_chain(vfs_image *fs, int first_block, const char *data, int size){
+  int block = first_block;
+
+  for(long offset = 0; offset < size; block = fs->fat[block]) {
+    int start = block;
+
+    while(fs->fat[block] == block + 1)
+      block++;
+
+    long n = (long)(block - start + 1) * fs->sb->block_size;
+    if(n > size - offset)
+      n = size - offset;
+
+    memcpy(BLOCK(start), data + offset, n);
+    mark_dirty(fs, BLOCK(start), n);
+    offset += n;
+  }
+
+  return;
+}
+
+//map size bytes of the host file (NULL if it cannot be read, an empty mapping for empty files)
+static char *map_input(const char *path, int size){
+  static char empty;
+  int f_input = open(path, O_RDONLY);
+  char *input = &empty;
+
+  if(f_input == -1)
+    return NULL;
+
+  if(size > 0 && (input = mmap(NULL, size, PROT_READ, MAP_PRIVATE, f_input, 0)) == MAP_FAILED)
+    input = NULL;
+  close(f_input);
+
+  if(input != NULL && size > 0)
+    madvise(input, size, MADV_SEQUENTIAL);
+
+  return input;
+}
+
+//choose how the size bytes of the host file at path, mapped at input, are stored: compressed (if asked for), or
+//without its blocks of zeros, when it takes fewer blocks that way
+static void plan_layout(vfs_image *fs, const char *path, const char *input, int size, int compress, file_layout *layout){
+  memset(layout, 0, sizeof(file_layout));
+  layout->n_blocks = size > 0 ? ((long)size + fs->sb->block_size - 1) / fs->sb->block_size : 1;
+  if(size == 0)
+    return;
+
+  struct timespec start;
+  long compress_ns = 0;
+  if(compress) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n_frames = compress_input(fs, input, size, layout->n_blocks, &layout->frames, &layout->ends);
+    compress_ns = elapsed_ns(&start);
+    if(n_frames != -1) {
+      layout->flags = FILE_COMPRESSED;
+      layout->n_frames = n_frames;
+      layout->n_blocks = FRAME_TABLE_BLOCKS(n_frames) + n_frames;
+    }
+  }
+
+  if(layout->flags == 0) {
+    int data_blocks = find_data_runs(fs, path, input, size, &layout->runs, &layout->n_runs);
+    if(SPARSE_TABLE_BLOCKS(layout->n_runs) + data_blocks < layout->n_blocks) {
+      layout->flags = FILE_SPARSE;
+      layout->n_blocks = SPARSE_TABLE_BLOCKS(layout->n_runs) + data_blocks;
+    }
+  }
+
+  // the files that compression doesn't make smaller count too, with the time it took to find it out
+  if(compress) {
+    __sync_fetch_and_add(&fs->compress_ns, compress_ns);
+    __sync_fetch_and_add(&fs->compress_in, size);
+    __sync_fetch_and_add(&fs->compress_out, (long)layout->n_blocks * fs->sb->block_size);
+  }
+
+  return;
+}
+
+//fill the chain starting at first_block (of layout->n_blocks blocks) with the file at input, as planned by plan_layout,
+//and free what the plan holds (following the FAT, so that it can run in the workers of get -r)
+static void copy_layout(vfs_image *fs, int first_block, const char *input, int size, file_layout *layout){
+  if(first_block != -1 && layout->flags == FILE_COMPRESSED)
+    copy_to_compressed_chain(fs, first_block, layout->frames, layout->ends, layout->n_frames);
+  else if(first_block != -1 && layout->flags == FILE_SPARSE)
+    copy_to_sparse_chain(fs, first_block, input, size, layout->runs, layout->n_runs);
+  else if(first_block != -1)
+    copy_to_chain(fs, first_block, input, size);
+
+  free(layout->runs);
+  free(layout->frames);
+  free(layout->ends);
+
+  return;
+}
+
+//find the runs of blocks of the host file at path, mapped at input, that are not all zeros (its holes, found with
+//SEEK_DATA and SEEK_HOLE, are not read); returns the number of blocks in the runs, listed in *runs (to be freed)
+static int find_data_runs(vfs_image *fs, const char *path, const char *input, int size, sparse_run **runs, int *n_runs){
+  int bs = fs->sb->block_size, n_blocks = 0, max_runs = 0, next = 0;
+  int f_input = open(path, O_RDONLY);
+  off_t data = 0, hole = size;
+
+  *runs = NULL;
+  *n_runs = 0;
+
+  for(off_t pos = 0; pos < size; pos = hole) {
+    // a host without SEEK_DATA has no holes, the zero blocks are found by reading them
+    if(f_input != -1 && (data = lseek(f_input, pos, SEEK_DATA)) == -1 && errno == ENXIO)
+      break;
+    if(f_input == -1 || data == -1) {
+      data = pos;
+      hole = size;
+    }
+    else if((hole = lseek(f_input, data, SEEK_HOLE)) == -1 || hole > size)
+      hole = size;
+
+    // (a block can have the end of a run of data and the start of the next one)
+    for(int block = data / bs > next ? data / bs : next; (off_t)block * bs < hole; next = ++block) {
+      long offset = (long)block * bs;
+
+      if(zero_block(input + offset, size - offset < bs ? size - offset : bs))
+        continue;
+
+      if(*n_runs > 0 && (*runs)[*n_runs - 1].offset + (*runs)[*n_runs - 1].length == block)
+        (*runs)[*n_runs - 1].length++;
+      else {
+        if(*n_runs == max_runs) {
+          max_runs = max_runs ? 2 * max_runs : 16;
+          *runs = (sparse_run *)realloc(*runs, max_runs * sizeof(sparse_run));
+        }
+        (*runs)[*n_runs].offset = block;
+        (*runs)[*n_runs].length = 1;
+        (*n_runs)++;
+      }
+      n_blocks++;
+    }
+  }
+
+  if(f_input != -1)
+    close(f_input);
+
+  return n_blocks;
+}
+
+//whether the n bytes at data (aligned to 16 bytes) are all zeros, compared 64 bytes at a time with vector operations
+static int zero_block(const char *data, int n){
+  int i = 0;
+
+  for(; i + 64 <= n; i += 64) {
+    const zero_vec *v = (const zero_vec *)(data + i);
+    zero_vec any = v[0] | v[1] | v[2] | v[3];
+
+    if(any[0] | any[1])
+      return 0;
+  }
+
+  for(; i < n; i++)
+    if(data[i] != 0)
+      return 0;
+
+  return 1;
+}
+
+//fill the chain starting at first_block with the table of the runs of a sparse file and then the blocks of the runs,
+//taken from its size bytes at data, following the FAT (so that it can run in the workers of get -r)
+static void copy_to_sparse_chain(vfs_image *fs, int first_block, const char *data, int size, sparse_run *runs, int n_runs){
+  int bs = fs->sb->block_size, n_table = SPARSE_TABLE_BLOCKS(n_runs), block = first_block;
+  char *table = (char *)calloc(n_table, bs);
+  sparse_header header = { .n_runs = n_runs, .table_blocks = n_table };
+
+  memcpy(table, &header, sizeof(sparse_header));
+  // a file of zeros has no runs (runs is NULL)
+  if(n_runs > 0)
+    memcpy(table + sizeof(sparse_header), runs, n_runs * sizeof(sparse_run));
+  for(int i = 0; i < n_table; i++, block = fs->fat[block]) {
+    memcpy(BLOCK(block), table + (long)i * bs, bs);
+    mark_dirty(fs, BLOCK(block), bs);
+  }
+  free(table);
+
+  for(int i = 0; i < n_runs; i++)
+    for(int k = 0; k < runs[i].length; k++, block = fs->fat[block]) {
+      long offset = (long)(runs[i].offset + k) * bs;
+      int n = size - offset < bs ? size - offset : bs;
+
+      memcpy(BLOCK(block), data + offset, n);
+      mark_dirty(fs, BLOCK(block), n);
+    }
+
+  return;
+}
+
+//number of blocks of the chain starting at first_block (of a file with the layout, see get_extent_map)
+static int chain_blocks(vfs_image *fs, int first_block, int layout){
+  extent_map *map = get_extent_map(fs, first_block, layout);
+  int n_blocks = 0;
+
+  for(int i = 0; i < map->n_extents; i++)
+    n_blocks += map->extents[i].length;
+
+  return n_blocks;
+}
+
+//compress the first bytes of the n at src into at most room bytes at dst, as long as they fit, in sequences of a token
+//(the number of literals in its high 4 bits, and the length of the match less LZ_MIN_MATCH in the low ones, 15 meaning
+//that bytes of 255 and a last smaller one follow, to be added), the literals, and the distance back to the match (2
+//bytes, little endian) with the extra bytes of its length; the last sequence has no match
+//last has the last position of each hash in the input whose src starts at base: the ones before base belong to the
+//frames before, so the table is only cleared (to -1) once per input
+//returns the number of bytes written, and in *consumed the number of bytes of src they hold
+static int lz_compress(const char *src, int n, char *dst, int room, int *consumed, int *last, int base){
+  const unsigned char *in = (const unsigned char *)src, *ip = in, *anchor = in, *iend = in + n;
+  unsigned char *op = (unsigned char *)dst, *oend = op + room;
+
+  // (the search stops once the literals fill the room)
+  while(ip + LZ_MIN_MATCH <= iend && ip - anchor < oend - op) {
+    unsigned int word, ref_word;
+    memcpy(&word, ip, sizeof(word));
+
+    unsigned int hash = (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+    int pos = last[hash] - base;
+    last[hash] = base + (ip - in);
+    if(pos < 0) {
+      ip++;
+      continue;
+    }
+
+    const unsigned char *ref = in + pos;
+    memcpy(&ref_word, ref, sizeof(ref_word));
+    if(ref >= ip || ip - ref > 0xffff || ref_word != word) {
+      ip++;
+      continue;
+    }
+
+    int length = LZ_MIN_MATCH, literals = ip - anchor;
+    while(ip + length < iend && ref[length] == ip[length])
+      length++;
+
+    // a long match is cut to the length whose extra bytes fit
+    int left = oend - op - (1 + lz_extra(literals) + literals + 2);
+    if(left < 0)
+      break;
+    if(lz_extra(length - LZ_MIN_MATCH) > left)
+      length = LZ_MIN_MATCH + (left == 0 ? 14 : 255 * left + 14);
+    op = lz_sequence(op, anchor, literals, ip - ref, length);
+    ip += length;
+    anchor = ip;
+  }
+
+  // the literals left, as many as fit
+  int literals = iend - anchor, left = oend - op - 1;
+  if(literals > left)
+    literals = left > 0 ? left : 0;
+  while(literals > 0 && oend - op < 1 + lz_extra(literals) + literals)
+    literals--;
+  if(literals > 0)
+    op = lz_sequence(op, anchor, literals, 0, 0);
+
+  *consumed = anchor + literals - in;
+  return op - (unsigned char *)dst;
+}
+
+//write a sequence of the n_literals bytes at literals and a match of length bytes at distance (none if length is 0)
+//returns the end of the sequence
+static unsigned char *lz_sequence(unsigned char *op, const unsigned char *literals, int n_literals, int distance, int length){
+  int match = length > 0 ? length - LZ_MIN_MATCH : 0;
+  int n;
+
+  *op++ = (n_literals < 15 ? n_literals : 15) << 4 | (match < 15 ? match : 15);
+  for(n = n_literals - 15; n >= 255; n -= 255)
+    *op++ = 255;
+  if(n >= 0)
+    *op++ = n;
+  memcpy(op, literals, n_literals);
+  op += n_literals;
+
+  if(length == 0)
+    return op;
+
+  *op++ = distance & 0xff;
+  *op++ = distance >> 8;
+  for(n = match - 15; n >= 255; n -= 255)
+    *op++ = 255;
+  if(n >= 0)
+    *op++ = n;
+
+  return op;
+}
+
+//number of bytes after the token for a count of n (of literals, or of a match less LZ_MIN_MATCH)
+static int lz_extra(int n){
+  return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+//decompress the frame at src (at most room bytes) into the n bytes at dst (returns -1 if the frame is not valid)
+static int lz_decompress(const char *src, int room, char *dst, int n){
+  const unsigned char *ip = (const unsigned char *)src, *iend = ip + room;
+  unsigned char *op = (unsigned char *)dst, *oend = op + n;
+
+  while(op < oend) {
+    if(ip == iend)
+      return -1;
+
+    int token = *ip++, literals = token >> 4, length = token & 15;
+    if(literals == 15 && (literals = lz_length(&ip, iend, 15)) == -1)
+      return -1;
+    if(literals > iend - ip || literals > oend - op)
+      return -1;
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+
+    // the last sequence ends at the end of the frame
+    if(op == oend)
+      break;
+
+    if(iend - ip < 2)
+      return -1;
+    int distance = ip[0] | ip[1] << 8;
+    ip += 2;
+    if(length == 15 && (length = lz_length(&ip, iend, 15)) == -1)
+      return -1;
+    length += LZ_MIN_MATCH;
+    if(distance == 0 || distance > op - (unsigned char *)dst || length > oend - op)
+      return -1;
+
+    // a match closer than its length repeats its bytes, which are copied a period (and then the ones copied) at a time
+    const unsigned char *from = op - distance;
+    while(length > 0) {
+      int k = op - from < length ? op - from : length;
+      memcpy(op, from, k);
+      op += k;
+      length -= k;
+    }
+  }
+
+  return 0;
+}
+
+//read the extra bytes of a count that starts at n (returns -1 if they go past end)
+static int lz_length(const unsigned char **ip, const unsigned char *end, int n){
+  unsigned char byte;
+
+  do {
+    if(*ip == end)
+      return -1;
+    byte = *(*ip)++;
+    n += byte;
+  } while(byte == 255);
+
+  return n;
+}
+
+//compress the size bytes of the file at input into frames of a block (see lz_compress), as long as they take fewer
+//than max_blocks blocks with their table; returns the number of frames (-1 if they don't), with the blocks in *frames
+//and the end of each frame in the file in *ends (to be freed)
+static int compress_input(vfs_image *fs, const char *input, int size, int max_blocks, char **frames, int **ends){
+  int bs = fs->sb->block_size, n_frames = 0;
+  int last[1 << LZ_HASH_BITS];
+
+  *frames = (char *)malloc((long)max_blocks * bs);
+  *ends = (int *)malloc(max_blocks * sizeof(int));
+  memset(last, 0xff, sizeof(last));
+
+  for(int pos = 0; pos < size; n_frames++) {
+    if(FRAME_TABLE_BLOCKS(n_frames + 1) + n_frames + 1 >= max_blocks) {
+      free(*frames);
+      free(*ends);
+      *frames = NULL;
+      *ends = NULL;
+      return -1;
+    }
+
+    char *frame = *frames + (long)n_frames * bs;
+    int consumed, n = lz_compress(input + pos, size - pos < FRAME_BYTES ? size - pos : FRAME_BYTES, frame, bs, &consumed, last, pos);
+    memset(frame + n, 0, bs - n);
+    pos += consumed;
+    (*ends)[n_frames] = pos;
+  }
+
+  return n_frames;
+}
+
+//fill the chain starting at first_block with the table of the frames of a compressed file and then the frames,
+//following the FAT (so that it can run in the workers of get -r)
+static void copy_to_compressed_chain(vfs_image *fs, int first_block, char *frames, int *ends, int n_frames){
+  int bs = fs->sb->block_size, n_table = FRAME_TABLE_BLOCKS(n_frames), block = first_block;
+  char *table = (char *)calloc(n_table, bs);
+  frame_header header = { .n_frames = n_frames, .table_blocks = n_table };
+
+  memcpy(table, &header, sizeof(frame_header));
+  memcpy(table + sizeof(frame_header), ends, n_frames * sizeof(int));
+  for(int i = 0; i < n_table; i++, block = fs->fat[block]) {
+    memcpy(BLOCK(block), table + (long)i * bs, bs);
+    mark_dirty(fs, BLOCK(block), bs);
+  }
+  free(table);
+
+  for(int i = 0; i < n_frames; i++, block = fs->fat[block]) {
+    memcpy(BLOCK(block), frames + (long)i * bs, bs);
+    mark_dirty(fs, BLOCK(block), bs);
+  }
+
+  return;
+}
+
+//read the end of each frame of the compressed file whose chain starts at first_block into its map
+//returns the number of blocks of its table
+static int load_frame_ends(vfs_image *fs, int first_block, extent_map *map){
+  frame_header *header = (frame_header *)BLOCK(first_block);
+  int bs = fs->sb->block_size, n_table = header->table_blocks > 0 ? header->table_blocks : 1, cur = first_block;
+  int *table = (int *)malloc(n_table * sizeof(int)), n_found = 0;
+
+  for(int i = 0; i < n_table && cur != -1; i++, cur = fs->fat[cur])
+    table[n_found++] = cur;
+
+  // (the table may be cut short, and the offsets of the frames must fit in an int)
+  long max_frames = ((long)n_found * bs - sizeof(frame_header)) / sizeof(int);
+  if(max_frames > INT_MAX / bs)
+    max_frames = INT_MAX / bs;
+  int n_frames = header->n_frames < 0 ? 0 : header->n_frames < max_frames ? header->n_frames : max_frames;
+
+  map->frame_ends = (int *)malloc((n_frames + 1) * sizeof(int));
+  for(int i = 0; i < n_frames; i++) {
+    long pos = sizeof(frame_header) + (long)i * sizeof(int);
+    map->frame_ends[i] = *(int *)(BLOCK(table[pos / bs]) + pos % bs);
+  }
+  map->n_frames = n_frames;
+  free(table);
+
+  return n_table;
+}
+
+//first frame of a compressed file that ends after offset (n_frames if there is none)
+static int find_frame(extent_map *map, int offset){
+  int low = 0, high = map->n_frames;
+
+  while(low < high) {
+    int mid = (low + high) / 2;
+    if(map->frame_ends[mid] <= offset)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+//decompress the frame f of a compressed file to out (returns -1 if it is not valid)
+static int decode_frame(vfs_image *fs, extent_map *map, int f, char *out){
+  int start = f > 0 ? map->frame_ends[f - 1] : 0, n;
+  char *frame = file_run(fs, map, f * fs->sb->block_size, &n);
+
+  if(frame == NULL || map->frame_ends[f] <= start || map->frame_ends[f] - start > FRAME_BYTES)
+    return -1;
+
+  return lz_decompress(frame, fs->sb->block_size, out, map->frame_ends[f] - start);
+}
+
+//decompress the bytes [offset, end) of a compressed file to buf (returns -1 if a frame is not valid)
+//the frames inside the range are decompressed in place, and the ones at its ends through a buffer
+static int read_frames(vfs_image *fs, extent_map *map, int offset, int end, char *buf){
+  struct timespec start;
+  char *frame = NULL;
+  int ahead = 0, status = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(int pos = offset, f = find_frame(map, offset); pos < end && status == 0; f++) {
+    if(f == map->n_frames) {
+      status = -1;
+      break;
+    }
+
+    int frame_start = f > 0 ? map->frame_ends[f - 1] : 0, frame_end = map->frame_ends[f];
+    prefetch_file(fs, map, f * fs->sb->block_size, map->n_frames * fs->sb->block_size, &ahead);
+
+    if(frame_start == pos && frame_end <= end)
+      status = decode_frame(fs, map, f, buf + pos - offset);
+    else {
+      if(frame == NULL)
+        frame = (char *)malloc(FRAME_BYTES);
+      if((status = decode_frame(fs, map, f, frame)) == 0)
+        memcpy(buf + pos - offset, frame + pos - frame_start, (frame_end < end ? frame_end : end) - pos);
+    }
+    pos = frame_end < end ? frame_end : end;
+  }
+  free(frame);
+
+  __sync_fetch_and_add(&fs->decompress_ns, elapsed_ns(&start));
+  __sync_fetch_and_add(&fs->decompress_bytes, end - offset);
+
+  return status;
+}
+
+//write the bytes [offset, end) of a compressed file to fd, decompressed into a buffer that is written once full
+//(returns VFS_EHOST on error, and VFS_EBADFS if a frame is not valid)
+static int write_frames(vfs_image *fs, int fd, extent_map *map, int offset, int end){
+  char *output = (char *)malloc(OUTPUT_BYTES);
+  int pos = offset, f = find_frame(map, offset), ahead = 0, status = VFS_OK;
+  long decode_ns = 0;
+
+  while(pos < end && status == VFS_OK) {
+    int n = 0;
+
+    // the buffer takes the frames that fit whole, and the first one is moved to its start from pos
+    for(; pos < end && f < map->n_frames && n + map->frame_ends[f] - (f > 0 ? map->frame_ends[f - 1] : 0) <= OUTPUT_BYTES; f++) {
+      int frame_start = f > 0 ? map->frame_ends[f - 1] : 0, frame_end = map->frame_ends[f] < end ? map->frame_ends[f] : end;
+      struct timespec start;
+
+      prefetch_file(fs, map, f * fs->sb->block_size, map->n_frames * fs->sb->block_size, &ahead);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if(decode_frame(fs, map, f, output + n) == -1) {
+        status = VFS_EBADFS;
+        break;
+      }
+      decode_ns += elapsed_ns(&start);
+
+      if(pos > frame_start)
+        memmove(output + n, output + n + pos - frame_start, frame_end - pos);
+      n += frame_end - pos;
+      pos = frame_end;
+    }
+
+    if(status == VFS_OK && n == 0)
+      status = VFS_EBADFS;
+
+    for(int written = 0; status == VFS_OK && written < n; ) {
+      ssize_t k = write(fd, output + written, n - written);
+      __sync_fetch_and_add(&fs->n_write_calls, 1);
+      if(k == -1 && errno == EINTR)
+        continue;
+      if(k <= 0)
+        status = VFS_EHOST;
+      else
+        written += k;
+    }
+  }
+  free(output);
+
+  __sync_fetch_and_add(&fs->decompress_ns, decode_ns);
+  __sync_fetch_and_add(&fs->decompress_bytes, pos - offset);
+
+  return status;
+}
+
+//nanoseconds since start
+static long elapsed_ns(struct timespec *start){
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (end.tv_sec - start->tv_sec) * 1000000000L + (end.tv_nsec - start->tv_nsec);
+}
+
+//find a directory entry in the directory (pos gets its position, if not NULL)
+static dir_entry *find_dir_entry(vfs_image *fs, dir_index *index, const char *name, int *pos){
+  int i = dir_index_find(fs, index, name);
+
+  if(pos != NULL)
+    *pos = i;
+
+  if(i == -1)
+    return NULL;
+
+  return dir_index_entry(fs, index, i);
+}
+
+//append an entry to the directory (returns its position or -1 if the disk is full)
+static int dir_add_entry(vfs_image *fs, dir_index *index, dir_entry *entry){
+  dir_entry *dir = (dir_entry *)BLOCK(index->block);
+  int n_entries = dir[0].size;
+
+  if(index->fill != NULL)
+    return sorted_add_entry(fs, index, entry);
+
+  if(n_entries % DIR_ENTRIES_PER_BLOCK == 0 && dir_append_block(fs, index) == -1)
+    return -1;
+
+  journal_bytes(fs, &dir[0], sizeof(dir_entry));
+  journal_bytes(fs, dir_index_entry(fs, index, n_entries), sizeof(dir_entry));
+  *dir_index_entry(fs, index, n_entries) = *entry;
+  dir[0].size++;
+  mark_dirty(fs, &dir[0], sizeof(dir_entry));
+  mark_dirty(fs, dir_index_entry(fs, index, n_entries), sizeof(dir_entry));
+  dir_index_insert(fs, index, n_entries);
+  note_parent_pos(fs, entry, n_entries);
+
+  return n_entries;
+}
+
+//remove the entry at position pos, moving the last entry of the directory to its place
+static void dir_remove_entry(vfs_image *fs, dir_index *index, int pos){
+  dir_entry *dir = (dir_entry *)BLOCK(index->block);
+  int last = dir[0].size - 1;
+
+  if(index->fill != NULL) {
+    sorted_remove_entry(fs, index, pos);
+    return;
+  }
+
+  journal_bytes(fs, &dir[0], sizeof(dir_entry));
+  journal_bytes(fs, dir_index_entry(fs, index, pos), sizeof(dir_entry));
+  dir_index_remove(fs, index, pos);
+
+  if(pos != last) {
+    *dir_index_entry(fs, index, pos) = *dir_index_entry(fs, index, last);
+    dir_index_move(fs, index, last, pos);
+    note_parent_pos(fs, dir_index_entry(fs, index, pos), pos);
+  }
+
+  dir[0].size--;
+  mark_dirty(fs, &dir[0], sizeof(dir_entry));
+  mark_dirty(fs, dir_index_entry(fs, index, pos), sizeof(dir_entry));
+
+  // the last entry was alone in the last block of the chain
+  if(last % DIR_ENTRIES_PER_BLOCK == 0) {
+    free_block(fs, index->chain[--index->n_blocks]);
+    journal_bytes(fs, &fs->fat[index->chain[index->n_blocks - 1]], sizeof(int));
+    fs->fat[index->chain[index->n_blocks - 1]] = -1;
+    mark_dirty(fs, &fs->fat[index->chain[index->n_blocks - 1]], sizeof(int));
+  }
+
+  return;
+}
+
+//add a block at the end of the chain of the directory (returns its position in the chain or -1 if the disk is full)
+static int dir_append_block(vfs_image *fs, dir_index *index){
+  pthread_mutex_lock(&fs->alloc_lock);
+  int next_block = alloc_chain(fs, 1, index->chain[index->n_blocks - 1] + 1);
+  pthread_mutex_unlock(&fs->alloc_lock);
+  if(next_block == -1)
+    return -1;
+
+  if(index->n_blocks == index->max_blocks) {
+    index->max_blocks *= 2;
+    index->chain = (int *)realloc(index->chain, index->max_blocks * sizeof(int));
+    if(index->fill != NULL) {
+      index->fill = (int *)realloc(index->fill, index->max_blocks * sizeof(int));
+      index->order = (int *)realloc(index->order, index->max_blocks * sizeof(int));
+    }
+  }
+
+  // the entries of a sorted directory can move to any slot of the new block
+  if(index->fill != NULL) {
+    memset(BLOCK(next_block), 0, fs->sb->block_size);
+    mark_dirty(fs, BLOCK(next_block), fs->sb->block_size);
+    index->fill[index->n_blocks] = 0;
+  }
+
+  journal_bytes(fs, &fs->fat[index->chain[index->n_blocks - 1]], sizeof(int));
+  fs->fat[index->chain[index->n_blocks - 1]] = next_block;
+  mark_dirty(fs, &fs->fat[index->chain[index->n_blocks - 1]], sizeof(int));
+  index->chain[index->n_blocks] = next_block;
+
+  return index->n_blocks++;
+}
+
+//first position in use from pos on, in the order of the chain (-1 if there is none)
+static int dir_next_pos(vfs_image *fs, dir_index *index, int pos){
+  if(index->fill == NULL)
+    return pos < ((dir_entry *)BLOCK(index->block))[0].size ? pos : -1;
+
+  int b = pos / DIR_ENTRIES_PER_BLOCK;
+  if(b < index->n_blocks && pos % DIR_ENTRIES_PER_BLOCK < index->fill[b])
+    return pos;
+
+  for(b++; b < index->n_blocks; b++)
+    if(index->fill[b] > 0)
+      return b * DIR_ENTRIES_PER_BLOCK;
+
+  return -1;
+}
+
+//blocks taken from the disk to add an entry named name to the directory (0 or 1)
+static int dir_add_blocks(vfs_image *fs, dir_index *index, const char *name){
+  if(index->fill != NULL)
+    return index->fill[index->order[sorted_block(fs, index, name)]] == DIR_ENTRIES_PER_BLOCK;
+
+  return ((dir_entry *)BLOCK(index->block))[0].size % DIR_ENTRIES_PER_BLOCK == 0;
+}
+
+//position in index->order of the block where the name belongs: the last one whose first name is not after it
+//(the first block, with '.' and '..', may have no other entries, and takes the names before all the others)
+static int sorted_block(vfs_image *fs, dir_index *index, const char *name){
+  int lo = 1, hi = index->n_blocks - 1, k = 0;
+
+  while(lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if(strncmp(((dir_entry *)BLOCK(index->chain[index->order[mid]]))->name, name, MAX_NAME_LENGHT) <= 0) {
+      k = mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+
+  return k;
+}
+
+//add an entry to a sorted directory, splitting its block if it is full (returns its position or -1 if the disk is full)
+static int sorted_add_entry(vfs_image *fs, dir_index *index, dir_entry *entry){
+  int per_block = DIR_ENTRIES_PER_BLOCK;
+  int k = sorted_block(fs, index, entry->name);
+  int b = index->order[k], new_b = -1;
+
+  // the entries only move inside the block, or to a new one
+  journal_bytes(fs, BLOCK(index->block), sizeof(dir_entry));
+  journal_bytes(fs, BLOCK(index->chain[b]), fs->sb->block_size);
+
+  // the upper half of a full block moves to a new block, which follows it in name order
+  if(index->fill[b] == per_block) {
+    int half = per_block / 2;
+    new_b = dir_append_block(fs, index);
+    if(new_b == -1)
+      return -1;
+
+    for(int s = half; s < per_block; s++)
+      sorted_move_entry(fs, index, b * per_block + s, new_b * per_block + s - half);
+    index->fill[b] = half;
+    index->fill[new_b] = per_block - half;
+
+    memmove(&index->order[k + 2], &index->order[k + 1], (index->n_blocks - k - 2) * sizeof(int));
+    index->order[k + 1] = new_b;
+
+    if(strncmp(((dir_entry *)BLOCK(index->chain[new_b]))->name, entry->name, MAX_NAME_LENGHT) < 0)
+      b = new_b;
+  }
+
+  // the slot of the entry, after the ones with smaller names ('.' and '..' stay at the start of the first block)
+  int lo = b == 0 ? 2 : 0, hi = index->fill[b];
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(strncmp(dir_index_entry(fs, index, b * per_block + mid)->name, entry->name, MAX_NAME_LENGHT) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for(int s = index->fill[b] - 1; s >= lo; s--)
+    sorted_move_entry(fs, index, b * per_block + s, b * per_block + s + 1);
+
+  int pos = b * per_block + lo;
+  *dir_index_entry(fs, index, pos) = *entry;
+  index->fill[b]++;
+  ((dir_entry *)BLOCK(index->block))[0].size++;
+  mark_dirty(fs, BLOCK(index->block), sizeof(dir_entry));
+  mark_dirty(fs, BLOCK(index->chain[index->order[k]]), fs->sb->block_size);
+  if(new_b != -1)
+    mark_dirty(fs, BLOCK(index->chain[new_b]), fs->sb->block_size);
+  dir_index_insert(fs, index, pos);
+  note_parent_pos(fs, entry, pos);
+
+  return pos;
+}
+
+//remove the entry at position pos of a sorted directory, closing the gap in its block
+//a block left empty takes the entries of the last block of the chain, which is freed
+static void sorted_remove_entry(vfs_image *fs, dir_index *index, int pos){
+  int per_block = DIR_ENTRIES_PER_BLOCK;
+  int b = pos / per_block;
+  int last = index->n_blocks - 1;
+
+  journal_bytes(fs, BLOCK(index->block), sizeof(dir_entry));
+  journal_bytes(fs, BLOCK(index->chain[b]), fs->sb->block_size);
+  if(index->fill[b] == 1 && b != 0) {
+    if(b != last)
+      journal_bytes(fs, BLOCK(index->chain[last]), fs->sb->block_size);
+    journal_bytes(fs, &fs->fat[index->chain[last - 1]], sizeof(int));
+  }
+
+  dir_index_remove(fs, index, pos);
+  memset(dir_index_entry(fs, index, pos), 0, sizeof(dir_entry));
+
+  for(int s = pos % per_block + 1; s < index->fill[b]; s++)
+    sorted_move_entry(fs, index, b * per_block + s, b * per_block + s - 1);
+  index->fill[b]--;
+  ((dir_entry *)BLOCK(index->block))[0].size--;
+  mark_dirty(fs, BLOCK(index->block), sizeof(dir_entry));
+  mark_dirty(fs, BLOCK(index->chain[b]), fs->sb->block_size);
+
+  if(index->fill[b] > 0 || b == 0)
+    return;
+
+  int k = 0;
+  while(index->order[k] != b)
+    k++;
+  memmove(&index->order[k], &index->order[k + 1], (last - k) * sizeof(int));
+
+  if(b != last) {
+    for(int s = 0; s < index->fill[last]; s++)
+      sorted_move_entry(fs, index, last * per_block + s, b * per_block + s);
+    index->fill[b] = index->fill[last];
+    mark_dirty(fs, BLOCK(index->chain[b]), fs->sb->block_size);
+
+    for(k = 0; index->order[k] != last; k++);
+    index->order[k] = b;
+  }
+
+  index->n_blocks--;
+  free_block(fs, index->chain[last]);
+  fs->fat[index->chain[last - 1]] = -1;
+  mark_dirty(fs, &fs->fat[index->chain[last - 1]], sizeof(int));
+
+  return;
+}
+
+//move the entry at position from of a sorted directory to the free slot to, leaving from free
+static void sorted_move_entry(vfs_image *fs, dir_index *index, int from, int to){
+  dir_entry *entry = dir_index_entry(fs, index, from);
+
+  *dir_index_entry(fs, index, to) = *entry;
+  memset(entry, 0, sizeof(dir_entry));
+  dir_index_move(fs, index, from, to);
+  note_parent_pos(fs, dir_index_entry(fs, index, to), to);
+
+  return;
+}
+
+//sort the blocks of a sorted directory by their first names, into index->order (the first block is always first)
+static void sorted_order(vfs_image *fs, dir_index *index){
+  block_name *names = (block_name *)malloc(index->n_blocks * sizeof(block_name));
+
+  for(int b = 1; b < index->n_blocks; b++) {
+    names[b].name = ((dir_entry *)BLOCK(index->chain[b]))->name;
+    names[b].pos = b;
+  }
+  qsort(names + 1, index->n_blocks - 1, sizeof(block_name), block_name_cmp);
+
+  index->order[0] = 0;
+  for(int b = 1; b < index->n_blocks; b++)
+    index->order[b] = names[b].pos;
+
+  free(names);
+  return;
+}
+
+//order of the first names of two blocks
+static int block_name_cmp(const void *a, const void *b){
+  return strncmp(((const block_name *)a)->name, ((const block_name *)b)->name, MAX_NAME_LENGHT);
+}
+
+//position of the entry with the given rank in name order in a sorted directory (-1 if there are fewer entries)
+static int sorted_pos(vfs_image *fs, dir_index *index, int rank){
+  for(int k = 0; k < index->n_blocks; k++) {
+    int b = index->order[k];
+    if(rank < index->fill[b])
+      return b * DIR_ENTRIES_PER_BLOCK + rank;
+    rank -= index->fill[b];
+  }
+
+  return -1;
+}
+
+static void *int_map_get(int_map *map, int key){
+  if(map->capacity == 0)
+    return NULL;
+
+  int mask = map->capacity - 1;
+  for(int i = (unsigned int)key * 2654435761u & mask; map->keys[i] != -1; i = (i + 1) & mask)
+    if(map->keys[i] == key)
+      return map->values[i];
+
+  return NULL;
+}
+
+static void int_map_put(int_map *map, int key, void *value){
+  if((map->count + 1) * 2 > map->capacity) {
+    int_map old = *map;
+
+    map->capacity = old.capacity ? old.capacity * 2 : 16;
+    map->count = 0;
+    map->keys = (int *)malloc(map->capacity * sizeof(int));
+    map->values = (void **)malloc(map->capacity * sizeof(void *));
+    memset(map->keys, -1, map->capacity * sizeof(int));
+
+    for(int i = 0; i < old.capacity; i++)
+      if(old.keys[i] != -1)
+        int_map_put(map, old.keys[i], old.values[i]);
+
+    free(old.keys);
+    free(old.values);
+  }
+
+  int mask = map->capacity - 1;
+  int i = (unsigned int)key * 2654435761u & mask;
+  while(map->keys[i] != -1 && map->keys[i] != key)
+    i = (i + 1) & mask;
+
+  if(map->keys[i] == -1)
+    map->count++;
+  map->keys[i] = key;
+  map->values[i] = value;
+
+  return;
+}
+
+static void int_map_del(int_map *map, int key){
+  if(map->capacity == 0)
+    return;
+
+  int mask = map->capacity - 1;
+  int i = (unsigned int)key * 2654435761u & mask;
+  while(map->keys[i] != key) {
+    if(map->keys[i] == -1)
+      return;
+    i = (i + 1) & mask;
+  }
+
+  // backward shift deletion, so that no tombstones are needed
+  for(int j = (i + 1) & mask; map->keys[j] != -1; j = (j + 1) & mask) {
+    int k = (unsigned int)map->keys[j] * 2654435761u & mask;
+    if((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      map->keys[i] = map->keys[j];
+      map->values[i] = map->values[j];
+      i = j;
+    }
+  }
+
+  map->keys[i] = -1;
+  map->count--;
+
+  return;
+}
+
+//FNV-1a hash of a directory entry name
+static unsigned int name_hash(const char *name){
+  unsigned int hash = 2166136261u;
+
+  for(int i = 0; i < MAX_NAME_LENGHT && name[i] != '\0'; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+//get the name index of the directory, building it on first access
+//(the directory must not be removed meanwhile, see pin_dir)
+static dir_index *get_dir_index(vfs_image *fs, int dir_block){
+  pthread_rwlock_rdlock(&fs->index_lock);
+  dir_index *index = (dir_index *)int_map_get(&fs->dir_indexes, dir_block);
+  pthread_rwlock_unlock(&fs->index_lock);
+  if(index != NULL)
+    return index;
+
+  // the directories that are being changed already have an index, so the one read here is stable
+  pthread_rwlock_wrlock(&fs->index_lock);
+  if((index = (dir_index *)int_map_get(&fs->dir_indexes, dir_block)) != NULL) {
+    pthread_rwlock_unlock(&fs->index_lock);
+    return index;
+  }
+
+  index = (dir_index *)malloc(sizeof(dir_index));
+  index->block = dir_block;
+  index->parent_pos = -1;
+  index->refs = 0;
+  index->removed = 0;
+  pthread_rwlock_init(&index->lock, NULL);
+
+  index->n_blocks = 0;
+  index->max_blocks = 4;
+  index->chain = (int *)malloc(index->max_blocks * sizeof(int));
+  for(int cur_block = dir_block; cur_block != -1; cur_block = fs->fat[cur_block]) {
+    if(index->n_blocks == index->max_blocks) {
+      index->max_blocks *= 2;
+      index->chain = (int *)realloc(index->chain, index->max_blocks * sizeof(int));
+    }
+    index->chain[index->n_blocks++] = cur_block;
+  }
+
+  // the blocks of a sorted directory are counted up to their first free slot, and put in name order
+  index->fill = index->order = NULL;
+  if(((dir_entry *)BLOCK(dir_block))[1].size & DIR_SORTED) {
+    index->fill = (int *)malloc(index->max_blocks * sizeof(int));
+    index->order = (int *)malloc(index->max_blocks * sizeof(int));
+    for(int b = 0; b < index->n_blocks; b++) {
+      dir_entry *entries = (dir_entry *)BLOCK(index->chain[b]);
+      for(index->fill[b] = 0; index->fill[b] < DIR_ENTRIES_PER_BLOCK && entries[index->fill[b]].type != 0; index->fill[b]++);
+    }
+    sorted_order(fs, index);
+  }
+
+  int n_entries = ((dir_entry *)BLOCK(dir_block))[0].size;
+
+  index->n_slots = 16;
+  while(index->n_slots < 2 * n_entries)
+    index->n_slots *= 2;
+  index->slots = (int *)malloc(index->n_slots * sizeof(int));
+  index->hashes = (unsigned int *)malloc(index->n_slots * sizeof(unsigned int));
+  memset(index->slots, -1, index->n_slots * sizeof(int));
+
+  for(int i = dir_next_pos(fs, index, 0); i != -1; i = dir_next_pos(fs, index, i + 1))
+    dir_index_insert(fs, index, i);
+
+  int_map_put(&fs->dir_indexes, dir_block, index);
+  pthread_rwlock_unlock(&fs->index_lock);
+
+  return index;
+}
+
+//discard the name index of a directory (when the directory is removed)
+//the caller holds a reference and the write lock of the index, which is freed with its last reference
+static void drop_dir_index(vfs_image *fs, dir_index *index){
+  pthread_rwlock_wrlock(&fs->index_lock);
+  int_map_del(&fs->dir_indexes, index->block);
+  pthread_rwlock_unlock(&fs->index_lock);
+
+  __atomic_store_n(&index->removed, 1, __ATOMIC_RELEASE);
+
+  return;
+}
+
+static void free_dir_index(dir_index *index){
+  pthread_rwlock_destroy(&index->lock);
+  free(index->chain);
+  free(index->fill);
+  free(index->order);
+  free(index->slots);
+  free(index->hashes);
+  free(index);
+
+  return;
+}
+
+//take a reference to the index of a directory, so that it is not freed while it is used
+//(safe while the directory cannot be removed: its parent is locked, or it is already referenced)
+static dir_index *pin_dir(vfs_image *fs, int dir_block){
+  dir_index *index = get_dir_index(fs, dir_block);
+  __sync_fetch_and_add(&index->refs, 1);
+
+  return index;
+}
+
+static void unpin_dir(vfs_image *fs, dir_index *index){
+  // the directory may be pinned and removed by another handle after the count reaches 0,
+  // so the index is freed by the one that takes the count from 0 to -1
+  if(__sync_sub_and_fetch(&index->refs, 1) == 0 && __atomic_load_n(&index->removed, __ATOMIC_ACQUIRE)
+     && __sync_bool_compare_and_swap(&index->refs, 0, -1))
+    free_dir_index(index);
+
+  return;
+}
+
+//lock a referenced index for reading or writing (VFS_ENOENT, without the lock, if the directory was removed)
+static int lock_index(dir_index *index, int write){
+  if(write)
+    pthread_rwlock_wrlock(&index->lock);
+  else
+    pthread_rwlock_rdlock(&index->lock);
+
+  if(index->removed) {
+    pthread_rwlock_unlock(&index->lock);
+    return VFS_ENOENT;
+  }
+
+  return VFS_OK;
+}
+
+//reference and lock the directory (NULL if it was removed)
+static dir_index *lock_dir(vfs_image *fs, int dir_block, int write){
+  dir_index *index = pin_dir(fs, dir_block);
+
+  if(lock_index(index, write) != VFS_OK) {
+    unpin_dir(fs, index);
+    return NULL;
+  }
+
+  return index;
+}
+
+static void unlock_dir(vfs_image *fs, dir_index *index){
+  pthread_rwlock_unlock(&index->lock);
+  unpin_dir(fs, index);
+
+  return;
+}
+
+//resolve path and lock the directory of its last component for an operation (mode is LOCK_READ, LOCK_WRITE or LOCK_RENAME)
+//dir gets the directory, referenced and locked, and name the last component (see resolve_path)
+static int lock_path(vfs_t *vfs, const char *path, int mode, dir_index **dir, char *name){
+  if(mode == LOCK_RENAME)
+    pthread_mutex_lock(&vfs->fs->rename_lock);
+
+  int status = resolve_path(vfs, path, dir, name);
+
+  if(status == VFS_OK && (status = lock_index(*dir, mode != LOCK_READ)) != VFS_OK)
+    unpin_dir(vfs->fs, *dir);
+
+  if(status != VFS_OK && mode == LOCK_RENAME)
+    pthread_mutex_unlock(&vfs->fs->rename_lock);
+
+  return status;
+}
+
+static void unlock_path(vfs_t *vfs, dir_index *dir, int mode){
+  unlock_dir(vfs->fs, dir);
+
+  if(mode == LOCK_RENAME)
+    pthread_mutex_unlock(&vfs->fs->rename_lock);
+
+  return;
+}
+
+//resolve the source and destination paths of cp and mv, and lock their directories for writing, with rename_lock held
+//(the two directories may be the same, and are locked in any order, as every operation that locks two holds rename_lock)
+static int lock_paths(vfs_t *vfs, const char *src, const char *dest, dir_index **src_dir, char *src_name, dir_index **dest_dir, char *dest_name){
+  vfs_image *fs = vfs->fs;
+
+  pthread_mutex_lock(&fs->rename_lock);
+
+  int status = resolve_path(vfs, src, src_dir, src_name);
+  if(status != VFS_OK) {
+    pthread_mutex_unlock(&fs->rename_lock);
+    return status;
+  }
+
+  if((status = resolve_path(vfs, dest, dest_dir, dest_name)) == VFS_OK) {
+    if((status = lock_index(*src_dir, 1)) == VFS_OK && *dest_dir != *src_dir && (status = lock_index(*dest_dir, 1)) != VFS_OK)
+      pthread_rwlock_unlock(&(*src_dir)->lock);
+
+    if(status != VFS_OK)
+      unpin_dir(fs, *dest_dir);
+  }
+
+  if(status != VFS_OK) {
+    unpin_dir(fs, *src_dir);
+    pthread_mutex_unlock(&fs->rename_lock);
+  }
+
+  return status;
+}
+
+static void unlock_paths(vfs_t *vfs, dir_index *src_dir, dir_index *dest_dir){
+  if(dest_dir != src_dir)
+    pthread_rwlock_unlock(&dest_dir->lock);
+  unpin_dir(vfs->fs, dest_dir);
+  unlock_dir(vfs->fs, src_dir);
+
+  pthread_mutex_unlock(&vfs->fs->rename_lock);
+
+  return;
+}
+
+//the directory that starts at block, locked for writing: one of the two already locked by cp or mv, or a new lock
+//(under rename_lock no directory is removed, so the lock never fails)
+static dir_index *lock_target(vfs_image *fs, int block, dir_index *src_dir, dir_index *dest_dir){
+  if(block == src_dir->block)
+    return src_dir;
+
+  if(block == dest_dir->block)
+    return dest_dir;
+
+  return lock_dir(fs, block, 1);
+}
+
+static void unlock_target(vfs_image *fs, dir_index *dir, dir_index *src_dir, dir_index *dest_dir){
+  // the changes to the directory are committed while it is locked
+  if(dir != src_dir && dir != dest_dir) {
+    txn_commit(fs);
+    unlock_dir(fs, dir);
+  }
+
+  return;
+}
+
+//replace the referenced directory dir by its subdirectory name (also referenced, NULL on error)
+//only one directory is locked at a time, so the walk never waits while holding a lock
+static int path_step(vfs_image *fs, dir_index **dir, const char *name){
+  dir_index *next = NULL;
+  int status = lock_index(*dir, 0);
+
+  if(status == VFS_OK) {
+    dir_entry *entry = find_dir_entry(fs, *dir, name, NULL);
+
+    if(entry == NULL)
+      status = VFS_ENOENT;
+    else if(entry->type != TYPE_DIR)
+      status = VFS_ENOTDIR;
+    else
+      next = pin_dir(fs, entry->first_block);
+
+    pthread_rwlock_unlock(&(*dir)->lock);
+  }
+
+  unpin_dir(fs, *dir);
+  *dir = next;
+
+  return status;
+}
+
+//find the directory of the last component of path, starting at the root (absolute paths) or at the current directory
+//dir gets it referenced, and name (MAX_NAME_LENGHT + 2 bytes) the last component, cut after MAX_NAME_LENGHT + 1
+//characters so that a name too long is still detected ("." if path ends with '/', so that "/" is the root)
+//each directory of the path costs one lookup in its name index, which is updated in place by mv, rm and rmdir
+static int resolve_path(vfs_t *vfs, const char *path, dir_index **dir, char *name){
+  vfs_image *fs = vfs->fs;
+  const char *end;
+
+  if(*path == '\0')
+    return VFS_ENOENT;
+
+  if(*path == '/')
+    *dir = pin_dir(fs, fs->sb->root_block);
+  else {
+    *dir = vfs->cwd;
+    __sync_fetch_and_add(&(*dir)->refs, 1);
+  }
+
+  for(; (end = strchr(path, '/')) != NULL; path = end + 1) {
+    size_t len = end - path < MAX_NAME_LENGHT + 1 ? end - path : MAX_NAME_LENGHT + 1;
+    int status;
+
+    // empty components ("a//b" or a leading '/') are skipped
+    if(len == 0)
+      continue;
+
+    memcpy(name, path, len);
+    name[len] = '\0';
+    if((status = path_step(fs, dir, name)) != VFS_OK)
+      return status;
+  }
+
+  strncpy(name, *path != '\0' ? path : ".", MAX_NAME_LENGHT + 1);
+  name[MAX_NAME_LENGHT + 1] = '\0';
+
+  return VFS_OK;
+}
+
+//find the directory path, referenced in dir
+static int resolve_dir(vfs_t *vfs, const char *path, dir_index **dir){
+  char name[MAX_NAME_LENGHT + 2];
+  int status = resolve_path(vfs, path, dir, name);
+
+  if(status == VFS_OK)
+    status = path_step(vfs->fs, dir, name);
+
+  return status;
+}
+
+//directory entry at position pos of the directory
+static dir_entry *dir_index_entry(vfs_image *fs, dir_index *index, int pos){
+  return (dir_entry *)BLOCK(index->chain[pos / DIR_ENTRIES_PER_BLOCK]) + pos % DIR_ENTRIES_PER_BLOCK;
+}
+
+//position of the entry with the given name (-1 if it doesn't exist)
+static int dir_index_find(vfs_image *fs, dir_index *index, const char *name){
+  if(strlen(name) > MAX_NAME_LENGHT)
+    return -1;
+
+  unsigned int hash = name_hash(name);
+  int mask = index->n_slots - 1;
+
+  for(int i = hash & mask; index->slots[i] != -1; i = (i + 1) & mask)
+    if(index->hashes[i] == hash && !strncmp(dir_index_entry(fs, index, index->slots[i])->name, name, MAX_NAME_LENGHT))
+      return index->slots[i];
+
+  return -1;
+}
+
+//add the entry at position pos to the hash table
+static void dir_index_insert(vfs_image *fs, dir_index *index, int pos){
+  if((pos + 1) * 2 > index->n_slots) {
+    int old_n_slots = index->n_slots;
+    int *old_slots = index->slots;
+
+    index->n_slots *= 2;
+    index->slots = (int *)malloc(index->n_slots * sizeof(int));
+    free(index->hashes);
+    index->hashes = (unsigned int *)malloc(index->n_slots * sizeof(unsigned int));
+    memset(index->slots, -1, index->n_slots * sizeof(int));
+
+    for(int i = 0; i < old_n_slots; i++)
+      if(old_slots[i] != -1)
+        dir_index_insert(fs, index, old_slots[i]);
+    free(old_slots);
+  }
+
+  unsigned int hash = name_hash(dir_index_entry(fs, index, pos)->name);
+  int mask = index->n_slots - 1;
+  int i = hash & mask;
+
+  while(index->slots[i] != -1)
+    i = (i + 1) & mask;
+
+  index->slots[i] = pos;
+  index->hashes[i] = hash;
+
+  return;
+}
+
+//remove the entry at position pos from the hash table
+static void dir_index_remove(vfs_image *fs, dir_index *index, int pos){
+  int mask = index->n_slots - 1;
+  int i = name_hash(dir_index_entry(fs, index, pos)->name) & mask;
+
+  while(index->slots[i] != pos)
+    i = (i + 1) & mask;
+
+  // backward shift deletion, so that no tombstones are needed
+  for(int j = (i + 1) & mask; index->slots[j] != -1; j = (j + 1) & mask) {
+    int k = index->hashes[j] & mask;
+    if((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      index->slots[i] = index->slots[j];
+      index->hashes[i] = index->hashes[j];
+      i = j;
+    }
+  }
+
+  index->slots[i] = -1;
+
+  return;
+}
+
+//the entry at position from was copied to position to
+static void dir_index_move(vfs_image *fs, dir_index *index, int from, int to){
+  int mask = index->n_slots - 1;
+  int i = name_hash(dir_index_entry(fs, index, to)->name) & mask;
+
+  while(index->slots[i] != from)
+    i = (i + 1) & mask;
+
+  index->slots[i] = to;
+
+  return;
+}
+
+//the entry of a subdirectory is now at position pos of its parent, which is locked for writing
+//(recorded in the index of the subdirectory, if it has one, so that pwd doesn't search the parent)
+static void note_parent_pos(vfs_image *fs, dir_entry *entry, int pos){
+  if(entry->type != TYPE_DIR)
+    return;
+
+  pthread_rwlock_rdlock(&fs->index_lock);
+  dir_index *index = (dir_index *)int_map_get(&fs->dir_indexes, entry->first_block);
+  pthread_rwlock_unlock(&fs->index_lock);
+
+  if(index != NULL)
+    index->parent_pos = pos;
+
+  return;
+}
+
+//entry of the subdirectory that starts at block in its parent, which is locked (NULL if it is not there)
+//the parent is only searched when the position recorded in the index of the subdirectory is not known
+static dir_entry *find_subdir_entry(vfs_image *fs, dir_index *parent, int block){
+  dir_index *index = get_dir_index(fs, block);
+  int pos = index->parent_pos;
+
+  if(pos < 2 || pos >= parent->n_blocks * DIR_ENTRIES_PER_BLOCK || dir_next_pos(fs, parent, pos) != pos ||
+     dir_index_entry(fs, parent, pos)->first_block != block || dir_index_entry(fs, parent, pos)->type != TYPE_DIR) {
+    for(pos = dir_next_pos(fs, parent, 2); pos != -1; pos = dir_next_pos(fs, parent, pos + 1)) {
+      dir_entry *entry = dir_index_entry(fs, parent, pos);
+      if(entry->type == TYPE_DIR && entry->first_block == block)
+        break;
+    }
+
+    if(pos == -1)
+      return NULL;
+    index->parent_pos = pos;
+  }
+
+  return dir_index_entry(fs, parent, pos);
+}
+
+
+//copy a directory entry to the structure given to the caller
+//(the flags of a directory are in its own block, and don't change after it is created)
+static void copy_entry(vfs_image *fs, dir_entry *dir, vfs_entry_t *entry){
+  memcpy(entry->name, dir->name, MAX_NAME_LENGHT);
+  entry->name[MAX_NAME_LENGHT] = '\0';
+  entry->type = dir->type;
+  entry->size = dir->size;
+  entry->flags = dir->type == TYPE_DIR ? ((dir_entry *)BLOCK(dir->first_block))[1].size & DIR_SORTED : 0;
+  if(dir->type == TYPE_FILE && (dir->month & FILE_SPARSE))
+    entry->flags |= VFS_FILE_SPARSE;
+  if(dir->type == TYPE_FILE && (dir->month & FILE_COMPRESSED))
+    entry->flags |= VFS_FILE_COMPRESSED;
+  entry->day = dir->day;
+  entry->month = dir->month & MONTH_MASK;
+  entry->year = 1900 + dir->year;
+
+  return;
+}
+
+// ls - list the contents of the current directory
+// up to max entries are copied to entries, starting at position offset (in directory order, which
+// for a sorted directory is '.', '..' and then the other entries by name, read block by block)
+static int do_list(vfs_t *vfs, dir_index *dir, int offset, vfs_entry_t *entries, int max, int *n) {
+  vfs_image *fs = vfs->fs;
+  dir_index *index = dir;
+  int n_entries = ((dir_entry *)BLOCK(index->block))[0].size;
+
+  *n = 0;
+  if(offset < 0 || offset > n_entries)
+    return VFS_ERANGE;
+
+  if(index->fill == NULL) {
+    for(int i = offset; i < n_entries && *n < max; i++)
+      copy_entry(fs, dir_index_entry(fs, index, i), &entries[(*n)++]);
+
+    return VFS_OK;
+  }
+
+  if(offset == n_entries || max <= 0)
+    return VFS_OK;
+
+  int pos = sorted_pos(fs, index, offset), k = 0;
+  while(index->order[k] != pos / DIR_ENTRIES_PER_BLOCK)
+    k++;
+
+  for(int s = pos % DIR_ENTRIES_PER_BLOCK; k < index->n_blocks && *n < max; k++, s = 0) {
+    int b = index->order[k];
+    for(; s < index->fill[b] && *n < max; s++)
+      copy_entry(fs, dir_index_entry(fs, index, b * DIR_ENTRIES_PER_BLOCK + s), &entries[(*n)++]);
+  }
+
+  return VFS_OK;
+}
+
+
+// information about the entry name of the current directory
+static int do_stat(vfs_t *vfs, dir_index *dir, const char *name, vfs_entry_t *entry) {
+  dir_entry *found = find_dir_entry(vfs->fs, dir, name, NULL);
+
+  if(found == NULL)
+    return VFS_ENOENT;
+
+  copy_entry(vfs->fs, found, entry);
+
+  return VFS_OK;
+}
+
+
+// mkdir dir - creates a subdirectory named dir in the current directory
+static int do_mkdir(vfs_t *vfs, dir_index *dir, const char *nome_dir, int flags) {
+  vfs_image *fs = vfs->fs;
+
+  if(strlen(nome_dir) > MAX_NAME_LENGHT)
+    return VFS_ENAMETOOLONG;
+
+  if(find_dir_entry(fs, dir, nome_dir, NULL) != NULL)
+    return VFS_EEXIST;
+
+  if(make_dir(fs, dir, nome_dir, flags) == -1)
+    return VFS_ENOSPC;
+
+  return VFS_OK;
+}
+
+//create the directory name in the directory parent, locked for writing (returns its block or -1 if the disk is full)
+static int make_dir(vfs_image *fs, dir_index *parent, const char *name, int flags){
+  int new_block = get_free_block(fs);
+  if(new_block == -1)
+    return -1;
+
+  init_dir_block(fs, new_block, parent->block, flags);
+
+  dir_entry new_entry;
+  init_dir_entry(&new_entry, TYPE_DIR, name, 0, new_block);
+  // the block was taken by the transaction, so it is freed without logging it again
+  if(dir_add_entry(fs, parent, &new_entry) == -1) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    free_own_chain(fs, new_block);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return -1;
+  }
+
+  return new_block;
+}
+
+
+// cd dir - move current directory to dir
+static int do_cd(vfs_t *vfs, const char *path) {
+  dir_index *dir;
+  int status = resolve_dir(vfs, path, &dir);
+
+  if(status != VFS_OK)
+    return status;
+
+  unpin_dir(vfs->fs, vfs->cwd);
+  vfs->cwd = dir;
+
+  return VFS_OK;
+}
+
+
+// pwd - the absolute path of the current directory
+// the path is built from the end of buf, one directory at a time, and then moved to its start
+// each directory costs one lookup of its entry in the parent (see find_subdir_entry), so pwd is O(depth)
+// (called with rename_lock held, so no directory is moved or removed, and each parent is locked while it is read)
+static int do_pwd(vfs_t *vfs, char *buf, size_t size) {
+  vfs_image *fs = vfs->fs;
+  int tmp_dir = vfs->cwd->block;
+  size_t pos = size;
+
+  if(vfs->cwd->removed)
+    return VFS_ENOENT;
+
+  if(size < 2)
+    return VFS_ERANGE;
+
+  buf[--pos] = '\0';
+  buf[--pos] = '/';
+
+  while(tmp_dir != fs->sb->root_block) {
+    int prev_dir = ((dir_entry *)BLOCK(tmp_dir))[1].first_block;
+    dir_index *index = lock_dir(fs, prev_dir, 0);
+    dir_entry *entry = find_subdir_entry(fs, index, tmp_dir);
+
+    if(entry != NULL) {
+      size_t len = strnlen(entry->name, MAX_NAME_LENGHT);
+      if(pos < len + 1) {
+        unlock_dir(fs, index);
+        return VFS_ERANGE;
+      }
+
+      pos -= len;
+      memcpy(buf + pos, entry->name, len);
+      buf[--pos] = '/';
+    }
+
+    unlock_dir(fs, index);
+    tmp_dir = prev_dir;
+  }
+
+  memmove(buf, buf + pos, size - pos);
+
+  return VFS_OK;
+}
+
+
+// rmdir dir - removes the dir subdirectory (if empty) from the current directory
+static int do_rmdir(vfs_t *vfs, dir_index *dir, const char *nome_dir) {
+  vfs_image *fs = vfs->fs;
+  int pos;
+  dir_entry *entry = find_dir_entry(fs, dir, nome_dir, &pos);
+
+  if(entry == NULL)
+    return VFS_ENOENT;
+
+  if(entry->type != TYPE_DIR)
+    return VFS_ENOTDIR;
+
+  // '.' and '..' are always the first two entries
+  if(pos < 2)
+    return VFS_EINVAL;
+
+  // the directory is locked, so that nothing is added to it while it is removed
+  int del_block = entry->first_block;
+  dir_index *del_index = lock_dir(fs, del_block, 1);
+  dir_entry *del_dir = (dir_entry *)BLOCK(del_block);
+
+  if(del_dir[0].size != 2) {
+    unlock_dir(fs, del_index);
+    return VFS_ENOTEMPTY;
+  }
+
+  drop_dir_index(fs, del_index);
+  unlock_dir(fs, del_index);
+  free_block(fs, del_block);
+  dir_remove_entry(fs, dir, pos);
+
+  return VFS_OK;
+}
+
+
+// get file1 file2 - copies a standard UNIX file file1 to a file in our system file2 (compressed, with flags
+// VFS_FILE_COMPRESSED)
+static int do_get(vfs_t *vfs, const char *nome_orig, dir_index *dir, const char *nome_dest, int flags) {
+  vfs_image *fs = vfs->fs;
+
+  if(strlen(nome_dest) > MAX_NAME_LENGHT)
+    return VFS_ENAMETOOLONG;
+
+  if(find_dir_entry(fs, dir, nome_dest, NULL) != NULL)
+    return VFS_EEXIST;
+
+  struct stat statbuf;
+  if(stat(nome_orig, &statbuf) == -1)
+    return VFS_EHOST;
+
+  if((statbuf.st_mode & S_IFMT) != S_IFREG)
+    return VFS_ENOTREG;
+
+  if(statbuf.st_size > INT_MAX)
+    return VFS_EFBIG;
+
+  int req_size = (int)statbuf.st_size;
+
+  // the input is mapped, and copied straight into the runs of the new chain
+  char *input = map_input(nome_orig, req_size);
+  if(input == NULL)
+    return VFS_EHOST;
+
+  // compressed, or without its blocks of zeros, the file may take fewer blocks
+  file_layout layout;
+  plan_layout(fs, nome_orig, input, req_size, flags & VFS_FILE_COMPRESSED, &layout);
+  int data_blocks = layout.n_blocks;
+
+  int first_block = -1;
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(fs->sb->n_free_blocks >= dir_add_blocks(fs, dir, nome_dest) + data_blocks)
+    first_block = alloc_chain(fs, data_blocks, fs->sb->free_block);
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  dir_entry new_entry;
+  init_dir_entry(&new_entry, TYPE_FILE, nome_dest, req_size, first_block);
+  new_entry.month |= layout.flags;
+  copy_layout(fs, first_block, input, req_size, &layout);
+
+  // another directory may have taken the block kept for the entry
+  int status = first_block == -1 ? VFS_ENOSPC : VFS_OK;
+  if(status == VFS_OK && dir_add_entry(fs, dir, &new_entry) == -1)
+    status = VFS_ENOSPC;
+
+  if(req_size > 0)
+    munmap(input, req_size);
+
+  if(status != VFS_OK && first_block != -1) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    free_own_chain(fs, first_block);
+    pthread_mutex_unlock(&fs->alloc_lock);
+  }
+
+  return status;
+}
+
+
+// get -r dir1 dir2 - copies a UNIX directory tree dir1 into the directory dir2 (created if needed)
+// the directories are created first, then the files are copied by a pool of worker threads
+// once the tree is being imported, the errors are reported for each entry, and the last one is returned
+// (the directories are locked here, one at a time, so that the other handles can use them during the import)
+static int do_get_tree(vfs_t *vfs, const char *host_dir, const char *dest_path, int n_workers, int flags, vfs_error_fn report, void *arg) {
+  vfs_image *fs = vfs->fs;
+  import_state state = { .fs = fs, .status = VFS_OK, .compress = flags & VFS_FILE_COMPRESSED, .report = report, .arg = arg };
+  char nome_dest[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+
+  struct stat statbuf;
+  if(stat(host_dir, &statbuf) == -1)
+    return VFS_EHOST;
+
+  if((statbuf.st_mode & S_IFMT) != S_IFDIR)
+    return VFS_ENOTDIR;
+
+  int status = resolve_path(vfs, dest_path, &dir, nome_dest);
+  if(status != VFS_OK)
+    return status;
+
+  if((status = lock_index(dir, 0)) == VFS_OK) {
+    dir_entry *dest = find_dir_entry(fs, dir, nome_dest, NULL);
+    if(dest != NULL && dest->type != TYPE_DIR)
+      status = VFS_ENOTDIR;
+    else if(dest == NULL && strlen(nome_dest) > MAX_NAME_LENGHT)
+      status = VFS_ENAMETOOLONG;
+    else if(dest != NULL)
+      state.dest = pin_dir(fs, dest->first_block);
+    pthread_rwlock_unlock(&dir->lock);
+  }
+
+  if(status == VFS_OK && state.dest != NULL && (status = lock_index(state.dest, 0)) != VFS_OK)
+    unpin_dir(fs, state.dest);
+
+  if(status != VFS_OK) {
+    unpin_dir(fs, dir);
+    return status;
+  }
+
+  // lists the tree and the space it needs (with the block and the entry of a new destination)
+  long req_blocks = state.dest == NULL ? 2 : 0;
+  import_walk(&state, host_dir, -1, &req_blocks);
+  if(state.dest != NULL)
+    pthread_rwlock_unlock(&state.dest->lock);
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  int free_blocks = fs->sb->n_free_blocks;
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  if(req_blocks > free_blocks)
+    import_error(&state, host_dir, VFS_ENOSPC);
+  else if(state.dest == NULL && (status = import_dest(&state, dir, nome_dest)) != VFS_OK)
+    import_error(&state, host_dir, status);
+  else {
+    // the directories are listed before their contents
+    for(int i = 0; i < state.n_jobs; i++) {
+      import_job *job = &state.jobs[i];
+      dir_index *parent = job->parent == -1 ? state.dest : state.jobs[job->parent].index;
+
+      if(job->type != TYPE_DIR || parent == NULL)
+        continue;
+
+      txn_begin(fs);
+      if(lock_index(parent, 1) == VFS_OK) {
+        int block = -1;
+        if(find_dir_entry(fs, parent, job->name, NULL) != NULL)
+          import_error(&state, job->path, VFS_EEXIST);
+        else if((block = make_dir(fs, parent, job->name, fs->sb->dir_flags)) != -1)
+          job->index = pin_dir(fs, block);
+        txn_commit(fs);
+        pthread_rwlock_unlock(&parent->lock);
+      }
+      txn_end(fs);
+    }
+
+    int n = state.n_workers = n_workers > 0 ? n_workers : sysconf(_SC_NPROCESSORS_ONLN);
+    import_worker *workers = (import_worker *)calloc(n, sizeof(import_worker));
+
+    // the blocks of the directories were taken, what is left is needed by the files (at most)
+    pthread_mutex_lock(&fs->alloc_lock);
+    state.pending = req_blocks - (free_blocks - fs->sb->n_free_blocks);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    pthread_mutex_init(&state.lock, NULL);
+    for(int i = 0; i < n; i++) {
+      workers[i].state = &state;
+      pthread_create(&workers[i].thread, NULL, import_worker_run, &workers[i]);
+    }
+    for(int i = 0; i < n; i++)
+      pthread_join(workers[i].thread, NULL);
+    pthread_mutex_destroy(&state.lock);
+
+    free(workers);
+  }
+
+  for(int i = 0; i < state.n_jobs; i++) {
+    if(state.jobs[i].index != NULL)
+      unpin_dir(fs, state.jobs[i].index);
+    free(state.jobs[i].path);
+  }
+  free(state.jobs);
+  if(state.dest != NULL)
+    unpin_dir(fs, state.dest);
+  unpin_dir(fs, dir);
+
+  return state.status;
+}
+
+//create the directory name that receives the tree in the directory parent, and reference it
+static int import_dest(import_state *state, dir_index *parent, const char *name){
+  vfs_image *fs = state->fs;
+  int block;
+
+  txn_begin(fs);
+  int status = lock_index(parent, 1);
+  if(status != VFS_OK) {
+    txn_end(fs);
+    return status;
+  }
+
+  // another handle may have created it since it was looked up
+  if(find_dir_entry(fs, parent, name, NULL) != NULL)
+    status = VFS_EEXIST;
+  else if((block = make_dir(fs, parent, name, fs->sb->dir_flags)) == -1)
+    status = VFS_ENOSPC;
+  else
+    state->dest = pin_dir(fs, block);
+  txn_commit(fs);
+  pthread_rwlock_unlock(&parent->lock);
+  txn_end(fs);
+
+  return status;
+}
+
+//list the tree under path as jobs, with parent as their directory, adding the blocks it needs to req_blocks
+static int import_walk(import_state *state, const char *path, int parent, long *req_blocks){
+  vfs_image *fs = state->fs;
+  DIR *dir = opendir(path);
+  struct dirent *ent;
+  int n_entries = 0;
+
+  if(dir == NULL) {
+    import_error(state, path, VFS_EHOST);
+    return 0;
+  }
+
+  while((ent = readdir(dir)) != NULL) {
+    if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+      continue;
+
+    // an entry whose path can't be built is left out, as one that can't be read
+    size_t length = strlen(path) + strlen(ent->d_name) + 2;
+    char *child = (char *)malloc(length);
+    if(child == NULL) {
+      import_error(state, path, VFS_EHOST);
+      continue;
+    }
+    snprintf(child, length, "%s/%s", path, ent->d_name);
+
+    int status = VFS_OK;
+    struct stat statbuf;
+    if(lstat(child, &statbuf) == -1)
+      status = VFS_EHOST;
+    else if((statbuf.st_mode & S_IFMT) != S_IFREG && (statbuf.st_mode & S_IFMT) != S_IFDIR)
+      status = VFS_ENOTREG;
+    else if(strlen(ent->d_name) > MAX_NAME_LENGHT)
+      status = VFS_ENAMETOOLONG;
+    else if(statbuf.st_size > INT_MAX && (statbuf.st_mode & S_IFMT) == S_IFREG)
+      status = VFS_EFBIG;
+    else if(parent == -1 && state->dest != NULL && find_dir_entry(fs, state->dest, ent->d_name, NULL) != NULL)
+      status = VFS_EEXIST;
+
+    if(status != VFS_OK) {
+      import_error(state, child, status);
+      free(child);
+      continue;
+    }
+
+    if(state->n_jobs == state->max_jobs) {
+      state->max_jobs = state->max_jobs ? 2 * state->max_jobs : 64;
+      state->jobs = (import_job *)realloc(state->jobs, state->max_jobs * sizeof(import_job));
+    }
+
+    int i = state->n_jobs++;
+    state->jobs[i].path = child;
+    strcpy(state->jobs[i].name, ent->d_name);
+    state->jobs[i].parent = parent;
+    state->jobs[i].index = NULL;
+    n_entries++;
+
+    if((statbuf.st_mode & S_IFMT) == S_IFDIR) {
+      state->jobs[i].type = TYPE_DIR;
+      state->jobs[i].size = 0;
+      *req_blocks += 1;
+      import_walk(state, child, i, req_blocks);
+    }
+    else {
+      state->jobs[i].type = TYPE_FILE;
+      state->jobs[i].size = (int)statbuf.st_size;
+      *req_blocks += statbuf.st_size > 0 ? (statbuf.st_size + fs->sb->block_size - 1) / fs->sb->block_size : 1;
+    }
+  }
+
+  closedir(dir);
+
+  // blocks for the new entries of the directory (the blocks of a sorted one may be half full)
+  *req_blocks += (fs->sb->dir_flags & DIR_SORTED ? 2 : 1) * n_entries / DIR_ENTRIES_PER_BLOCK + 1;
+
+  return n_entries;
+}
+
+//record an entry of the host tree that is not imported
+static void import_error(import_state *state, const char *path, int status){
+  state->status = status;
+  if(state->report != NULL)
+    state->report(path, status, state->arg);
+
+  return;
+}
+
+//copy the files of the import jobs, until there are no more jobs
+static void *import_worker_run(void *arg){
+  import_worker *worker = (import_worker *)arg;
+  import_state *state = worker->state;
+  vfs_image *fs = state->fs;
+  int i;
+
+  while((i = __sync_fetch_and_add(&state->next_job, 1)) < state->n_jobs) {
+    import_job *job = &state->jobs[i];
+    dir_index *dir = job->parent == -1 ? state->dest : state->jobs[job->parent].index;
+
+    if(job->type != TYPE_FILE || dir == NULL)
+      continue;
+
+    // the walk counted a block of the chain for each block of the file in the blocks pending
+    long counted = job->size > 0 ? ((long)job->size + fs->sb->block_size - 1) / fs->sb->block_size : 1;
+    char *input = map_input(job->path, job->size);
+    if(input == NULL) {
+      __sync_fetch_and_sub(&state->pending, counted);
+      pthread_mutex_lock(&state->lock);
+      import_error(state, job->path, VFS_EHOST);
+      pthread_mutex_unlock(&state->lock);
+      continue;
+    }
+
+    // compressed, or without its blocks of zeros, the file may take fewer blocks, and the others are not pending
+    file_layout layout;
+    plan_layout(fs, job->path, input, job->size, state->compress, &layout);
+    __sync_fetch_and_sub(&state->pending, counted - layout.n_blocks);
+
+    // the copy is done without any lock
+    txn_begin(fs);
+    int first_block = import_alloc(worker, layout.n_blocks);
+    copy_layout(fs, first_block, input, job->size, &layout);
+
+    if(job->size > 0)
+      munmap(input, job->size);
+
+    // the directory may have been removed, or given an entry with the same name, by another handle
+    int status = first_block == -1 ? VFS_ENOSPC : lock_index(dir, 1);
+    if(status == VFS_OK) {
+      dir_entry new_entry;
+      init_dir_entry(&new_entry, TYPE_FILE, job->name, job->size, first_block);
+      new_entry.month |= layout.flags;
+      if(find_dir_entry(fs, dir, job->name, NULL) != NULL)
+        status = VFS_EEXIST;
+      else if(dir_add_entry(fs, dir, &new_entry) == -1)
+        status = VFS_ENOSPC;
+      if(status == VFS_OK)
+        txn_commit(fs);
+      pthread_rwlock_unlock(&dir->lock);
+    }
+
+    if(status != VFS_OK) {
+      if(first_block != -1) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        free_own_chain(fs, first_block);
+        pthread_mutex_unlock(&fs->alloc_lock);
+      }
+      txn_commit(fs);
+
+      pthread_mutex_lock(&state->lock);
+      import_error(state, job->path, status);
+      pthread_mutex_unlock(&state->lock);
+    }
+    txn_end(fs);
+  }
+
+  // returns the blocks reserved and not used
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(worker->res_length > 0)
+    unreserve_run(fs, worker->res_start, worker->res_length);
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  return NULL;
+}
+
+//allocate a chain of n blocks for a worker, from its reservation of contiguous blocks
+//the reservation is refilled (IMPORT_RESERVATION blocks) under alloc_lock when it runs out
+static int import_alloc(import_worker *worker, int n){
+  import_state *state = worker->state;
+  vfs_image *fs = state->fs;
+
+  if(worker->res_length < n) {
+    int first_block = -1;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    if(worker->res_length > 0)
+      unreserve_run(fs, worker->res_start, worker->res_length);
+    worker->res_length = 0;
+
+    // the reservations only use the space that is not needed by the other files,
+    // so that the last files never find the free blocks reserved by other workers
+    if(n < IMPORT_RESERVATION && fs->sb->n_free_blocks - __atomic_load_n(&state->pending, __ATOMIC_RELAXED) >= (long)state->n_workers * IMPORT_RESERVATION)
+      worker->res_length = reserve_run(fs, IMPORT_RESERVATION, fs->sb->free_block, &worker->res_start);
+
+    // large files (or a disk without long enough runs) are allocated directly
+    if(worker->res_length < n) {
+      if(worker->res_length > 0)
+        unreserve_run(fs, worker->res_start, worker->res_length);
+      worker->res_length = 0;
+      first_block = alloc_chain(fs, n, fs->sb->free_block);
+    }
+    if(first_block != -1)
+      __sync_fetch_and_sub(&state->pending, n);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    if(worker->res_length == 0)
+      return first_block;
+  }
+
+  __sync_fetch_and_sub(&state->pending, n);
+
+  // the reserved run is only in the block map (so that it is not lost if the image is not closed)
+  int first_block = worker->res_start;
+  journal_free_runs(fs, &(extent){ .start = first_block, .length = n }, 1);
+  link_run(fs, first_block, n);
+  worker->res_start += n;
+  worker->res_length -= n;
+
+  return first_block;
+}
+
+
+// put file1 file2 - copy a file from our system file1 to a normal UNIX file file2
+static int do_put(vfs_t *vfs, dir_index *dir, const char *nome_orig, const char *nome_dest) {
+  vfs_image *fs = vfs->fs;
+  dir_entry *entry = find_dir_entry(fs, dir, nome_orig, NULL);
+
+  if(entry == NULL)
+    return VFS_ENOENT;
+
+  if(entry->type != TYPE_FILE)
+    return VFS_EISDIR;
+
+  int f_output = open(nome_dest, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  struct stat statbuf;
+
+  if(f_output == -1)
+    return VFS_EHOST;
+
+  // the holes of a sparse file are left as holes of a regular file, which is then extended over the last one
+  int regular = fstat(f_output, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+  int status = write_file_range(fs, f_output, entry, 0, entry->size, regular);
+  if(status == VFS_OK && regular && ftruncate(f_output, entry->size) == -1)
+    status = VFS_EHOST;
+
+  close(f_output);
+
+  return status;
+}
+
+
+// read size bytes (or up to the end) of the file name, starting at offset, to buf (n gets the number of bytes read)
+static int do_read(vfs_t *vfs, dir_index *dir, const char *nome_fich, int offset, char *buf, int size, int *n) {
+  vfs_image *fs = vfs->fs;
+  dir_entry *entry = find_dir_entry(fs, dir, nome_fich, NULL);
+
+  *n = 0;
+  if(entry == NULL)
+    return VFS_ENOENT;
+
+  if(entry->type != TYPE_FILE)
+    return VFS_EISDIR;
+
+  if(offset < 0 || offset > entry->size || size < 0)
+    return VFS_ERANGE;
+
+  int end = size < entry->size - offset ? offset + size : entry->size, ahead = 0;
+  extent_map *map = get_extent_map(fs, entry->first_block, entry->month & ~MONTH_MASK);
+
+  if(entry->month & FILE_COMPRESSED) {
+    if(read_frames(fs, map, offset, end, buf) == -1)
+      return VFS_EBADFS;
+  }
+  else
+    for(int pos = offset; pos < end; ) {
+      int run;
+      prefetch_file(fs, map, pos, end, &ahead);
+      char *data = file_run(fs, map, pos, &run);
+
+      if(run > end - pos)
+        run = end - pos;
+
+      if(data == NULL)
+        memset(buf + pos - offset, 0, run);
+      else
+        memcpy(buf + pos - offset, data, run);
+      pos += run;
+    }
+
+  *n = end - offset;
+
+  return VFS_OK;
+}
+
+
+// cat file - writes the contents of the file file to fd
+// cat file offset [length] - writes length bytes (or up to the end, if length is negative) starting at offset
+static int do_cat(vfs_t *vfs, dir_index *dir, const char *nome_fich, int offset, int length, int fd) {
+  vfs_image *fs = vfs->fs;
+  dir_entry *entry = find_dir_entry(fs, dir, nome_fich, NULL);
+
+  if(entry == NULL)
+    return VFS_ENOENT;
+
+  if(entry->type != TYPE_FILE)
+    return VFS_EISDIR;
+
+  if(offset < 0 || offset > entry->size)
+    return VFS_ERANGE;
+
+  int end = entry->size;
+  if(length >= 0 && length < end - offset)
+    end = offset + length;
+
+  return write_file_range(fs, fd, entry, offset, end, 0);
+}
+
+
+// cp file1 file2 - copy the file file1 to file2 (replacing file2 if it is a file)
+// cp file dir - copy the file file to the dir subdirectory
+// (called with rename_lock held and the directories of both paths locked, the subdirectory is locked here)
+static int do_cp(vfs_t *vfs, dir_index *src_dir, const char *nome_orig, dir_index *dest_dir, const char *nome_dest) {
+  vfs_image *fs = vfs->fs;
+  dir_entry *entry = find_dir_entry(fs, src_dir, nome_orig, NULL);
+  dir_index *exp_dir = dest_dir;
+
+  if(entry == NULL)
+    return VFS_ENOENT;
+
+  if(entry->type != TYPE_FILE)
+    return VFS_EISDIR;
+
+  int input_block = entry->first_block, req_size = entry->size, flags = entry->month & ~MONTH_MASK;
+
+  dir_entry *dest = find_dir_entry(fs, dest_dir, nome_dest, NULL);
+  if(dest == entry)
+    return VFS_ESAME;
+
+  if(dest != NULL && dest->type == TYPE_DIR) {
+    nome_dest = nome_orig;
+    exp_dir = lock_target(fs, dest->first_block, src_dir, dest_dir);
+
+    if(find_dir_entry(fs, exp_dir, nome_dest, NULL) != NULL) {
+      unlock_target(fs, exp_dir, src_dir, dest_dir);
+      return VFS_EEXIST;
+    }
+  }
+  else if(dest != NULL) {
+    // the copy is made before the chain of the old file is released, so a failed copy leaves it as it was
+    if(reserve_release(fs, dest->first_block) == -1)
+      return VFS_ENOSPC;
+
+    int first_block = take_chain_copy(fs, input_block, req_size, flags, 0);
+    if(first_block == -1)
+      return VFS_ENOSPC;
+
+    int old_block = dest->first_block;
+    dir_entry new_entry;
+    init_dir_entry(&new_entry, TYPE_FILE, dest->name, req_size, first_block);
+    new_entry.month |= flags;
+
+    journal_bytes(fs, dest, sizeof(dir_entry));
+    *dest = new_entry;
+    mark_dirty(fs, dest, sizeof(dir_entry));
+    release_chain(fs, old_block);
+
+    return VFS_OK;
+  }
+  else if(strlen(nome_dest) > MAX_NAME_LENGHT)
+    return VFS_ENAMETOOLONG;
+
+  int status = cp_chain(fs, exp_dir, nome_dest, input_block, req_size, flags);
+
+  unlock_target(fs, exp_dir, src_dir, dest_dir);
+
+  return status;
+}
+
+//add a copy named name of the file with the chain input_block (and the flags of its entry) to the directory dir,
+//locked for writing
+static int cp_chain(vfs_image *fs, dir_index *dir, const char *name, int input_block, int req_size, int flags){
+  int first_block = take_chain_copy(fs, input_block, req_size, flags, dir_add_blocks(fs, dir, name));
+  dir_entry new_entry;
+
+  if(first_block == -1)
+    return VFS_ENOSPC;
+
+  init_dir_entry(&new_entry, TYPE_FILE, name, req_size, first_block);
+  new_entry.month |= flags;
+  if(dir_add_entry(fs, dir, &new_entry) == -1) {
+    if(first_block == input_block)
+      release_chain(fs, first_block);
+    else {
+      pthread_mutex_lock(&fs->alloc_lock);
+      free_own_chain(fs, first_block);
+      pthread_mutex_unlock(&fs->alloc_lock);
+    }
+    return VFS_ENOSPC;
+  }
+
+  return VFS_OK;
+}
+
+//take a reference to the chain input_block of a file for a copy of it (or copy its blocks to a new chain),
+//keeping entry_blocks free for the entry of the copy; returns the first block of the copy (-1 if the disk is full)
+static int take_chain_copy(vfs_image *fs, int input_block, int req_size, int flags, int entry_blocks){
+  int data_blocks = flags ? chain_blocks(fs, input_block, flags) : req_size > 0 ? ((long)req_size + fs->sb->block_size - 1) / fs->sb->block_size : 1;
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(fs->sb->n_free_blocks < entry_blocks) {
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return -1;
+  }
+
+  // the copy shares the chain of the original, no block is copied
+  unsigned short *shares = block_shares(fs, input_block, 1);
+  if(shares != NULL && *shares < USHRT_MAX) {
+    journal_share(fs, input_block, 1);
+    (*shares)++;
+    mark_dirty(fs, shares, sizeof(unsigned short));
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return input_block;
+  }
+
+  // without room for the table of shared chains (or too many copies) the blocks are copied
+  int first_block = -1;
+  if(fs->sb->n_free_blocks >= entry_blocks + data_blocks)
+    first_block = alloc_chain(fs, data_blocks, fs->sb->free_block);
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  if(first_block == -1)
+    return -1;
+
+  // the chain of a sparse or compressed file is copied as it is, with its table
+  if(flags)
+    copy_chain(fs, input_block, first_block, data_blocks);
+  else {
+    extent_map *input_map = get_extent_map(fs, input_block, 0), *output_map = get_extent_map(fs, first_block, 0);
+    int ahead = 0;
+
+    // copy the largest span that is contiguous both in the input and in the output
+    for(int offset = 0; offset < req_size; ) {
+      int n_input, n_output;
+      prefetch_file(fs, input_map, offset, req_size, &ahead);
+      char *input = file_run(fs, input_map, offset, &n_input);
+      char *output = file_run(fs, output_map, offset, &n_output);
+
+      int n = n_input < n_output ? n_input : n_output;
+      if(n > req_size - offset)
+        n = req_size - offset;
+
+      memcpy(output, input, n);
+      mark_dirty(fs, output, n);
+      offset += n;
+    }
+  }
+
+  return first_block;
+}
+
+// mv file1 file2 - move file from file1 to file2
+// mv file dir - move the file file to the dir dir
+// (called with rename_lock held and the directories of both paths locked, the destination directory
+// and a moved directory are locked here)
+static int do_mv(vfs_t *vfs, dir_index *src_dir, const char *nome_orig, dir_index *dest_dir, const char *nome_dest) {
+  vfs_image *fs = vfs->fs;
+  int pos;
+  dir_index *exp_dir = dest_dir;
+  dir_entry *entry = find_dir_entry(fs, src_dir, nome_orig, &pos);
+
+  if(entry == NULL)
+    return VFS_ENOENT;
+
+  // '.' and '..' are always the first two entries
+  if(pos < 2)
+    return VFS_EINVAL;
+
+  dir_entry *dest = find_dir_entry(fs, dest_dir, nome_dest, NULL);
+  if(dest == entry)
+    return VFS_OK;
+
+  // a directory cannot be moved into itself or one of its subdirectories
+  int exp_block = dest != NULL && dest->type == TYPE_DIR ? dest->first_block : dest_dir->block;
+  if(entry->type == TYPE_DIR && is_subdir(fs, exp_block, entry->first_block))
+    return VFS_EINVAL;
+
+  if(dest != NULL && dest->type == TYPE_DIR) {
+    nome_dest = nome_orig;
+    exp_dir = lock_target(fs, exp_block, src_dir, dest_dir);
+
+    if(find_dir_entry(fs, exp_dir, nome_dest, NULL) != NULL) {
+      unlock_target(fs, exp_dir, src_dir, dest_dir);
+      return VFS_EEXIST;
+    }
+  }
+  else if(dest != NULL) {
+    int status = do_rm(vfs, dest_dir, nome_dest);
+    if(status != VFS_OK)
+      return status;
+
+    // removing the destination may have moved the origin entry
+    if(dest_dir == src_dir)
+      entry = find_dir_entry(fs, src_dir, nome_orig, &pos);
+  }
+  else if(strlen(nome_dest) > MAX_NAME_LENGHT)
+    return VFS_ENAMETOOLONG;
+
+  // a sorted directory keeps its order: the entry is added with the new name, and the old one removed
+  if(exp_dir == src_dir && src_dir->fill != NULL) {
+    dir_entry renamed = *entry;
+    memset(renamed.name, 0, MAX_NAME_LENGHT);
+    memcpy(renamed.name, nome_dest, strlen(nome_dest));
+
+    if(dir_add_entry(fs, src_dir, &renamed) == -1)
+      return VFS_ENOSPC;
+
+    find_dir_entry(fs, src_dir, nome_orig, &pos);
+    dir_remove_entry(fs, src_dir, pos);
+
+    return VFS_OK;
+  }
+
+  // an entry renamed in the same directory keeps its place
+  if(exp_dir == src_dir) {
+    journal_bytes(fs, entry, sizeof(dir_entry));
+    dir_index_remove(fs, src_dir, pos);
+    memset(entry->name, 0, MAX_NAME_LENGHT);
+    memcpy(entry->name, nome_dest, strlen(nome_dest));
+    mark_dirty(fs, entry, sizeof(dir_entry));
+    dir_index_insert(fs, src_dir, pos);
+
+    return VFS_OK;
+  }
+
+  dir_entry moved = *entry;
+  memset(moved.name, 0, MAX_NAME_LENGHT);
+  memcpy(moved.name, nome_dest, strlen(nome_dest));
+
+  // the entry is added first, so that it is never lost if the disk is full
+  if(dir_add_entry(fs, exp_dir, &moved) == -1) {
+    unlock_target(fs, exp_dir, src_dir, dest_dir);
+    return VFS_ENOSPC;
+  }
+
+  dir_remove_entry(fs, src_dir, pos);
+
+  // a moved directory must point to its new parent
+  if(moved.type == TYPE_DIR) {
+    dir_index *moved_dir = lock_dir(fs, moved.first_block, 1);
+    journal_bytes(fs, &((dir_entry *)BLOCK(moved.first_block))[1], sizeof(dir_entry));
+    ((dir_entry *)BLOCK(moved.first_block))[1].first_block = exp_dir->block;
+    mark_dirty(fs, &((dir_entry *)BLOCK(moved.first_block))[1], sizeof(dir_entry));
+    unlock_dir(fs, moved_dir);
+  }
+
+  unlock_target(fs, exp_dir, src_dir, dest_dir);
+
+  return VFS_OK;
+}
+
+//whether the directory block is dir_block or one of its subdirectories (following the '..' entries up to the root)
+static int is_subdir(vfs_image *fs, int block, int dir_block){
+  while(block != dir_block && block != fs->sb->root_block)
+    block = ((dir_entry *)BLOCK(block))[1].first_block;
+
+  return block == dir_block;
+}
+
+
+// rm file - removes the file file
+static int do_rm(vfs_t *vfs, dir_index *dir, const char *nome_fich) {
+  vfs_image *fs = vfs->fs;
+  int pos;
+  dir_entry *entry = find_dir_entry(fs, dir, nome_fich, &pos);
+
+  if(entry == NULL)
+    return VFS_ENOENT;
+
+  if(entry->type != TYPE_FILE)
+    return VFS_EISDIR;
+
+  if(reserve_release(fs, entry->first_block) == -1)
+    return VFS_ENOSPC;
+
+  release_chain(fs, entry->first_block);
+
+  dir_remove_entry(fs, dir, pos);
+
+  return VFS_OK;
+}
+
+
+//enter an operation that changes the image (before it takes any lock), waiting while defrag moves blocks
+static void gate_enter(vfs_image *fs){
+  layout_gate *gate = &fs->gate;
+
+  // the count is raised before moving is read, and defrag sets moving before it reads the count,
+  // so either the operation waits for defrag or defrag waits for the operation
+  while(__atomic_add_fetch(&gate->n_changing, 1, __ATOMIC_SEQ_CST) > 0 && __atomic_load_n(&gate->moving, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&gate->lock);
+    if(__atomic_sub_fetch(&gate->n_changing, 1, __ATOMIC_SEQ_CST) == 0)
+      pthread_cond_broadcast(&gate->cond);
+    while(gate->moving)
+      pthread_cond_wait(&gate->cond, &gate->lock);
+    pthread_mutex_unlock(&gate->lock);
+  }
+
+  return;
+}
+
+static void gate_leave(vfs_image *fs){
+  layout_gate *gate = &fs->gate;
+
+  if(__atomic_sub_fetch(&gate->n_changing, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&gate->moving, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&gate->lock);
+    pthread_cond_broadcast(&gate->cond);
+    pthread_mutex_unlock(&gate->lock);
+  }
+
+  return;
+}
+
+//stop the operations that change the image, once the ones in progress end (the ones that only read go on)
+static void gate_close(vfs_image *fs){
+  layout_gate *gate = &fs->gate;
+
+  pthread_mutex_lock(&gate->lock);
+  while(gate->moving)
+    pthread_cond_wait(&gate->cond, &gate->lock);
+  __atomic_store_n(&gate->moving, 1, __ATOMIC_SEQ_CST);
+  while(__atomic_load_n(&gate->n_changing, __ATOMIC_SEQ_CST) > 0)
+    pthread_cond_wait(&gate->cond, &gate->lock);
+  pthread_mutex_unlock(&gate->lock);
+
+  return;
+}
+
+static void gate_open(vfs_image *fs){
+  layout_gate *gate = &fs->gate;
+
+  pthread_mutex_lock(&gate->lock);
+  __atomic_store_n(&gate->moving, 0, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&gate->cond);
+  pthread_mutex_unlock(&gate->lock);
+
+  return;
+}
+
+//list the chains of the tree in the order of the layout, and the owner of each block
+static void layout_scan(vfs_image *fs, layout *lt){
+  int *pending = NULL, n_pending = 0, max_pending = 0;  // subdirectories still to list: chain of the parent, position and block
+
+  lt->owner = (int *)calloc(N_BLOCKS, sizeof(int));
+
+  for(int dir = layout_add(fs, lt, TYPE_DIR, fs->sb->root_block, -1, 0); ; ) {
+    dir_index *index = lock_dir(fs, lt->chains[dir].first_block, 0);
+    int first_pending = n_pending;
+
+    for(int pos = dir_next_pos(fs, index, 2); pos != -1; pos = dir_next_pos(fs, index, pos + 1)) {
+      dir_entry *entry = dir_index_entry(fs, index, pos);
+
+      if(entry->type == TYPE_FILE)
+        layout_add(fs, lt, TYPE_FILE, entry->first_block, dir, pos);
+      else {
+        if(n_pending == max_pending) {
+          max_pending = max_pending ? 2 * max_pending : 64;
+          pending = (int *)realloc(pending, 3 * max_pending * sizeof(int));
+        }
+        pending[3 * n_pending] = dir;
+        pending[3 * n_pending + 1] = pos;
+        pending[3 * n_pending + 2] = entry->first_block;
+        n_pending++;
+      }
+    }
+    unlock_dir(fs, index);
+
+    // the subdirectories are taken from the end, so they are put in reverse order
+    for(int i = first_pending, j = n_pending - 1; i < j; i++, j--)
+      for(int k = 0; k < 3; k++) {
+        int tmp = pending[3 * i + k];
+        pending[3 * i + k] = pending[3 * j + k];
+        pending[3 * j + k] = tmp;
+      }
+
+    if(n_pending == 0)
+      break;
+
+    n_pending--;
+    dir = layout_add(fs, lt, TYPE_DIR, pending[3 * n_pending + 2], pending[3 * n_pending], pending[3 * n_pending + 1]);
+  }
+
+  // the table of shared chains goes after the tree, the journal and the blocks reserved by get -r stay where they are
+  if(fs->sb->share_table != 0)
+    layout_add(fs, lt, TYPE_FILE, fs->sb->share_table, -1, 0);
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  for(int b = find_bit(fs, 0, N_BLOCKS, 1); b < N_BLOCKS; b = find_bit(fs, b + 1, N_BLOCKS, 1))
+    if(lt->owner[b] == 0)
+      lt->owner[b] = -1;
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  free(pending);
+
+  return;
+}
+
+//add the chain starting at first_block, with its entry at position pos of the directory chain dir (-1 for the root
+//and the table of shared chains)
+//a chain that is already there (a copy made by cp) only gets the entry (returns the chain)
+static int layout_add(vfs_image *fs, layout *lt, char type, int first_block, int dir, int pos){
+  int c = lt->owner[first_block] - 1;
+
+  if(c < 0 || lt->chains[c].first_block != first_block) {
+    if(lt->n_chains == lt->max_chains) {
+      lt->max_chains = lt->max_chains ? 2 * lt->max_chains : 64;
+      lt->chains = (layout_chain *)realloc(lt->chains, lt->max_chains * sizeof(layout_chain));
+    }
+
+    c = lt->n_chains++;
+    lt->chains[c] = (layout_chain){ .first_block = first_block, .n_blocks = 0, .type = type, .refs = -1 };
+    for(int b = first_block; b != -1; b = fs->fat[b]) {
+      lt->owner[b] = c + 1;
+      lt->chains[c].n_blocks++;
+    }
+  }
+
+  if(dir != -1) {
+    if(lt->n_refs == lt->max_refs) {
+      lt->max_refs = lt->max_refs ? 2 * lt->max_refs : 64;
+      lt->refs = (layout_ref *)realloc(lt->refs, lt->max_refs * sizeof(layout_ref));
+    }
+
+    lt->refs[lt->n_refs] = (layout_ref){ .dir = dir, .pos = pos, .next = lt->chains[c].refs };
+    lt->chains[c].refs = lt->n_refs++;
+  }
+
+  return c;
+}
+
+//fragmentation of the chains: percentage of the links between their blocks that don't go to the next block
+static double layout_score(vfs_image *fs, layout *lt){
+  long n_links = 0, n_breaks = 0;
+
+  for(int c = 0; c < lt->n_chains; c++)
+    for(int b = lt->chains[c].first_block; fs->fat[b] != -1; b = fs->fat[b]) {
+      n_links++;
+      if(fs->fat[b] != b + 1)
+        n_breaks++;
+    }
+
+  return n_links > 0 ? 100.0 * n_breaks / n_links : 0;
+}
+
+//first block from start on where the n blocks of chain c can be laid out: blocks that are free or of the chains
+//after c (returns -1 if there is none)
+static int layout_target(vfs_image *fs, layout *lt, int c, int start, int n){
+  for(int b = start; b < start + n && start + n <= N_BLOCKS; b++)
+    if(lt->owner[b] == -1 || (lt->owner[b] > 0 && lt->owner[b] - 1 < c))
+      start = b + 1;
+
+  return start + n <= N_BLOCKS ? start : -1;
+}
+
+//whether the chain that starts at block is the n blocks from target on, in order
+static int layout_in_place(vfs_image *fs, int block, int target, int n){
+  if(block != target)
+    return 0;
+
+  for(int b = target; b < target + n - 1; b++)
+    if(fs->fat[b] != b + 1)
+      return 0;
+
+  return fs->fat[target + n - 1] == -1;
+}
+
+//lock the directory that starts at block for writing, for the move in progress (if it is not locked yet)
+//(defrag holds rename_lock, so the directories are locked in any order)
+static dir_index *layout_lock(vfs_image *fs, layout *lt, int block){
+  for(int i = 0; i < lt->n_locked; i++)
+    if(lt->locked[i]->block == block)
+      return lt->locked[i];
+
+  if(lt->n_locked == lt->max_locked) {
+    lt->max_locked = lt->max_locked ? 2 * lt->max_locked : 16;
+    lt->locked = (dir_index **)realloc(lt->locked, lt->max_locked * sizeof(dir_index *));
+  }
+
+  return lt->locked[lt->n_locked++] = lock_dir(fs, block, 1);
+}
+
+//move chain c to the free blocks [lo, hi) (exact), or out of them, in a transaction of its own
+//the entries that point to it are updated and its old blocks freed (returns the blocks moved, or -1 if there is no room)
+//(the root keeps its first block, only the others are moved)
+static int move_chain(vfs_image *fs, layout *lt, int c, int lo, int hi, int exact){
+  layout_chain *chain = &lt->chains[c];
+  int root = chain->first_block == fs->sb->root_block;
+  int old_start = root ? fs->fat[chain->first_block] : chain->first_block;
+  int n = root ? chain->n_blocks - 1 : chain->n_blocks;
+  int new_start = -1;
+
+  txn_start(fs);
+
+  // the directories with an entry of the chain are locked, and for a directory itself and its subdirectories
+  // (whose entries '.' and '..' point to it)
+  lt->n_locked = 0;
+  dir_index *index = NULL;
+  if(chain->type == TYPE_DIR) {
+    index = layout_lock(fs, lt, chain->first_block);
+    if(!root)
+      layout_lock(fs, lt, lt->chains[lt->refs[chain->refs].dir].first_block);
+    for(int pos = dir_next_pos(fs, index, 2); pos != -1; pos = dir_next_pos(fs, index, pos + 1))
+      if(dir_index_entry(fs, index, pos)->type == TYPE_DIR)
+        layout_lock(fs, lt, dir_index_entry(fs, index, pos)->first_block);
+  }
+  else
+    for(int r = chain->refs; r != -1; r = lt->refs[r].next)
+      layout_lock(fs, lt, lt->chains[lt->refs[r].dir].first_block);
+
+  // room for the records of the entries that point to the chain (or to its directory), of its copies and of its
+  // old runs, before anything is changed
+  long n_records = 3;
+  if(chain->type == TYPE_DIR)
+    for(int pos = dir_next_pos(fs, index, 2); pos != -1; pos = dir_next_pos(fs, index, pos + 1))
+      n_records += dir_index_entry(fs, index, pos)->type == TYPE_DIR;
+  else
+    for(int r = chain->refs; r != -1; r = lt->refs[r].next)
+      n_records++;
+  for(int b = old_start; b != -1; b = fs->fat[b])
+    n_records += fs->fat[b] != b + 1;
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(txn_reserve(fs, n_records * JREC_ENTRY) == -1)
+    new_start = -1;
+  else if(!exact)
+    new_start = alloc_outside(fs, n, lo, hi);
+  else if(find_bit(fs, lo, lo + n, 1) == lo + n) {
+    take_run(fs, lo, n);
+    new_start = link_runs(fs, &(extent){ .start = lo, .length = n }, 1);
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  if(new_start != -1) {
+    copy_chain(fs, old_start, new_start, n);
+
+    if(root) {
+      journal_bytes(fs, &fs->fat[chain->first_block], sizeof(int));
+      fs->fat[chain->first_block] = new_start;
+      mark_dirty(fs, &fs->fat[chain->first_block], sizeof(int));
+    }
+    else if(old_start == fs->sb->share_table) {
+      journal_bytes(fs, &fs->sb->share_table, sizeof(int));
+      fs->sb->share_table = new_start;
+      mark_dirty(fs, &fs->sb->share_table, sizeof(int));
+      drop_extent_map(fs, old_start);
+    }
+    else if(chain->type == TYPE_FILE) {
+      for(int r = chain->refs; r != -1; r = lt->refs[r].next) {
+        dir_entry *entry = dir_index_entry(fs, layout_lock(fs, lt, lt->chains[lt->refs[r].dir].first_block), lt->refs[r].pos);
+        journal_bytes(fs, entry, sizeof(dir_entry));
+        entry->first_block = new_start;
+        mark_dirty(fs, entry, sizeof(dir_entry));
+      }
+      drop_extent_map(fs, old_start);
+    }
+    else {
+      dir_entry *entry = dir_index_entry(fs, layout_lock(fs, lt, lt->chains[lt->refs[chain->refs].dir].first_block), lt->refs[chain->refs].pos);
+      journal_bytes(fs, entry, sizeof(dir_entry));
+      entry->first_block = new_start;
+      mark_dirty(fs, entry, sizeof(dir_entry));
+
+      // the new block is free until the transaction commits, so its entry '.' is not logged
+      ((dir_entry *)BLOCK(new_start))[0].first_block = new_start;
+      mark_dirty(fs, BLOCK(new_start), sizeof(dir_entry));
+      for(int pos = dir_next_pos(fs, index, 2); pos != -1; pos = dir_next_pos(fs, index, pos + 1))
+        if((entry = dir_index_entry(fs, index, pos))->type == TYPE_DIR) {
+          dir_entry *parent = (dir_entry *)BLOCK(entry->first_block) + 1;
+          journal_bytes(fs, parent, sizeof(dir_entry));
+          parent->first_block = new_start;
+          mark_dirty(fs, parent, sizeof(dir_entry));
+        }
+
+      pthread_rwlock_wrlock(&fs->index_lock);
+      int_map_del(&fs->dir_indexes, index->block);
+      index->block = new_start;
+      int_map_put(&fs->dir_indexes, new_start, index);
+      pthread_rwlock_unlock(&fs->index_lock);
+    }
+
+    if(index != NULL)
+      for(int i = root, b = new_start; i < index->n_blocks; i++, b = fs->fat[b])
+        index->chain[i] = b;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    // the copies of a file are counted by its first block
+    unsigned short *shares = chain->refs != -1 && chain->type == TYPE_FILE ? block_shares(fs, old_start, 0) : NULL;
+    if(shares != NULL && *shares > 0) {
+      int n_shares = *shares;
+      journal_share(fs, old_start, -n_shares);
+      *shares = 0;
+      mark_dirty(fs, shares, sizeof(unsigned short));
+      shares = block_shares(fs, new_start, 0);
+      journal_share(fs, new_start, n_shares);
+      *shares = n_shares;
+      mark_dirty(fs, shares, sizeof(unsigned short));
+    }
+
+    for(int b = old_start; b != -1; ) {
+      int start = b, next;
+      while(fs->fat[b] == b + 1)
+        b++;
+      next = fs->fat[b];
+      memset(&lt->owner[start], 0, (long)(b - start + 1) * sizeof(int));
+      free_run(fs, start, b - start + 1);
+      b = next;
+    }
+    for(int b = new_start; b != -1; b = fs->fat[b])
+      lt->owner[b] = c + 1;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    if(!root)
+      chain->first_block = new_start;
+  }
+
+  txn_commit(fs);
+  for(int i = 0; i < lt->n_locked; i++)
+    unlock_dir(fs, lt->locked[i]);
+  txn_finish(fs);
+
+  return new_start == -1 ? -1 : n;
+}
+
+//allocate a chain of n blocks out of the blocks [lo, hi), after the high water mark first, so that the chains
+//moved out of the way of another one are not in the way of the next ones (returns its first block or -1)
+static int alloc_outside(vfs_image *fs, int n, int lo, int hi){
+  int high = fs->sb->high_water > hi ? fs->sb->high_water : hi;
+  int ranges[3][2] = { { high, N_BLOCKS }, { hi, high }, { 1, lo } };
+  int n_free = fs->sb->n_free_blocks, n_runs = 0, max_runs = 0, start;
+  extent *runs = NULL;
+
+  for(int b = find_bit(fs, lo, hi, 0); b < hi; b = find_bit(fs, b, hi, 0)) {
+    int end = find_bit(fs, b, hi, 1);
+    n_free -= end - b;
+    b = end;
+  }
+
+  if(n > n_free)
+    return -1;
+
+  // a run long enough for the whole chain, or else the free runs of each range in order, so that none is skipped
+  for(int r = 0; r < 3; r++)
+    if(find_run(fs, n, ranges[r][0], ranges[r][1], &start) == n) {
+      take_run(fs, start, n);
+      return link_runs(fs, &(extent){ .start = start, .length = n }, 1);
+    }
+
+  for(int r = 0; r < 3; r++)
+    for(int from = ranges[r][0]; n > 0 && (start = find_bit(fs, from, ranges[r][1], 0)) < ranges[r][1]; ) {
+      int len = find_bit(fs, start, start + n < ranges[r][1] ? start + n : ranges[r][1], 1) - start;
+
+      take_run(fs, start, len);
+      if(n_runs == max_runs) {
+        max_runs = max_runs ? max_runs * 2 : 8;
+        runs = (extent *)realloc(runs, max_runs * sizeof(extent));
+      }
+      runs[n_runs++] = (extent){ .start = start, .length = len };
+      from = start + len;
+      n -= len;
+    }
+
+  int first_block = link_runs(fs, runs, n_runs);
+  free(runs);
+
+  return first_block;
+}
+
+//copy the n blocks of the chain from to the chain to, a span contiguous in both at a time
+static void copy_chain(vfs_image *fs, int from, int to, int n){
+  while(n > 0) {
+    int len = 1;
+
+    while(len < n && fs->fat[from + len - 1] == from + len && fs->fat[to + len - 1] == to + len)
+      len++;
+
+    memcpy(BLOCK(to), BLOCK(from), (long)len * fs->sb->block_size);
+    mark_dirty(fs, BLOCK(to), (long)len * fs->sb->block_size);
+
+    from = fs->fat[from + len - 1];
+    to = fs->fat[to + len - 1];
+    n -= len;
+  }
+
+  return;
+}
+
+static void free_layout(layout *lt){
+  free(lt->chains);
+  free(lt->refs);
+  free(lt->owner);
+  free(lt->locked);
+
+  return;
+}
+
+
+// defrag - lays out the chains of the tree from the first block, so that each one is contiguous and they
+// follow the tree (each directory, its files, and then its subdirectories), with the free space at the end
+// the chains in the way of another one are first moved out of it, after the high water mark if there is room
+// with max_ms > 0 it stops after that time, and the next call goes on from there (the chains already laid out
+// are not moved again)
+static int do_defrag(vfs_t *vfs, int max_ms, vfs_defrag_t *result) {
+  vfs_image *fs = vfs->fs;
+  layout lt = { 0 };
+  struct timespec start, now;
+  int next = fs->sb->root_block + 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  layout_scan(fs, &lt);
+
+  result->score_before = layout_score(fs, &lt);
+  result->n_moved = 0;
+  result->n_blocks_moved = 0;
+  result->done = 1;
+
+  // the chains that are contiguous already and within the blocks in use stay where they are, and the others go
+  // around them (so an image that is not fragmented is left as it is, and the chains after the blocks in use fill
+  // the free blocks between them)
+  pthread_mutex_lock(&fs->alloc_lock);
+  long n_used = N_BLOCKS - fs->sb->n_free_blocks;
+  pthread_mutex_unlock(&fs->alloc_lock);
+  for(int c = 0; c < lt.n_chains; c++) {
+    int root = lt.chains[c].first_block == fs->sb->root_block;
+    int block = root ? fs->fat[lt.chains[c].first_block] : lt.chains[c].first_block;
+    int n = root ? lt.chains[c].n_blocks - 1 : lt.chains[c].n_blocks;
+
+    if(n > 0 && block + n <= n_used && layout_in_place(fs, block, block, n))
+      for(int b = block; b < block + n; b++)
+        lt.owner[b] = -1;
+  }
+
+  for(int c = 0; c < lt.n_chains; c++) {
+    int root = lt.chains[c].first_block == fs->sb->root_block;
+    int block = root ? fs->fat[lt.chains[c].first_block] : lt.chains[c].first_block;
+    int n = root ? lt.chains[c].n_blocks - 1 : lt.chains[c].n_blocks;
+
+    if(n == 0 || lt.owner[block] == -1)
+      continue;
+
+    if(max_ms > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= max_ms) {
+        result->done = 0;
+        break;
+      }
+    }
+
+    int target = layout_target(fs, &lt, c, next, n);
+    if(target == -1 || layout_in_place(fs, block, target, n)) {
+      if(target != -1)
+        next = target + n;
+      continue;
+    }
+
+    // a chain that cannot be moved (the disk is almost full) stays where it is, and the next ones go around it
+    int b, moved;
+    for(b = target; b < target + n; b++)
+      if(lt.owner[b] > 0) {
+        if((moved = move_chain(fs, &lt, lt.owner[b] - 1, target, target + n, 0)) == -1)
+          break;
+        result->n_moved++;
+        result->n_blocks_moved += moved;
+      }
+
+    if(b < target + n || (moved = move_chain(fs, &lt, c, target, target + n, 1)) == -1)
+      continue;
+    result->n_moved++;
+    result->n_blocks_moved += moved;
+    next = target + n;
+  }
+
+  // the next blocks are allocated after the chains
+  if(result->done) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->sb->free_block = next;
+    pthread_mutex_unlock(&fs->alloc_lock);
+  }
+
+  result->score_after = layout_score(fs, &lt);
+  free_layout(&lt);
+
+  return VFS_OK;
+}
+
+
+//check the directories taken from the list of the walk, until all of them are checked
+static void *fsck_walk_run(void *arg){
+  fsck_state *st = (fsck_state *)arg;
+
+  pthread_mutex_lock(&st->lock);
+  while(1) {
+    // the walk ends when no directory is left and none is being checked (which could add more)
+    while(st->next_dir == st->n_dirs && st->n_busy > 0)
+      pthread_cond_wait(&st->cond, &st->lock);
+    if(st->next_dir == st->n_dirs)
+      break;
+
+    fsck_dir *dir = st->dirs[st->next_dir++];
+    st->n_busy++;
+    pthread_mutex_unlock(&st->lock);
+
+    fsck_check_dir(st, dir);
+
+    pthread_mutex_lock(&st->lock);
+    if(--st->n_busy == 0 && st->next_dir == st->n_dirs)
+      pthread_cond_broadcast(&st->cond);
+  }
+  pthread_mutex_unlock(&st->lock);
+
+  return NULL;
+}
+
+//check a directory (claimed by its parent): its chain, its entries '.' and '..', its count of entries, and the entries
+//themselves (the invalid ones and the ones with the name of another one are removed)
+//its subdirectories are claimed and added to the walk, and its files listed for fsck_check_file
+static void fsck_check_dir(fsck_state *st, fsck_dir *dir){
+  vfs_image *fs = st->fs;
+  dir_entry *entries = (dir_entry *)BLOCK(dir->block);
+  int per_block = DIR_ENTRIES_PER_BLOCK, sorted = entries[1].size & DIR_SORTED;
+  int *blocks = NULL, end, n_live = 0, n_names = 0, n_files = 0;
+
+  int n_blocks = fsck_chain(st, dir->block, INT_MAX, 1, &blocks, &end);
+  if(end != FSCK_END)
+    fsck_report(st, dir, NULL, fsck_problem(end), 1);
+
+  if(entries[0].type != TYPE_DIR || entries[0].first_block != dir->block || strncmp(entries[0].name, ".", MAX_NAME_LENGHT) != 0) {
+    fsck_report(st, dir, NULL, "entry '.' doesn't point to the directory", 1);
+    if(st->repair) {
+      entries[0].type = TYPE_DIR;
+      strncpy(entries[0].name, ".", MAX_NAME_LENGHT);
+      entries[0].first_block = dir->block;
+    }
+  }
+
+  if(entries[1].type != TYPE_DIR || entries[1].first_block != dir->parent || strncmp(entries[1].name, "..", MAX_NAME_LENGHT) != 0) {
+    fsck_report(st, dir, NULL, "entry '..' doesn't point to the parent", 1);
+    if(st->repair) {
+      entries[1].type = TYPE_DIR;
+      strncpy(entries[1].name, "..", MAX_NAME_LENGHT);
+      entries[1].first_block = dir->parent;
+    }
+  }
+
+  // the entries in use: the first ones of the chain (as many as the count), or the ones at the start of each block
+  // of a sorted directory, up to its first free slot
+  int *live = (int *)malloc((long)n_blocks * per_block * sizeof(int)), n_entries = entries[0].size;
+  if(!sorted) {
+    if(n_entries < 2 || n_entries > n_blocks * per_block) {
+      fsck_report(st, dir, NULL, "wrong number of entries", 1);
+      n_entries = n_entries < 2 ? 2 : n_blocks * per_block;
+    }
+    for(int pos = 2; pos < n_entries; pos++)
+      live[n_live++] = pos;
+  }
+  else {
+    for(int b = 0; b < n_blocks; b++)
+      for(int slot = b == 0 ? 2 : 0; slot < per_block && ((dir_entry *)BLOCK(blocks[b]))[slot].type != 0; slot++)
+        live[n_live++] = b * per_block + slot;
+    if(n_entries != n_live + 2)
+      fsck_report(st, dir, NULL, "wrong number of entries", 1);
+    n_entries = n_live + 2;
+  }
+  if(st->repair)
+    entries[0].size = n_entries;
+
+  fsck_name *names = (fsck_name *)malloc((n_live + 1) * sizeof(fsck_name));
+  fsck_file *files = (fsck_file *)malloc((n_live + 1) * sizeof(fsck_file));
+
+  for(int i = 0; i < n_live; i++) {
+    dir_entry *entry = (dir_entry *)BLOCK(blocks[live[i] / per_block]) + live[i] % per_block;
+
+    if((entry->type != TYPE_DIR && entry->type != TYPE_FILE) || !fsck_valid_name(entry)) {
+      fsck_report(st, dir, NULL, "invalid entry", 1);
+      fsck_remove(st, dir, live[i]);
+    }
+    else
+      names[n_names++] = (fsck_name){ .entry = entry, .pos = live[i] };
+  }
+
+  // the first entry of each name is kept
+  qsort(names, n_names, sizeof(fsck_name), fsck_name_cmp);
+  for(int i = 0; i < n_names; i++) {
+    dir_entry *entry = names[i].entry;
+
+    if(i > 0 && strncmp(entry->name, names[i - 1].entry->name, MAX_NAME_LENGHT) == 0) {
+      fsck_report(st, dir, entry->name, "duplicate name", 1);
+      fsck_remove(st, dir, names[i].pos);
+    }
+    else if(entry->type == TYPE_FILE)
+      files[n_files++] = (fsck_file){ .first_block = entry->first_block, .entry = entry, .dir = dir, .pos = names[i].pos };
+    else if(!fsck_valid_block(fs, entry->first_block)) {
+      fsck_report(st, dir, entry->name, "first block out of the image or free", 1);
+      fsck_remove(st, dir, names[i].pos);
+    }
+    else if(fsck_claim(st, entry->first_block)) {
+      fsck_report(st, dir, entry->name, "first block in another chain", 1);
+      fsck_remove(st, dir, names[i].pos);
+    }
+    else
+      fsck_add_dir(st, dir, entry);
+  }
+
+  // the blocks of an unsorted directory after the ones its entries need are freed
+  int needed = (n_entries + per_block - 1) / per_block;
+  if(!sorted && n_blocks > needed) {
+    fsck_report(st, dir, NULL, "more blocks than its entries need", 1);
+    if(st->repair) {
+      fs->fat[blocks[needed - 1]] = -1;
+      for(int b = needed; b < n_blocks; b++) {
+        fs->fat[blocks[b]] = FAT_FREE;
+        __atomic_fetch_and(&st->reached[blocks[b] / BITS_PER_WORD], ~(1UL << (blocks[b] % BITS_PER_WORD)), __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&st->lock);
+  if(st->n_files + n_files > st->max_files) {
+    while(st->n_files + n_files > st->max_files)
+      st->max_files = st->max_files ? 2 * st->max_files : 1024;
+    st->files = (fsck_file *)realloc(st->files, st->max_files * sizeof(fsck_file));
+  }
+  // st->files is NULL until a directory with files is checked
+  if(n_files > 0)
+    memcpy(&st->files[st->n_files], files, n_files * sizeof(fsck_file));
+  st->n_files += n_files;
+  pthread_mutex_unlock(&st->lock);
+
+  free(blocks);
+  free(live);
+  free(names);
+  free(files);
+
+  return;
+}
+
+//check the chains of the file entries, sorted by first block: the entries are taken FSCK_FILES_CHUNK at a time,
+//and a worker checks the chains whose first entry is among the ones it took
+static void *fsck_files_run(void *arg){
+  fsck_state *st = (fsck_state *)arg;
+  long i;
+
+  while((i = __sync_fetch_and_add(&st->next_file, FSCK_FILES_CHUNK)) < st->n_files)
+    for(long j = i; j < i + FSCK_FILES_CHUNK && j < st->n_files; j++)
+      if(j == 0 || st->files[j - 1].first_block != st->files[j].first_block) {
+        long k = j + 1;
+        while(k < st->n_files && st->files[k].first_block == st->files[j].first_block)
+          k++;
+        fsck_check_file(st, &st->files[j], k - j);
+      }
+
+  return NULL;
+}
+
+//check the chain of the n entries that start at the same block (copies made by cp): it must not be part of another
+//chain, and it must have the blocks that their size needs (the entries are removed if it cannot be kept, and the
+//chain cut or the sizes fixed otherwise)
+//the chain of a sparse or compressed file must have the blocks of its table of runs or frames, which must be valid
+static void fsck_check_file(fsck_state *st, fsck_file *files, int n){
+  vfs_image *fs = st->fs;
+  int first_block = files[0].first_block, size = 0, end, *table = NULL, n_expected = 0, frames_size = 0;
+  int layout = files[0].entry->month & ~MONTH_MASK;
+  const char *problem = NULL;
+
+  for(int i = 0; i < n; i++)
+    if(files[i].entry->size > size)
+      size = files[i].entry->size;
+  int size_blocks = ((long)size + fs->sb->block_size - 1) / fs->sb->block_size;
+
+  if(!fsck_valid_block(fs, first_block))
+    problem = "first block out of the image or free";
+  else if(layout != 0 && layout != FILE_SPARSE && layout != FILE_COMPRESSED)
+    problem = "unknown layout";
+  else if(layout == FILE_SPARSE && (n_expected = fsck_sparse_table(fs, first_block, size_blocks, &table)) == -1)
+    problem = "invalid table of runs";
+  else if(layout == FILE_COMPRESSED && (n_expected = fsck_frame_table(fs, first_block, size, &table, &frames_size)) == -1)
+    problem = "invalid table of frames";
+  else if(fsck_claim(st, first_block))
+    problem = "first block in another chain";
+
+  if(problem != NULL) {
+    for(int i = 0; i < n; i++) {
+      fsck_report(st, files[i].dir, files[i].entry->name, problem, 1);
+      fsck_remove(st, files[i].dir, files[i].pos);
+      files[i].entry = NULL;
+    }
+    free(table);
+    return;
+  }
+
+  int n_blocks = fsck_chain(st, first_block, layout != 0 ? n_expected : size_blocks > 0 ? size_blocks : 1, 1, NULL, &end);
+  if(end != FSCK_END)
+    fsck_report(st, files[0].dir, files[0].entry->name, fsck_problem(end), 1);
+
+  // the runs of a sparse file are cut to the blocks left, so the ones lost read as zeros, and the frames of a
+  // compressed file too, which cuts the file after the last frame left
+  if(layout == FILE_SPARSE && n_blocks < n_expected) {
+    fsck_report(st, files[0].dir, files[0].entry->name, "chain shorter than its runs", 1);
+    if(st->repair)
+      fsck_trim_runs(fs, table, n_blocks);
+  }
+  else if(layout == FILE_COMPRESSED && n_blocks < n_expected) {
+    fsck_report(st, files[0].dir, files[0].entry->name, "chain shorter than its frames", 1);
+    if(st->repair)
+      frames_size = fsck_trim_frames(fs, table, n_blocks);
+  }
+  free(table);
+
+  for(int i = 0; i < n; i++) {
+    dir_entry *entry = files[i].entry;
+
+    if((entry->month & ~MONTH_MASK) != layout) {
+      fsck_report(st, files[i].dir, entry->name, "copy with another layout than the first one", 1);
+      if(st->repair)
+        entry->month = (entry->month & MONTH_MASK) | layout;
+    }
+
+    if(layout == FILE_COMPRESSED) {
+      if(entry->size != frames_size) {
+        fsck_report(st, files[i].dir, entry->name, "size different from the one of its frames", 1);
+        if(st->repair)
+          entry->size = frames_size;
+      }
+    }
+    else if(entry->size < 0 || (layout == 0 && ((long)entry->size + fs->sb->block_size - 1) / fs->sb->block_size > n_blocks)) {
+      fsck_report(st, files[i].dir, entry->name, "size larger than the chain", 1);
+      if(st->repair)
+        entry->size = entry->size < 0 ? 0 : n_blocks * fs->sb->block_size;
+    }
+  }
+
+  return;
+}
+
+//check the table of frames at the start of the chain of a compressed file of size bytes (before the chain is claimed):
+//its blocks must be in the chain, and the ends of its frames in order, a frame holding at most FRAME_BYTES
+//returns the number of blocks of the chain it describes (-1 if it is invalid), in table the blocks of the table and in
+//frames_size the end of its last frame
+static int fsck_frame_table(vfs_image *fs, int first_block, int size, int **table, int *frames_size){
+  frame_header *header = (frame_header *)BLOCK(first_block);
+  int n_table = header->table_blocks, n_frames = header->n_frames, cur = first_block;
+
+  // after a repair the table may have more blocks than its frames need
+  if(n_frames < 0 || n_frames > size || n_table < FRAME_TABLE_BLOCKS(n_frames) || n_table > FRAME_TABLE_BLOCKS(size))
+    return -1;
+
+  *table = (int *)malloc(n_table * sizeof(int));
+  for(int i = 0; i < n_table; i++, cur = fs->fat[cur]) {
+    if(!fsck_valid_block(fs, cur))
+      return -1;
+    (*table)[i] = cur;
+  }
+
+  int last_end = 0;
+  for(int i = 0; i < n_frames; i++) {
+    long pos = sizeof(frame_header) + (long)i * sizeof(int);
+    int frame_end = *(int *)(BLOCK((*table)[pos / fs->sb->block_size]) + pos % fs->sb->block_size);
+
+    if(frame_end <= last_end || frame_end - last_end > FRAME_BYTES)
+      return -1;
+    last_end = frame_end;
+  }
+
+  *frames_size = last_end;
+  return n_table + n_frames;
+}
+
+//cut the frames of the compressed file whose table is in the blocks table to the first n_blocks blocks of its chain
+//(with the table, which keeps at least its first block); returns the end of the last frame left
+static int fsck_trim_frames(vfs_image *fs, int *table, int n_blocks){
+  frame_header *header = (frame_header *)BLOCK(table[0]);
+
+  if(n_blocks < header->table_blocks)
+    header->table_blocks = n_blocks;
+  header->n_frames = n_blocks - header->table_blocks;
+  if(header->n_frames == 0)
+    return 0;
+
+  long pos = sizeof(frame_header) + (long)(header->n_frames - 1) * sizeof(int);
+  return *(int *)(BLOCK(table[pos / fs->sb->block_size]) + pos % fs->sb->block_size);
+}
+
+//check the table of runs at the start of the chain of a sparse file of n_blocks blocks (before the chain is claimed):
+//its blocks must be in the chain, and its runs sorted, apart and within the file
+//returns the number of blocks of the chain it describes (-1 if it is invalid), and in table the blocks of the table
+static int fsck_sparse_table(vfs_image *fs, int first_block, int n_blocks, int **table){
+  sparse_header *header = (sparse_header *)BLOCK(first_block);
+  int n_table = header->table_blocks, n_runs = header->n_runs, cur = first_block;
+
+  // after a repair the table may have more blocks than its runs need
+  if(n_runs < 0 || n_runs > n_blocks || n_table < SPARSE_TABLE_BLOCKS(n_runs) || n_table > SPARSE_TABLE_BLOCKS(n_blocks))
+    return -1;
+
+  *table = (int *)malloc(n_table * sizeof(int));
+  for(int i = 0; i < n_table; i++, cur = fs->fat[cur]) {
+    if(!fsck_valid_block(fs, cur))
+      return -1;
+    (*table)[i] = cur;
+  }
+
+  int n_data = 0, next = 0;
+  for(int i = 0; i < n_runs; i++) {
+    long pos = sizeof(sparse_header) + (long)i * sizeof(sparse_run);
+    sparse_run *run = (sparse_run *)(BLOCK((*table)[pos / fs->sb->block_size]) + pos % fs->sb->block_size);
+
+    if(run->length <= 0 || run->offset < next || (long)run->offset + run->length > n_blocks)
+      return -1;
+    next = run->offset + run->length;
+    n_data += run->length;
+  }
+
+  return n_table + n_data;
+}
+
+//cut the runs of the sparse file whose table is in the blocks table to the first n_blocks blocks of its chain (with the
+//table, which keeps at least its first block)
+static void fsck_trim_runs(vfs_image *fs, int *table, int n_blocks){
+  sparse_header *header = (sparse_header *)BLOCK(table[0]);
+  int n_data = n_blocks - header->table_blocks;
+
+  if(n_data < 0) {
+    header->table_blocks = n_blocks;
+    header->n_runs = 0;
+    return;
+  }
+
+  for(int i = 0; i < header->n_runs; i++) {
+    long pos = sizeof(sparse_header) + (long)i * sizeof(sparse_run);
+    sparse_run *run = (sparse_run *)(BLOCK(table[pos / fs->sb->block_size]) + pos % fs->sb->block_size);
+
+    if(n_data == 0) {
+      header->n_runs = i;
+      break;
+    }
+    if(run->length > n_data)
+      run->length = n_data;
+    n_data -= run->length;
+  }
+
+  return;
+}
+
+//claim the blocks of the chain after first_block (claimed by the caller), up to n_max blocks in all
+//returns the number of blocks claimed (listed in blocks, if not NULL) and in end why the chain ended (FSCK_END, or the
+//problem found); with cut, a repair makes the chain end at its last block claimed
+static int fsck_chain(fsck_state *st, int first_block, int n_max, int cut, int **blocks, int *end){
+  vfs_image *fs = st->fs;
+  int n_blocks = 0, max_blocks = 0;
+
+  for(int b = first_block; ; ) {
+    if(blocks != NULL) {
+      if(n_blocks == max_blocks) {
+        max_blocks = max_blocks ? 2 * max_blocks : 16;
+        *blocks = (int *)realloc(*blocks, max_blocks * sizeof(int));
+      }
+      (*blocks)[n_blocks] = b;
+    }
+    n_blocks++;
+
+    int next = fs->fat[b];
+    if(next == -1) {
+      *end = FSCK_END;
+      break;
+    }
+
+    if(n_blocks == n_max)
+      *end = FSCK_LONG;
+    else if(!fsck_valid_block(fs, next))
+      *end = FSCK_BAD;
+    else if(fsck_claim(st, next))
+      *end = FSCK_CROSS;
+    else {
+      b = next;
+      continue;
+    }
+
+    if(cut && st->repair)
+      fs->fat[b] = -1;
+    break;
+  }
+
+  return n_blocks;
+}
+
+//mark a block as reached (returns whether it already was, by another chain or by the same one)
+static int fsck_claim(fsck_state *st, int block){
+  unsigned long bit = 1UL << (block % BITS_PER_WORD);
+
+  return (__atomic_fetch_or(&st->reached[block / BITS_PER_WORD], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+//whether a chain can go to the block: in the image, in use, and not the first block of the root
+static int fsck_valid_block(vfs_image *fs, int block){
+  return block >= 0 && block < N_BLOCKS && block != fs->sb->root_block && fs->fat[block] != FAT_FREE;
+}
+
+static int fsck_valid_name(dir_entry *entry){
+  int len = strnlen(entry->name, MAX_NAME_LENGHT);
+
+  return len > 0 && memchr(entry->name, '/', len) == NULL && strncmp(entry->name, ".", MAX_NAME_LENGHT) != 0
+         && strncmp(entry->name, "..", MAX_NAME_LENGHT) != 0;
+}
+
+static const char *fsck_problem(int end){
+  switch(end) {
+    case FSCK_LONG: return "chain longer than the size";
+    case FSCK_BAD: return "chain goes to a block out of the image or free";
+    default: return "chain crosses another one";
+  }
+}
+
+//order of the entries of a directory by name, and by position for the same name
+static int fsck_name_cmp(const void *a, const void *b){
+  const fsck_name *name_a = (const fsck_name *)a, *name_b = (const fsck_name *)b;
+  int cmp = strncmp(name_a->entry->name, name_b->entry->name, MAX_NAME_LENGHT);
+
+  return cmp != 0 ? cmp : name_a->pos - name_b->pos;
+}
+
+//order of the file entries by first block, and by address for the same block
+static int fsck_file_cmp(const void *a, const void *b){
+  const fsck_file *file_a = (const fsck_file *)a, *file_b = (const fsck_file *)b;
+
+  if(file_a->first_block != file_b->first_block)
+    return file_a->first_block < file_b->first_block ? -1 : 1;
+
+  return file_a->entry < file_b->entry ? -1 : file_a->entry > file_b->entry;
+}
+
+static int fsck_pos_cmp(const void *a, const void *b){
+  return *(const int *)a - *(const int *)b;
+}
+
+//add the subdirectory of an entry of dir (already claimed) to the walk
+static void fsck_add_dir(fsck_state *st, fsck_dir *dir, dir_entry *entry){
+  fsck_dir *subdir = (fsck_dir *)calloc(1, sizeof(fsck_dir));
+
+  subdir->block = entry->first_block;
+  subdir->parent = dir->block;
+  subdir->path = fsck_path(dir->path, entry->name);
+
+  pthread_mutex_lock(&st->lock);
+  if(st->n_dirs == st->max_dirs) {
+    st->max_dirs = st->max_dirs ? 2 * st->max_dirs : 64;
+    st->dirs = (fsck_dir **)realloc(st->dirs, st->max_dirs * sizeof(fsck_dir *));
+  }
+  st->dirs[st->n_dirs++] = subdir;
+  pthread_cond_signal(&st->cond);
+  pthread_mutex_unlock(&st->lock);
+
+  return;
+}
+
+//path of the entry name of a directory (the directory itself if name is NULL), allocated
+static char *fsck_path(const char *dir_path, const char *name){
+  size_t len = strlen(dir_path) + MAX_NAME_LENGHT + 2;
+  char *path = (char *)malloc(len);
+
+  snprintf(path, len, "%s%s%.*s", dir_path, name != NULL && strcmp(dir_path, "/") != 0 ? "/" : "", MAX_NAME_LENGHT, name != NULL ? name : "");
+
+  return path;
+}
+
+//remove the entry at position pos of the directory once the check ends (repair)
+static void fsck_remove(fsck_state *st, fsck_dir *dir, int pos){
+  if(!st->repair)
+    return;
+
+  pthread_mutex_lock(&st->lock);
+  if(dir->n_removed == dir->max_removed) {
+    dir->max_removed = dir->max_removed ? 2 * dir->max_removed : 8;
+    dir->removed = (int *)realloc(dir->removed, dir->max_removed * sizeof(int));
+  }
+  dir->removed[dir->n_removed++] = pos;
+  pthread_mutex_unlock(&st->lock);
+
+  return;
+}
+
+//report a problem of the entry name of the directory dir (of the image if dir is NULL), repaired if it can be
+static void fsck_report(fsck_state *st, fsck_dir *dir, const char *name, const char *problem, int can_repair){
+  int repaired = can_repair && st->repair;
+
+  pthread_mutex_lock(&st->lock);
+  st->result->n_errors++;
+  st->result->n_repaired += repaired;
+  if(st->report != NULL) {
+    char *path = fsck_path(dir != NULL ? dir->path : "", name);
+    st->report(path, problem, repaired, st->arg);
+    free(path);
+  }
+  pthread_mutex_unlock(&st->lock);
+
+  return;
+}
+
+//check the table of shared chains (its n_table blocks are in table) against the entries of each chain: it counts
+//their copies, the entries after the first one
+static void fsck_shares(fsck_state *st, int *table, int n_table){
+  vfs_image *fs = st->fs;
+  int per_block = fs->sb->block_size / sizeof(unsigned short);
+  long i = 0;
+
+  for(int b = 0; b < N_BLOCKS; b++) {
+    fsck_file *first = NULL;
+    int n = 0;
+
+    // the entries are sorted by first block
+    for(; i < st->n_files && st->files[i].first_block <= b; i++)
+      if(st->files[i].first_block == b && st->files[i].entry != NULL) {
+        first = first != NULL ? first : &st->files[i];
+        n++;
+      }
+
+    if(table == NULL) {
+      if(n > 1)
+        fsck_report(st, first->dir, first->entry->name, "copies not counted (there is no table of shared chains)", 0);
+      continue;
+    }
+
+    unsigned short *shares = (unsigned short *)BLOCK(table[b / per_block]) + b % per_block;
+    if(*shares != (n > 0 ? n - 1 : 0)) {
+      fsck_report(st, first != NULL ? first->dir : NULL, first != NULL ? first->entry->name : NULL, "wrong number of copies in the table of shared chains", 1);
+      if(st->repair)
+        *shares = n > 0 ? n - 1 : 0;
+    }
+  }
+
+  return;
+}
+
+//remove the entries of a directory found by the check (repair), as rm and rmdir do: the last entry of an unsorted
+//directory takes the place of the one removed (and the blocks left empty are freed), and the entries of a block of
+//a sorted one are moved back
+static void fsck_compact(fsck_state *st, fsck_dir *dir){
+  vfs_image *fs = st->fs;
+  dir_entry *entries = (dir_entry *)BLOCK(dir->block);
+  int per_block = DIR_ENTRIES_PER_BLOCK, *blocks = NULL, n_blocks = 0, max_blocks = 0;
+
+  for(int b = dir->block; b != -1; b = fs->fat[b]) {
+    if(n_blocks == max_blocks) {
+      max_blocks = max_blocks ? 2 * max_blocks : 16;
+      blocks = (int *)realloc(blocks, max_blocks * sizeof(int));
+    }
+    blocks[n_blocks++] = b;
+  }
+
+  // from the last position, so that the ones still to remove don't move
+  qsort(dir->removed, dir->n_removed, sizeof(int), fsck_pos_cmp);
+  for(int i = dir->n_removed - 1; i >= 0; i--) {
+    dir_entry *block_entries = (dir_entry *)BLOCK(blocks[dir->removed[i] / per_block]);
+    int slot = dir->removed[i] % per_block;
+
+    if(!(entries[1].size & DIR_SORTED)) {
+      int last = --entries[0].size;
+      block_entries[slot] = ((dir_entry *)BLOCK(blocks[last / per_block]))[last % per_block];
+    }
+    else {
+      int fill = slot + 1;
+      while(fill < per_block && block_entries[fill].type != 0)
+        fill++;
+      memmove(&block_entries[slot], &block_entries[slot + 1], (fill - slot - 1) * sizeof(dir_entry));
+      memset(&block_entries[fill - 1], 0, sizeof(dir_entry));
+      entries[0].size--;
+    }
+  }
+
+  int needed = (entries[0].size + per_block - 1) / per_block;
+  if(!(entries[1].size & DIR_SORTED) && needed < n_blocks) {
+    fs->fat[blocks[needed - 1]] = -1;
+    for(int b = needed; b < n_blocks; b++) {
+      fs->fat[blocks[b]] = FAT_FREE;
+      st->reached[blocks[b] / BITS_PER_WORD] &= ~(1UL << (blocks[b] % BITS_PER_WORD));
+    }
+  }
+
+  free(blocks);
+
+  return;
+}
+
+//check the blocks in use against the ones reached: the others are leaked (and freed by a repair), and none can be
+//after the high water mark; the block map and the count of free blocks of an open image are checked too (the blocks
+//reserved by get -r are in the block map, not in the FAT)
+static void fsck_blocks(fsck_state *st){
+  vfs_image *fs = st->fs;
+  long n_reached = 0, n_leaked = 0, n_unmapped = 0, n_free = 0;
+  int last_used = -1;
+  char problem[64];
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  for(int b = 0; b < N_BLOCKS; b++) {
+    int used = fs->fat[b] != FAT_FREE, mapped = (fs->block_map[b / BITS_PER_WORD] >> (b % BITS_PER_WORD)) & 1;
+
+    if((st->reached[b / BITS_PER_WORD] >> (b % BITS_PER_WORD)) & 1)
+      n_reached++;
+    else if(used) {
+      n_leaked++;
+      if(st->repair) {
+        fs->fat[b] = FAT_FREE;
+        used = 0;
+      }
+    }
+
+    last_used = used ? b : last_used;
+    n_unmapped += used && !mapped;
+    n_free += !mapped;
+  }
+
+  if(n_leaked > 0) {
+    snprintf(problem, sizeof(problem), "%ld blocks in use out of the tree", n_leaked);
+    fsck_report(st, NULL, NULL, problem, 1);
+  }
+
+  // the blocks after the mark are taken as cleared, so it is only moved up (the block map of an image is built up
+  // to it, so the blocks after it are missing from the map too)
+  int bad_mark = last_used >= fs->sb->high_water || fs->sb->high_water > N_BLOCKS;
+  if(bad_mark) {
+    fsck_report(st, NULL, NULL, "high water mark before a block in use or out of the image", 1);
+    if(st->repair)
+      fs->sb->high_water = fs->sb->high_water > N_BLOCKS ? N_BLOCKS : last_used + 1;
+  }
+
+  // a repair changes the FAT, and the count is recomputed from it
+  if(st->repair)
+    fs->sb->n_free_blocks = N_BLOCKS - n_reached;
+  else {
+    if(n_unmapped > 0 && !bad_mark)
+      fsck_report(st, NULL, NULL, "blocks in use missing from the block map", 0);
+    if(n_free != fs->sb->n_free_blocks)
+      fsck_report(st, NULL, NULL, "wrong count of free blocks", 0);
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  st->result->n_used_blocks = n_reached;
+  st->result->n_leaked_blocks = n_leaked;
+
+  return;
+}
+
+//run the function in n threads with the state of fsck
+static void fsck_run(fsck_state *st, void *(*run)(void *), int n){
+  pthread_t *threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+
+  for(int i = 0; i < n; i++)
+    pthread_create(&threads[i], NULL, run, st);
+  for(int i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  return;
+}
+
+
+// fsck - checks that the chains of the tree, of the table of shared chains and of the journal don't cross, that each
+// chain fits the size of its file or the entries of its directory, that the table counts the copies of each chain,
+// and that the blocks in use are the ones reached (the others are leaked)
+// the directories are checked by n_workers threads, each one taking the next directory found, and then the chains
+// of the files, with all the entries of a chain together; a repair cuts the chains where they go wrong, fixes the
+// sizes and counts, removes the entries that cannot be kept and frees the leaked blocks
+static int do_fsck(vfs_image *fs, int repair, int n_workers, vfs_fsck_fn report, void *arg, vfs_fsck_t *result) {
+  fsck_state st = { .fs = fs, .repair = repair, .result = result, .report = report, .arg = arg };
+  int root = fs->sb->root_block, *table = NULL, n_table = 0, end;
+
+  memset(result, 0, sizeof(vfs_fsck_t));
+  if(root < 0 || root >= N_BLOCKS || fs->fat[root] == FAT_FREE) {
+    fsck_report(&st, NULL, NULL, "the root directory is not in the image", 0);
+    return VFS_EBADFS;
+  }
+
+  if(n_workers <= 0)
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  st.reached = (unsigned long *)calloc((N_BLOCKS + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+  pthread_mutex_init(&st.lock, NULL);
+  pthread_cond_init(&st.cond, NULL);
+
+  if(fs->sb->free_block < 1 || fs->sb->free_block > N_BLOCKS) {
+    fsck_report(&st, NULL, NULL, "first block to search for free blocks out of the image", 1);
+    if(repair)
+      fs->sb->free_block = 1;
+  }
+
+  // the journal and the table of shared chains are claimed first, so that a chain of the tree that crosses them is cut
+  fsck_claim(&st, root);
+  if(fs->sb->journal_block != 0) {
+    int block = fs->sb->journal_block;
+    if(!fsck_valid_block(fs, block) || fsck_claim(&st, block) || fsck_chain(&st, block, INT_MAX, 0, NULL, &end) != fs->sb->journal_blocks || end != FSCK_END)
+      fsck_report(&st, NULL, NULL, "the chain of the journal is damaged", 0);
+  }
+
+  if(fs->sb->share_table != 0) {
+    int block = fs->sb->share_table, size = ((long)N_BLOCKS * sizeof(unsigned short) + fs->sb->block_size - 1) / fs->sb->block_size;
+    if(!fsck_valid_block(fs, block) || fsck_claim(&st, block) || (n_table = fsck_chain(&st, block, INT_MAX, 0, &table, &end)) != size || end != FSCK_END)
+      fsck_report(&st, NULL, NULL, "the chain of the table of shared chains is damaged", 0);
+  }
+
+  // the walk starts at the root
+  st.dirs = (fsck_dir **)malloc(sizeof(fsck_dir *));
+  st.dirs[0] = (fsck_dir *)calloc(1, sizeof(fsck_dir));
+  st.dirs[0]->block = st.dirs[0]->parent = root;
+  st.dirs[0]->path = fsck_path("/", NULL);
+  st.n_dirs = st.max_dirs = 1;
+  fsck_run(&st, fsck_walk_run, n_workers);
+
+  if(st.n_files > 0)
+    qsort(st.files, st.n_files, sizeof(fsck_file), fsck_file_cmp);
+  fsck_run(&st, fsck_files_run, n_workers);
+
+  // the table is only checked if it is whole
+  if(fs->sb->share_table == 0 || n_table == ((long)N_BLOCKS * sizeof(unsigned short) + fs->sb->block_size - 1) / fs->sb->block_size)
+    fsck_shares(&st, fs->sb->share_table != 0 ? table : NULL, n_table);
+
+  for(int i = 0; i < st.n_dirs; i++)
+    if(st.dirs[i]->n_removed > 0)
+      fsck_compact(&st, st.dirs[i]);
+
+  fsck_blocks(&st);
+
+  result->n_dirs = st.n_dirs;
+  for(long i = 0; i < st.n_files; i++)
+    result->n_files += st.files[i].entry != NULL;
+
+  for(int i = 0; i < st.n_dirs; i++) {
+    free(st.dirs[i]->path);
+    free(st.dirs[i]->removed);
+    free(st.dirs[i]);
+  }
+  free(st.dirs);
+  free(st.files);
+  free(st.reached);
+  free(table);
+  pthread_mutex_destroy(&st.lock);
+  pthread_cond_destroy(&st.cond);
+
+  return VFS_OK;
+}
+
+
+// resize - sets the number of blocks of the image, extending or truncating its file and the mapping in place
+// the data blocks don't move, so only the FAT does: to the space it left after the superblock if it fits there (an
+// image that was never resized has it there), or after the last block
+// the image is shrunk only if the blocks after its new end are free (defrag moves the chains to the start)
+static int do_resize(vfs_image *fs, int n_blocks) {
+  int old_blocks = N_BLOCKS, block_size = fs->sb->block_size, status = VFS_OK;
+  long old_fat = (char *)fs->fat - (char *)fs->sb, data_offset = fs->blocks - (char *)fs->sb, old_size = fs->size;
+  long fat_offset = FAT_SIZE(n_blocks) <= data_offset - block_size ? block_size : data_offset + (long)n_blocks * block_size;
+  long size = image_end(fat_offset, data_offset, n_blocks, block_size);
+
+  pthread_mutex_lock(&fs->dur.flush_lock);
+  pthread_mutex_lock(&fs->alloc_lock);
+
+  if(n_blocks < old_blocks) {
+    // the table of shared chains has a count for each block, its blocks after the new end are freed first
+    if((status = resize_shares(fs, n_blocks)) == VFS_OK) {
+      move_fat(fs, fat_offset, n_blocks);
+      fs->sb->n_free_blocks -= old_blocks - n_blocks;
+      fs->sb->n_blocks = n_blocks;
+      if(fs->sb->high_water > n_blocks)
+        fs->sb->high_water = n_blocks;
+      if(fs->sb->free_block > n_blocks)
+        fs->sb->free_block = 1;
+    }
+  }
+  else if(n_blocks > old_blocks) {
+    if(ftruncate(fs->fd, size) == -1 || map_image(fs, size) != VFS_OK) {
+      if(ftruncate(fs->fd, old_size) == -1) {}
+      status = VFS_EHOST;
+    }
+    else {
+      long n_words = (n_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD, old_words = (old_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+      fs->block_map = (unsigned long *)realloc(fs->block_map, n_words * sizeof(unsigned long));
+      memset(&fs->block_map[old_words], 0, (n_words - old_words) * sizeof(unsigned long));
+
+      n_words = ((size + fs->page_size - 1) / fs->page_size + BITS_PER_WORD - 1) / BITS_PER_WORD;
+      old_words = ((old_size + fs->page_size - 1) / fs->page_size + BITS_PER_WORD - 1) / BITS_PER_WORD;
+      fs->dirty_pages = (unsigned long *)realloc(fs->dirty_pages, n_words * sizeof(unsigned long));
+      memset(&fs->dirty_pages[old_words], 0, (n_words - old_words) * sizeof(unsigned long));
+      fs->size = size;
+
+      // the new blocks are free and taken as never used, so the part of the old FAT among them is cleared
+      move_fat(fs, fat_offset, n_blocks);
+      long old_end = old_fat + FAT_SIZE(old_blocks);
+      if(old_fat > data_offset)
+        memset((char *)fs->sb + old_fat, 0, (fat_offset > old_fat && fat_offset < old_end ? fat_offset : old_end) - old_fat);
+      fs->sb->n_free_blocks += n_blocks - old_blocks;
+      fs->sb->n_blocks = n_blocks;
+      status = resize_shares(fs, n_blocks);
+    }
+  }
+
+  if(status == VFS_OK && n_blocks != old_blocks) {
+    fs->sb->fat_offset = fat_offset;
+    fs->sb->data_offset = data_offset;
+    msync(fs->sb, fs->size, MS_SYNC);
+
+    // the pages listed for VFS_DURABILITY_SYNC were written with the others
+    if(dirty.fs == fs) {
+      free(dirty.runs);
+      dirty = (dirty_list){ 0 };
+    }
+
+    // the file is truncated once the superblock on the disk has the new size (the pages after it are flushed)
+    if(size < fs->size) {
+      map_image(fs, size);
+      if(ftruncate(fs->fd, size) == -1) {}
+      fs->size = size;
+      fs->block_map = (unsigned long *)realloc(fs->block_map, (n_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD * sizeof(unsigned long));
+    }
+  }
+
+  pthread_mutex_unlock(&fs->alloc_lock);
+  pthread_mutex_unlock(&fs->dur.flush_lock);
+
+  return status;
+}
+
+//set the length of the table of shared chains to the one of an image of n_blocks blocks (if it has one): the blocks
+//added are cleared, and before the blocks after the new end are freed, the ones from n_blocks on must be free or
+//among them (called with alloc_lock held)
+static int resize_shares(vfs_image *fs, int n_blocks){
+  int length = ((long)n_blocks * sizeof(unsigned short) + fs->sb->block_size - 1) / fs->sb->block_size;
+  int n_used = 0, n_cut = 0, n_table = 0, last = -1, tail = -1;
+
+  for(int b = fs->sb->share_table; fs->sb->share_table != 0 && b != -1; tail = b, b = fs->fat[b], n_table++) {
+    if(n_table == length - 1)
+      last = b;
+    n_cut += n_table >= length && b >= n_blocks;
+  }
+
+  for(int b = find_bit(fs, n_blocks, N_BLOCKS, 1); b < N_BLOCKS; b = find_bit(fs, b + 1, N_BLOCKS, 1))
+    n_used++;
+  if(n_used > n_cut)
+    return VFS_EBUSY;
+
+  if(fs->sb->share_table == 0 || n_table == length)
+    return VFS_OK;
+
+  if(n_table > length) {
+    int rest = fs->fat[last];
+    fs->fat[last] = -1;
+    mark_dirty(fs, &fs->fat[last], sizeof(int));
+    free_chain(fs, rest);
+  }
+  else {
+    int first_block = alloc_chain(fs, length - n_table, fs->sb->free_block);
+    if(first_block == -1)
+      return VFS_ENOSPC;
+
+    for(int b = first_block; b != -1; b = fs->fat[b]) {
+      memset(BLOCK(b), 0, fs->sb->block_size);
+      mark_dirty(fs, BLOCK(b), fs->sb->block_size);
+    }
+    fs->fat[tail] = first_block;
+    mark_dirty(fs, &fs->fat[tail], sizeof(int));
+  }
+  drop_extent_map(fs, fs->sb->share_table);
+
+  return VFS_OK;
+}
+
+//move the FAT to fat_offset, with n_blocks entries (the ones added are free), while no directory index or extent
+//map is being read from it
+static void move_fat(vfs_image *fs, long fat_offset, int n_blocks){
+  int *fat = (int *)((char *)fs->sb + fat_offset);
+  int n = n_blocks < N_BLOCKS ? n_blocks : N_BLOCKS;
+
+  pthread_rwlock_wrlock(&fs->index_lock);
+  pthread_rwlock_wrlock(&fs->extent_lock);
+  if(fat != fs->fat)
+    memmove(fat, fs->fat, FAT_SIZE(n));
+  memset(&fat[n], FAT_FREE, FAT_SIZE(n_blocks - n));
+  fs->fat = fat;
+  pthread_rwlock_unlock(&fs->extent_lock);
+  pthread_rwlock_unlock(&fs->index_lock);
+
+  return;
+}
+
+//map the image up to size bytes without moving it: the pages added come from the address range kept for the
+//mapping (or from mremap, if there is none and the addresses after it are free), and the ones removed go back to it
+static int map_image(vfs_image *fs, long size){
+  long mapped = (fs->size + fs->page_size - 1) / fs->page_size * fs->page_size;
+  long wanted = (size + fs->page_size - 1) / fs->page_size * fs->page_size;
+  char *start = (char *)fs->sb;
+
+  if(wanted > fs->reserved) {
+    if(mremap(start, fs->reserved, wanted, 0) == MAP_FAILED)
+      return VFS_EHOST;
+    fs->reserved = wanted;
+  }
+  else if(wanted > mapped) {
+    int populate = fs->map_flags & VFS_MAP_POPULATE ? MAP_POPULATE : 0;
+    if(mmap(start + mapped, wanted - mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | populate, fs->fd, mapped) == MAP_FAILED)
+      return VFS_EHOST;
+    if(fs->map_flags & VFS_MAP_HUGE)
+      madvise(start + mapped, wanted - mapped, MADV_HUGEPAGE);
+  }
+  else if(wanted < mapped)
+    mmap(start + wanted, mapped - wanted, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+  return VFS_OK;
+}
+
+//size of an image of n_blocks blocks with its FAT and its data blocks at those offsets
+static long image_end(long fat_offset, long data_offset, int n_blocks, int block_size){
+  long fat_end = fat_offset + FAT_SIZE(n_blocks), data_end = data_offset + (long)n_blocks * block_size;
+
+  return fat_end > data_end ? fat_end : data_end;
+}
+
+
+//size of the image of a new file system
+long vfs_image_size(int block_size, int fat_type){
+  return FILESYSTEM_SIZE(block_size, FAT_ENTRIES(fat_type));
+}
+
+//create and format a new image (the file must not exist)
+int vfs_format(const char *path, int block_size, int fat_type){
+  return vfs_format_flags(path, block_size, fat_type, 0);
+}
+
+int vfs_format_flags(const char *path, int block_size, int fat_type, int flags){
+  vfs_image image = { 0 }, *fs = &image;
+  int fsd;
+
+  if(block_size != 128 && block_size != 256 && block_size != 512 && block_size != 1024)
+    return VFS_EINVAL;
+
+  if(fat_type < MIN_FAT_TYPE || fat_type > MAX_FAT_TYPE)
+    return VFS_EINVAL;
+
+  if((fsd = open(path, O_CREAT | O_EXCL | O_RDWR, S_IRWXU)) == -1)
+    return errno == EEXIST ? VFS_EEXIST : VFS_EHOST;
+
+  // extends the file system to the desired size (without writing it, so the file is sparse)
+  fs->size = vfs_image_size(block_size, fat_type);
+  if(ftruncate(fsd, fs->size) == -1 || (fs->sb = (superblock *)mmap(NULL, fs->size, PROT_READ | PROT_WRITE, MAP_SHARED, fsd, 0)) == MAP_FAILED) {
+    close(fsd);
+    unlink(path);
+    return VFS_EHOST;
+  }
+  close(fsd);
+
+  fs->fat = (int *)((unsigned long int)fs->sb + block_size);
+  fs->blocks = (char *)((unsigned long int)fs->fat + FAT_SIZE(FAT_ENTRIES(fat_type)));
+
+  // initiates the superblock
+  init_superblock(fs, block_size, fat_type, flags);
+
+  // initiates FAT (only the entry of the root directory, the others are free)
+  init_fat(fs);
+
+  // starts the root directory block '/'
+  init_dir_block(fs, fs->sb->root_block, fs->sb->root_block, flags);
+
+  munmap(fs->sb, fs->size);
+
+  return VFS_OK;
+}
+
+//map an image and check it, rolling back the operations that were not flushed
+static int open_image(const char *path, int flags, vfs_image **image){
+  int fsd;
+  struct stat buf;
+
+  if((fsd = open(path, O_RDWR)) == -1)
+    return errno == ENOENT ? VFS_ENOENT : VFS_EHOST;
+
+  if(fstat(fsd, &buf) == -1) {
+    close(fsd);
+    return VFS_EHOST;
+  }
+
+  if(buf.st_size < (long)sizeof(superblock)) {
+    close(fsd);
+    return VFS_EBADFS;
+  }
+
+  vfs_image *fs = (vfs_image *)calloc(1, sizeof(vfs_image));
+  fs->size = buf.st_size;
+  fs->fd = fsd;
+  fs->page_size = sysconf(_SC_PAGESIZE);
+  fs->reserved = (fs->size + fs->page_size - 1) / fs->page_size * fs->page_size;
+  fs->map_flags = flags;
+
+  // maps the file system (reading all of it with VFS_MAP_POPULATE)
+  int populate = flags & VFS_MAP_POPULATE ? MAP_POPULATE : 0;
+  if((fs->sb = (superblock *)mmap(NULL, fs->size, PROT_READ | PROT_WRITE, MAP_SHARED | populate, fsd, 0)) == MAP_FAILED) {
+    close(fsd);
+    free(fs);
+    return VFS_EHOST;
+  }
+
+  // test if the file system is valid
+  if(fs->sb->check_number != CHECK_NUMBER || fs->sb->fat_type < MIN_FAT_TYPE || fs->sb->fat_type > MAX_FAT_TYPE
+     || fs->sb->block_size < (int)sizeof(superblock)) {
+    munmap(fs->sb, fs->size);
+    close(fsd);
+    free(fs);
+    return VFS_EBADFS;
+  }
+
+  // older filesystems derive the number of entries from the FAT type, and the ones that were never resized have
+  // the FAT after the superblock
+  if(fs->sb->n_blocks == 0)
+    fs->sb->n_blocks = FAT_ENTRIES(fs->sb->fat_type);
+  long fat_offset = fs->sb->fat_offset != 0 ? fs->sb->fat_offset : fs->sb->block_size;
+  long data_offset = fs->sb->data_offset != 0 ? fs->sb->data_offset : fs->sb->block_size + FAT_SIZE(N_BLOCKS);
+
+  if(fat_offset < fs->sb->block_size || data_offset < fs->sb->block_size || N_BLOCKS > FAT_ENTRIES(MAX_FAT_TYPE)
+     || fs->size != image_end(fat_offset, data_offset, N_BLOCKS, fs->sb->block_size)) {
+    munmap(fs->sb, fs->size);
+    close(fsd);
+    free(fs);
+    return VFS_EBADFS;
+  }
+
+  // the mapping is moved to the start of an address range that fits the largest image, so that it grows in place
+  // (without it, vfs_resize can only grow it if the addresses after it are free), aligned for huge pages
+  int max_blocks = FAT_ENTRIES(MAX_FAT_TYPE);
+  long max_size = image_end(data_offset + (long)max_blocks * fs->sb->block_size, data_offset, max_blocks, fs->sb->block_size);
+  char *range = mmap(NULL, max_size + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  char *aligned = (char *)(((unsigned long)range + HUGE_PAGE_SIZE - 1) & ~(unsigned long)(HUGE_PAGE_SIZE - 1));
+  if(range != MAP_FAILED && mremap(fs->sb, fs->size, fs->size, MREMAP_MAYMOVE | MREMAP_FIXED, aligned) != MAP_FAILED) {
+    if(aligned > range)
+      munmap(range, aligned - range);
+    fs->sb = (superblock *)aligned;
+    fs->reserved = max_size + HUGE_PAGE_SIZE - (aligned - range);
+  }
+  else if(range != MAP_FAILED)
+    munmap(range, max_size + HUGE_PAGE_SIZE);
+
+  // the kernel backs it with huge pages where the file system of the image allows it (e.g. tmpfs with huge=advise)
+  if(flags & VFS_MAP_HUGE)
+    madvise(fs->sb, fs->size, MADV_HUGEPAGE);
+
+  fs->fat = (int *)((char *)fs->sb + fat_offset);
+  fs->blocks = (char *)fs->sb + data_offset;
+
+  pthread_mutex_init(&fs->rename_lock, NULL);
+  pthread_mutex_init(&fs->alloc_lock, NULL);
+  pthread_rwlock_init(&fs->index_lock, NULL);
+  pthread_rwlock_init(&fs->extent_lock, NULL);
+  pthread_mutex_init(&fs->jnl.lock, NULL);
+  pthread_cond_init(&fs->jnl.cond, NULL);
+  pthread_mutex_init(&fs->dur.lock, NULL);
+  pthread_cond_init(&fs->dur.cond, NULL);
+  pthread_mutex_init(&fs->dur.flush_lock, NULL);
+  pthread_mutex_init(&fs->gate.lock, NULL);
+  pthread_cond_init(&fs->gate.cond, NULL);
+  fs->n_handles = 1;
+  fs->prefetch_blocks = PREFETCH_BYTES / fs->sb->block_size;
+
+  // the pages changed by the operations are tracked, for the flushes of the journal and the durability modes
+  fs->dirty_pages = (unsigned long *)calloc(((fs->size + fs->page_size - 1) / fs->page_size + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+
+  // rolls back the operations that were not flushed (the journal is used once vfs_journal turns it on)
+  journal_open(fs);
+
+  // builds the bitmap of the blocks in use
+  init_block_map(fs);
+
+  *image = fs;
+
+  return VFS_OK;
+}
+
+//open an image, with a handle whose current directory is the root
+int vfs_open(const char *path, vfs_t **vfs){
+  return vfs_open_flags(path, vfs, 0);
+}
+
+//open an image with the options of its mapping (VFS_MAP_POPULATE, VFS_MAP_HUGE)
+int vfs_open_flags(const char *path, vfs_t **vfs, int flags){
+  vfs_image *fs;
+  int status;
+
+  if((flags & ~(VFS_MAP_POPULATE | VFS_MAP_HUGE)) != 0)
+    return VFS_EINVAL;
+
+  if((status = open_image(path, flags, &fs)) != VFS_OK)
+    return status;
+
+  *vfs = (vfs_t *)malloc(sizeof(vfs_t));
+  (*vfs)->fs = fs;
+  (*vfs)->cwd = pin_dir(fs, fs->sb->root_block);
+
+  return VFS_OK;
+}
+
+//new handle on the image of vfs, starting at its current directory
+int vfs_dup(vfs_t *vfs, vfs_t **copy){
+  __sync_fetch_and_add(&vfs->fs->n_handles, 1);
+  __sync_fetch_and_add(&vfs->cwd->refs, 1);
+
+  *copy = (vfs_t *)malloc(sizeof(vfs_t));
+  **copy = *vfs;
+
+  return VFS_OK;
+}
+
+//close a handle, and the image with its last handle
+int vfs_close(vfs_t *vfs){
+  vfs_image *fs = vfs->fs;
+
+  unpin_dir(fs, vfs->cwd);
+  free(vfs);
+
+  if(__sync_sub_and_fetch(&fs->n_handles, 1) > 0)
+    return VFS_OK;
+
+  return close_image(fs);
+}
+
+//write the changes of an image that are not on the disk yet, and unmap it (VFS_EHOST if they couldn't be written)
+static int close_image(vfs_image *fs){
+  int status = VFS_OK;
+
+  // the changes made since the last flush are written before the image is closed
+  stop_flush_thread(fs);
+  if(fs->dur.mode != VFS_DURABILITY_NONE && flush_dirty(fs) == -1)
+    status = VFS_EHOST;
+
+  for(int i = 0; i < fs->dir_indexes.capacity; i++)
+    if(fs->dir_indexes.keys[i] != -1)
+      free_dir_index((dir_index *)fs->dir_indexes.values[i]);
+  for(int i = 0; i < fs->file_extents.capacity; i++)
+    if(fs->file_extents.keys[i] != -1) {
+      free(((extent_map *)fs->file_extents.values[i])->extents);
+      free(((extent_map *)fs->file_extents.values[i])->frame_ends);
+      free(fs->file_extents.values[i]);
+    }
+  free(fs->dir_indexes.keys);
+  free(fs->dir_indexes.values);
+  free(fs->file_extents.keys);
+  free(fs->file_extents.values);
+
+  free(fs->block_map);
+  free(fs->dirty_pages);
+  munmap(fs->sb, fs->reserved);
+  if(close(fs->fd) == -1)
+    status = VFS_EHOST;
+  pthread_mutex_destroy(&fs->rename_lock);
+  pthread_mutex_destroy(&fs->alloc_lock);
+  pthread_rwlock_destroy(&fs->index_lock);
+  pthread_rwlock_destroy(&fs->extent_lock);
+  pthread_mutex_destroy(&fs->jnl.lock);
+  pthread_cond_destroy(&fs->jnl.cond);
+  pthread_mutex_destroy(&fs->dur.lock);
+  pthread_cond_destroy(&fs->dur.cond);
+  pthread_mutex_destroy(&fs->dur.flush_lock);
+  pthread_mutex_destroy(&fs->gate.lock);
+  pthread_cond_destroy(&fs->gate.cond);
+  free(fs);
+
+  return status;
+}
+
+int vfs_info(vfs_t *vfs, vfs_info_t *info){
+  vfs_image *fs = vfs->fs;
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  info->block_size = fs->sb->block_size;
+  info->fat_type = fs->sb->fat_type;
+  info->n_blocks = fs->sb->n_blocks;
+  info->n_free_blocks = fs->sb->n_free_blocks;
+  info->n_write_calls = fs->n_write_calls;
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  pthread_mutex_lock(&fs->jnl.lock);
+  info->journal_mode = fs->jnl.mode;
+  info->n_commits = fs->jnl.n_commits;
+  info->n_rolled_back = fs->jnl.n_rolled_back;
+  info->n_journal_overflows = fs->jnl.n_overflows;
+  pthread_mutex_unlock(&fs->jnl.lock);
+
+  pthread_mutex_lock(&fs->dur.lock);
+  info->durability = fs->dur.mode;
+  info->n_flushes = fs->dur.n_flushes;
+  info->flush_us = fs->dur.flush_ns / 1000;
+  info->max_flush_us = fs->dur.max_flush_ns / 1000;
+  pthread_mutex_unlock(&fs->dur.lock);
+
+  info->prefetch_blocks = __atomic_load_n(&fs->prefetch_blocks, __ATOMIC_RELAXED);
+  info->n_prefetches = __atomic_load_n(&fs->n_prefetches, __ATOMIC_RELAXED);
+  info->compress_in = __atomic_load_n(&fs->compress_in, __ATOMIC_RELAXED);
+  info->compress_out = __atomic_load_n(&fs->compress_out, __ATOMIC_RELAXED);
+  info->compress_us = __atomic_load_n(&fs->compress_ns, __ATOMIC_RELAXED) / 1000;
+  info->decompress_bytes = __atomic_load_n(&fs->decompress_bytes, __ATOMIC_RELAXED);
+  info->decompress_us = __atomic_load_n(&fs->decompress_ns, __ATOMIC_RELAXED) / 1000;
+
+  return VFS_OK;
+}
+
+//set how the operations are journaled, creating the journal of the image the first time it is turned on
+int vfs_journal(vfs_t *vfs, int mode){
+  vfs_image *fs = vfs->fs;
+  int status = VFS_OK;
+
+  if(mode != VFS_JOURNAL_OFF && mode != VFS_JOURNAL_OP && mode != VFS_JOURNAL_GROUP)
+    return VFS_EINVAL;
+
+  if(mode != VFS_JOURNAL_OFF && (status = journal_create(fs)) != VFS_OK)
+    return status;
+
+  // the mode only changes between transactions (the operations in progress when it is turned on are not journaled)
+  pthread_mutex_lock(&fs->jnl.lock);
+  while(fs->jnl.n_active > 0)
+    pthread_cond_wait(&fs->jnl.cond, &fs->jnl.lock);
+  __atomic_store_n(&fs->jnl.mode, mode, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&fs->jnl.lock);
+
+  return status;
+}
+
+//set when the changes are written to the disk (batch_ops and batch_ms are only used by VFS_DURABILITY_BATCH)
+int vfs_durability(vfs_t *vfs, int mode, int batch_ops, int batch_ms){
+  vfs_image *fs = vfs->fs;
+  durability *dur = &fs->dur;
+
+  if(mode != VFS_DURABILITY_NONE && mode != VFS_DURABILITY_BATCH && mode != VFS_DURABILITY_SYNC)
+    return VFS_EINVAL;
+
+  if(mode == VFS_DURABILITY_BATCH && (batch_ops <= 0 || batch_ms <= 0))
+    return VFS_EINVAL;
+
+  // the background thread of the previous mode makes its last flush
+  stop_flush_thread(fs);
+
+  pthread_mutex_lock(&dur->lock);
+  __atomic_store_n(&dur->mode, mode, __ATOMIC_RELAXED);
+  dur->batch_ops = batch_ops;
+  dur->batch_ms = batch_ms;
+  dur->n_ops = 0;
+  if(mode == VFS_DURABILITY_BATCH) {
+    dur->running = 1;
+    pthread_create(&dur->thread, NULL, flush_thread_run, fs);
+  }
+  pthread_mutex_unlock(&dur->lock);
+
+  return VFS_OK;
+}
+
+//set how many blocks of a file are read ahead of the ones being read by vfs_read, vfs_cat, vfs_put and vfs_cp
+//(0 turns the prefetch off)
+int vfs_prefetch(vfs_t *vfs, int n_blocks){
+  if(n_blocks < 0)
+    return VFS_EINVAL;
+
+  __atomic_store_n(&vfs->fs->prefetch_blocks, n_blocks, __ATOMIC_RELAXED);
+
+  return VFS_OK;
+}
+
+//lay out the chains of the image contiguously, for up to max_ms milliseconds (0 for no limit)
+//the operations that change the image wait until it ends, the ones that only read go on
+int vfs_defrag(vfs_t *vfs, int max_ms, vfs_defrag_t *result){
+  if(max_ms < 0)
+    return VFS_EINVAL;
+
+  gate_close(vfs->fs);
+  pthread_mutex_lock(&vfs->fs->rename_lock);
+  int status = do_defrag(vfs, max_ms, result);
+  pthread_mutex_unlock(&vfs->fs->rename_lock);
+  gate_open(vfs->fs);
+
+  return status;
+}
+
+//check the image of vfs with n_workers threads (0 for one per processor), without repairing it
+//the operations that change the image wait until it ends, the ones that only read go on
+int vfs_fsck(vfs_t *vfs, int n_workers, vfs_fsck_fn report, void *arg, vfs_fsck_t *result){
+  if(n_workers < 0)
+    return VFS_EINVAL;
+
+  gate_close(vfs->fs);
+  pthread_mutex_lock(&vfs->fs->rename_lock);
+  int status = do_fsck(vfs->fs, 0, n_workers, report, arg, result);
+  pthread_mutex_unlock(&vfs->fs->rename_lock);
+  gate_open(vfs->fs);
+
+  return status;
+}
+
+//check an image that is not open, and repair it if asked to (the repairs are on the disk when it returns)
+int vfs_fsck_image(const char *path, int repair, int n_workers, vfs_fsck_fn report, void *arg, vfs_fsck_t *result){
+  vfs_image *fs;
+  int status;
+
+  if(n_workers < 0)
+    return VFS_EINVAL;
+
+  if((status = open_image(path, 0, &fs)) != VFS_OK)
+    return status;
+
+  status = do_fsck(fs, repair, n_workers, report, arg, result);
+  if(status == VFS_OK && result->n_repaired > 0 && msync(fs->sb, fs->size, MS_SYNC) == -1)
+    status = VFS_EHOST;
+  if(close_image(fs) != VFS_OK && status == VFS_OK)
+    status = VFS_EHOST;
+
+  return status;
+}
+
+//set the number of blocks of the image (the operations that change it wait, see vfs_defrag)
+int vfs_resize(vfs_t *vfs, int n_blocks){
+  if(n_blocks < FAT_ENTRIES(MIN_FAT_TYPE) || n_blocks > FAT_ENTRIES(MAX_FAT_TYPE))
+    return VFS_EINVAL;
+
+  gate_close(vfs->fs);
+  pthread_mutex_lock(&vfs->fs->rename_lock);
+  int status = do_resize(vfs->fs, n_blocks);
+  pthread_mutex_unlock(&vfs->fs->rename_lock);
+  gate_open(vfs->fs);
+
+  return status;
+}
+
+const char *vfs_strerror(int status){
+  switch (status){
+    case VFS_OK: return "success";
+    case VFS_ENOENT: return "entry doesn't exist";
+    case VFS_EEXIST: return "entry exists";
+    case VFS_ENOTDIR: return "entry not a directory";
+    case VFS_EISDIR: return "entry not a file";
+    case VFS_ENOTEMPTY: return "entry not empty";
+    case VFS_ENAMETOOLONG: return "name too long (MAX: 20 characters)";
+    case VFS_ENOSPC: return "disk space is full";
+    case VFS_EINVAL: return "invalid argument";
+    case VFS_ESAME: return "source and destination are the same file";
+    case VFS_ERANGE: return "offset out of range";
+    case VFS_EFBIG: return "file too large (MAX: 2147483647 bytes)";
+    case VFS_ENOTREG: return "file is not a regular file";
+    case VFS_EHOST: return "host file cannot be accessed";
+    case VFS_EBADFS: return "invalid filesystem";
+    case VFS_EBUSY: return "blocks in use after the new end (defrag moves them to the start)";
+    default: return "unknown error";
+  }
+}
+
+// the operations lock the directory of the last component of their path, for reading if they don't change it,
+// and the ones that lock other directories as well take rename_lock first
+
+int vfs_list(vfs_t *vfs, const char *path, int offset, vfs_entry_t *entries, int max, int *n){
+  dir_index *dir;
+
+  *n = 0;
+  int status = resolve_dir(vfs, path, &dir);
+  if(status == VFS_OK && (status = lock_index(dir, 0)) != VFS_OK)
+    unpin_dir(vfs->fs, dir);
+  if(status == VFS_OK) {
+    status = do_list(vfs, dir, offset, entries, max, n);
+    unlock_dir(vfs->fs, dir);
+  }
+  return status;
+}
+
+int vfs_stat(vfs_t *vfs, const char *path, vfs_entry_t *entry){
+  char name[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+  int status = lock_path(vfs, path, LOCK_READ, &dir, name);
+  if(status == VFS_OK) {
+    status = do_stat(vfs, dir, name, entry);
+    unlock_path(vfs, dir, LOCK_READ);
+  }
+  return status;
+}
+
+int vfs_mkdir(vfs_t *vfs, const char *path){
+  return vfs_mkdir_flags(vfs, path, vfs->fs->sb->dir_flags);
+}
+
+int vfs_mkdir_flags(vfs_t *vfs, const char *path, int flags){
+  char name[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+
+  txn_begin(vfs->fs);
+  int status = lock_path(vfs, path, LOCK_WRITE, &dir, name);
+  if(status == VFS_OK) {
+    status = do_mkdir(vfs, dir, name, flags);
+    txn_commit(vfs->fs);
+    unlock_path(vfs, dir, LOCK_WRITE);
+  }
+  txn_end(vfs->fs);
+  return status;
+}
+
+int vfs_cd(vfs_t *vfs, const char *path){
+  return do_cd(vfs, path);
+}
+
+int vfs_pwd(vfs_t *vfs, char *buf, size_t size){
+  pthread_mutex_lock(&vfs->fs->rename_lock);
+  int status = do_pwd(vfs, buf, size);
+  pthread_mutex_unlock(&vfs->fs->rename_lock);
+  return status;
+}
+
+int vfs_rmdir(vfs_t *vfs, const char *path){
+  char name[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+
+  txn_begin(vfs->fs);
+  int status = lock_path(vfs, path, LOCK_RENAME, &dir, name);
+  if(status == VFS_OK) {
+    status = do_rmdir(vfs, dir, name);
+    txn_commit(vfs->fs);
+    unlock_path(vfs, dir, LOCK_RENAME);
+  }
+  txn_end(vfs->fs);
+  return status;
+}
+
+int vfs_get(vfs_t *vfs, const char *host_path, const char *path){
+  return vfs_get_flags(vfs, host_path, path, 0);
+}
+
+int vfs_get_flags(vfs_t *vfs, const char *host_path, const char *path, int flags){
+  char name[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+
+  if(flags & ~VFS_FILE_COMPRESSED)
+    return VFS_EINVAL;
+
+  txn_begin(vfs->fs);
+  int status = lock_path(vfs, path, LOCK_WRITE, &dir, name);
+  if(status == VFS_OK) {
+    status = do_get(vfs, host_path, dir, name, flags);
+    txn_commit(vfs->fs);
+    unlock_path(vfs, dir, LOCK_WRITE);
+  }
+  txn_end(vfs->fs);
+  return status;
+}
+
+int vfs_get_tree(vfs_t *vfs, const char *host_dir, const char *path, int n_workers, vfs_error_fn report, void *arg){
+  return vfs_get_tree_flags(vfs, host_dir, path, n_workers, 0, report, arg);
+}
+
+int vfs_get_tree_flags(vfs_t *vfs, const char *host_dir, const char *path, int n_workers, int flags, vfs_error_fn report, void *arg){
+  if(flags & ~VFS_FILE_COMPRESSED)
+    return VFS_EINVAL;
+
+  return do_get_tree(vfs, host_dir, path, n_workers, flags, report, arg);
+}
+
+int vfs_put(vfs_t *vfs, const char *path, const char *host_path){
+  char name[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+  int status = lock_path(vfs, path, LOCK_READ, &dir, name);
+  if(status == VFS_OK) {
+    status = do_put(vfs, dir, name, host_path);
+    unlock_path(vfs, dir, LOCK_READ);
+  }
+  return status;
+}
+
+int vfs_read(vfs_t *vfs, const char *path, int offset, char *buf, int size, int *n){
+  char name[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+
+  *n = 0;
+  int status = lock_path(vfs, path, LOCK_READ, &dir, name);
+  if(status == VFS_OK) {
+    status = do_read(vfs, dir, name, offset, buf, size, n);
+    unlock_path(vfs, dir, LOCK_READ);
+  }
+  return status;
+}
+
+int vfs_cat(vfs_t *vfs, const char *path, int offset, int length, int fd){
+  char name[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+  int status = lock_path(vfs, path, LOCK_READ, &dir, name);
+  if(status == VFS_OK) {
+    status = do_cat(vfs, dir, name, offset, length, fd);
+    unlock_path(vfs, dir, LOCK_READ);
+  }
+  return status;
+}
+
+int vfs_cp(vfs_t *vfs, const char *src, const char *dest){
+  char src_name[MAX_NAME_LENGHT + 2], dest_name[MAX_NAME_LENGHT + 2];
+  dir_index *src_dir, *dest_dir;
+
+  txn_begin(vfs->fs);
+  int status = lock_paths(vfs, src, dest, &src_dir, src_name, &dest_dir, dest_name);
+  if(status == VFS_OK) {
+    status = do_cp(vfs, src_dir, src_name, dest_dir, dest_name);
+    txn_commit(vfs->fs);
+    unlock_paths(vfs, src_dir, dest_dir);
+  }
+  txn_end(vfs->fs);
+  return status;
+}
+
+int vfs_mv(vfs_t *vfs, const char *src, const char *dest){
+  char src_name[MAX_NAME_LENGHT + 2], dest_name[MAX_NAME_LENGHT + 2];
+  dir_index *src_dir, *dest_dir;
+
+  txn_begin(vfs->fs);
+  int status = lock_paths(vfs, src, dest, &src_dir, src_name, &dest_dir, dest_name);
+  if(status == VFS_OK) {
+    status = do_mv(vfs, src_dir, src_name, dest_dir, dest_name);
+    txn_commit(vfs->fs);
+    unlock_paths(vfs, src_dir, dest_dir);
+  }
+  txn_end(vfs->fs);
+  return status;
+}
+
+int vfs_rm(vfs_t *vfs, const char *path){
+  char name[MAX_NAME_LENGHT + 2];
+  dir_index *dir;
+
+  txn_begin(vfs->fs);
+  int status = lock_path(vfs, path, LOCK_WRITE, &dir, name);
+  if(status == VFS_OK) {
+    status = do_rm(vfs, dir, name);
+    txn_commit(vfs->fs);
+    unlock_path(vfs, dir, LOCK_WRITE);
+  }
+  txn_end(vfs->fs);
+  return status;
+}
@@ -2,33 +2,28 @@
 //                                                               //
 //                Project II: File System Manager                //
 //                                                               //
-// Compilation: gcc vfs.c -Wall -lreadline -o vfs                //
-// Usage: ./vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] FILESYSTEM //
+// Compilation: make (or gcc vfs.c libvfs.c -Wall -pthread       //
+//              -lreadline -o vfs)                               //
+// Usage: ./vfs [-b[128|256|512|1024]] [-f[7-28]] [-S] [-c[r]]   //
+//              [-d[none|batch[:OPS:MS]|sync]]                   //
+//              [-j[off|op|group]] [-m[populate|huge]]           //
+//              [-pBLOCKS] [-s SCRIPT] [-t] [-wWORKERS]          //
+//              FILESYSTEM                                       //
 //                                                               //
 ///////////////////////////////////////////////////////////////////
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
-#include <sys/types.h>
+#include <sys/resource.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#include "vfs.h"
 
 #define MAXARGS 100
-#define CHECK_NUMBER 9999
-#define TYPE_DIR 'D'
-#define TYPE_FILE 'F'
-#define MAX_NAME_LENGHT 20
-
-#define FAT_ENTRIES(TYPE) ((TYPE) == 7 ? 128 : (TYPE) == 8 ? 256 : (TYPE) == 9 ? 512 : 1024)
-#define FAT_SIZE(TYPE) (FAT_ENTRIES(TYPE) * sizeof(int))
-#define BLOCK(N) (blocks + (N) * sb->block_size)
-#define DIR_ENTRIES_PER_BLOCK (sb->block_size / sizeof(dir_entry))
+#define LS_PAGE 64  // entries read from the library at a time by ls
 
 typedef struct command {
   char *cmd;              // string with just the main command
@@ -36,76 +31,181 @@ typedef struct command {
   char *argv[MAXARGS+1];  // vector containing the arguments
 } COMMAND;
 
-typedef struct superblock_entry {
-  int check_number;   // number that allows to identify the system as valid
-  int block_size;     // block size {128, 256 (default), 512 or 1024 bytes}
-  int fat_type;       // FAT type {7, 8 (default), 9 or 10}
-  int root_block;     // number of the first block for the root directory
-  int free_block;     // number of the first block in the list of free blocks
-  int n_free_blocks;  // total number of free blocks
-} superblock;
-
-typedef struct directory_entry {
-  char type;                   // entry type (TYPE_DIR or TYPE_FILE)
-  char name[MAX_NAME_LENGHT];  // entry name
-  unsigned char day;           // day where it was created (between 1 and 31)
-  unsigned char month;         // month where it was created (between 1 and 12)
-  unsigned char year;          // year where it was created (between 0 and 255 - 0 representa o ano de 1900)
-  int size;                    // size in bytes (0 if TYPE_DIR)
-  int first_block;             // first data block
-} dir_entry;
+typedef struct ls_key {
+  const char *name;  // name of the entry (in the arena of ls)
+  int index;         // position of the entry in the arena
+} ls_key;
 
 // global variables
-superblock *sb;   // superblock of the file system
-int *fat;         // pointer to the FAT table
-char *blocks;     // pointer to data region
-int current_dir;  // block of current directory
+vfs_t *vfs;         // handle of the file system
+char *script_name;  // file with the commands to run in batch mode (NULL for standard input)
+int batch_mode;     // read commands without readline (script or standard input not a terminal)
+int show_timing;    // print the latency of each command and a summary at the end
+int n_workers;      // number of threads used by get -r (0 for one per processor)
+int dir_flags;      // flags of the directories of a new file system (VFS_DIR_SORTED)
+int journal_mode;   // VFS_JOURNAL_OFF, VFS_JOURNAL_OP or VFS_JOURNAL_GROUP
+int durability;     // VFS_DURABILITY_NONE, VFS_DURABILITY_BATCH or VFS_DURABILITY_SYNC
+int batch_ops = 64; // operations between the flushes of VFS_DURABILITY_BATCH
+int batch_ms = 100; // and longest time between them
+int check_mode;     // check the file system and exit (1, -c), repairing it (2, -cr)
+int map_flags;      // VFS_MAP_POPULATE and VFS_MAP_HUGE
+int prefetch = -1;  // blocks of a file read ahead of the ones being read (-1 for the default of the library)
 
 // auxiliary functions
 COMMAND parse(char *);
 void parse_argv(int, char **);
 void show_usage_and_exit(void);
+int close_filesystem(void);
+void run_interactive(void);
+void run_batch(void);
+double elapsed_us(struct timespec *, struct timespec *);
+void print_time(char *, struct timespec *, struct timespec *, struct rusage *, struct rusage *);
 void init_filesystem(int, int, char *);
-void init_superblock(int, int);
-void init_fat(void);
-void init_dir_block(int, int);
-void init_dir_entry(dir_entry *, char, char *, int, int);
+void check_filesystem(char *);
 void exec_com(COMMAND);
+void print_error(char *, char *, char *, int);
+void print_error_dest(char *, char *, char *, char *, int);
+void report_import_error(const char *, int, void *);
+void report_fsck_problem(const char *, const char *, int, void *);
+void print_fsck_result(vfs_fsck_t *);
+
+// commands that print their results
+void print_ls(char *, int, int, int);
+void ls_unsorted(char *, int, int);
+void ls_sorted(char *, int, int);
+int print_entry(vfs_entry_t *);
+ls_key *ls_keys(vfs_entry_t *, int);
+void ls_sift_down(ls_key *, int, int);
+void print_pwd(void);
+void print_defrag(int);
+void print_fsck(void);
+void print_resize(char *);
+int key_cmp(const void *, const void *);
+const char *getMonthName(unsigned int);
 
-// directory manipulation functions
-void vfs_ls(void);
-void vfs_mkdir(char *);
-void vfs_cd(char *);
-void vfs_pwd(void);
-void vfs_rmdir(char *);
-
-// file manipulation functions
-void vfs_get(char *, char *);
-void vfs_put(char *, char *);
-void vfs_cat(char *);
-void vfs_cp(char *, char *);
-void vfs_mv(char *, char *);
-void vfs_rm(char *);
+int main(int argc, char *argv[]) {
+  parse_argv(argc, argv);
+  if (batch_mode)
+    run_batch();
+  else
+    run_interactive();
+  return close_filesystem();
+}
 
 
-int main(int argc, char *argv[]) {
+void run_interactive(void) {
   char *linha;
   COMMAND com;
+  struct timespec start, end;
+  struct rusage usage_start, usage_end;
 
-  parse_argv(argc, argv);
   while (1) {
     if ((linha = readline("vfs$ ")) == NULL) {
       free(linha);
-      exit(0);
+      break;
     }
     if (strlen(linha) != 0) {
       add_history(linha);
       com = parse(linha);
+      getrusage(RUSAGE_SELF, &usage_start);
+      clock_gettime(CLOCK_MONOTONIC, &start);
       exec_com(com);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      getrusage(RUSAGE_SELF, &usage_end);
+      if (show_timing)
+        print_time(com.cmd, &start, &end, &usage_start, &usage_end);
     }
     free(linha);
   }
-  return 0;
+  return;
+}
+
+
+// reads the commands from the script (or standard input) without prompt or history
+void run_batch(void) {
+  FILE *input = stdin;
+  char *linha = NULL;
+  size_t linha_size = 0;
+  ssize_t n;
+  int n_commands = 0;
+  double total_us = 0;
+  COMMAND com;
+  struct timespec start, end;
+  struct rusage usage_start, usage_end, usage_total;
+
+  getrusage(RUSAGE_SELF, &usage_total);
+  if (script_name != NULL && (input = fopen(script_name, "r")) == NULL) {
+    printf("vfs: cannot open script (%s)\n", script_name);
+    close_filesystem();
+    exit(1);
+  }
+
+  while ((n = getline(&linha, &linha_size, input)) != -1) {
+    while (n > 0 && (linha[n-1] == '\n' || linha[n-1] == '\r'))
+      linha[--n] = '\0';
+    // empty lines and comments are ignored
+    if (n == 0 || linha[0] == '#')
+      continue;
+    com = parse(linha);
+    if (com.cmd == NULL)
+      continue;
+    if (!strcmp(com.cmd, "exit"))
+      break;
+
+    getrusage(RUSAGE_SELF, &usage_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    exec_com(com);
+    // keeps the messages in order with the output written directly to the descriptor
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    n_commands++;
+    total_us += elapsed_us(&start, &end);
+    if (show_timing)
+      print_time(com.cmd, &start, &end, &usage_start, &usage_end);
+  }
+
+  if (show_timing) {
+    vfs_info_t info;
+    vfs_info(vfs, &info);
+    getrusage(RUSAGE_SELF, &usage_end);
+    fprintf(stderr, "total: %d commands in %.3f s (%.0f commands/s, %ld write calls, %ld prefetches)\n", n_commands,
+            total_us / 1e6, total_us > 0 ? n_commands / (total_us / 1e6) : 0, info.n_write_calls, info.n_prefetches);
+    fprintf(stderr, "faults: %ld minor, %ld major\n", usage_end.ru_minflt - usage_total.ru_minflt,
+            usage_end.ru_majflt - usage_total.ru_majflt);
+    if (info.journal_mode != VFS_JOURNAL_OFF)
+      fprintf(stderr, "journal: %ld commits, %d operations failed without room for their records\n", info.n_commits,
+              info.n_journal_overflows);
+    if (info.n_flushes > 0)
+      fprintf(stderr, "flushes: %ld (%.1f us on average, %ld us at most)\n", info.n_flushes,
+              (double)info.flush_us / info.n_flushes, info.max_flush_us);
+    // bytes per microsecond are MB/s
+    if (info.compress_in > 0)
+      fprintf(stderr, "compression: %ld bytes in %ld (%.2fx), %.1f MB/s\n", info.compress_in, info.compress_out,
+              (double)info.compress_in / info.compress_out, info.compress_us > 0 ? (double)info.compress_in / info.compress_us : 0);
+    if (info.decompress_bytes > 0)
+      fprintf(stderr, "decompression: %ld bytes, %.1f MB/s\n", info.decompress_bytes,
+              info.decompress_us > 0 ? (double)info.decompress_bytes / info.decompress_us : 0);
+  }
+
+  free(linha);
+  if (input != stdin)
+    fclose(input);
+  return;
+}
+
+
+double elapsed_us(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+
+// -t - latency of a command and the page faults taken while it ran (major ones read the disk)
+void print_time(char *cmd, struct timespec *start, struct timespec *end, struct rusage *usage_start, struct rusage *usage_end) {
+  fprintf(stderr, "time: %s %.1f us %ld minor %ld major\n", cmd, elapsed_us(start, end),
+          usage_end->ru_minflt - usage_start->ru_minflt, usage_end->ru_majflt - usage_start->ru_majflt);
+  return;
 }
 
 
@@ -127,7 +227,7 @@ void parse_argv(int argc, char *argv[]) {
   // default values
   block_size = 256;
   fat_type = 8;
-  if (argc < 2 || argc > 4) {
+  if (argc < 2) {
     printf("vfs: invalid number of arguments\n");
     show_usage_and_exit();
   }
@@ -141,10 +241,73 @@ void parse_argv(int argc, char *argv[]) {
 	}
       } else if (argv[i][1] == 'f') {
 	fat_type = atoi(&argv[i][2]);
-	if (fat_type != 7 && fat_type != 8 && fat_type != 9 && fat_type != 10) {
+	if (fat_type < VFS_MIN_FAT_TYPE || fat_type > VFS_MAX_FAT_TYPE) {
 	  printf("vfs: invalid fat type (%d)\n", fat_type);
 	  show_usage_and_exit();
 	}
+      } else if (argv[i][1] == 's') {
+	// the script name can be attached (-sSCRIPT) or the next argument (-s SCRIPT)
+	if (argv[i][2] != '\0')
+	  script_name = &argv[i][2];
+	else if (i + 1 < argc - 1)
+	  script_name = argv[++i];
+	else {
+	  printf("vfs: missing script name\n");
+	  show_usage_and_exit();
+	}
+      } else if (argv[i][1] == 't' && argv[i][2] == '\0') {
+	show_timing = 1;
+      } else if (argv[i][1] == 'S' && argv[i][2] == '\0') {
+	dir_flags = VFS_DIR_SORTED;
+      } else if (argv[i][1] == 'c' && (argv[i][2] == '\0' || !strcmp(&argv[i][2], "r"))) {
+	check_mode = argv[i][2] == '\0' ? 1 : 2;
+      } else if (argv[i][1] == 'd') {
+	// batch can be followed by the number of operations and the milliseconds between flushes (batch:OPS:MS)
+	char *mode = argv[i][2] != '\0' || i + 1 >= argc - 1 ? &argv[i][2] : argv[++i];
+	if (!strcmp(mode, "none"))
+	  durability = VFS_DURABILITY_NONE;
+	else if (!strcmp(mode, "sync"))
+	  durability = VFS_DURABILITY_SYNC;
+	else if (!strncmp(mode, "batch", 5) && (mode[5] == '\0' || (sscanf(mode + 5, ":%d:%d", &batch_ops, &batch_ms) == 2 && batch_ops > 0 && batch_ms > 0)))
+	  durability = VFS_DURABILITY_BATCH;
+	else {
+	  printf("vfs: invalid durability mode (%s)\n", mode);
+	  show_usage_and_exit();
+	}
+      } else if (argv[i][1] == 'j') {
+	if (!strcmp(&argv[i][2], "off"))
+	  journal_mode = VFS_JOURNAL_OFF;
+	else if (!strcmp(&argv[i][2], "op"))
+	  journal_mode = VFS_JOURNAL_OP;
+	else if (!strcmp(&argv[i][2], "group"))
+	  journal_mode = VFS_JOURNAL_GROUP;
+	else {
+	  printf("vfs: invalid journal mode (%s)\n", &argv[i][2]);
+	  show_usage_and_exit();
+	}
+      } else if (argv[i][1] == 'm') {
+	if (!strcmp(&argv[i][2], "populate"))
+	  map_flags |= VFS_MAP_POPULATE;
+	else if (!strcmp(&argv[i][2], "huge"))
+	  map_flags |= VFS_MAP_HUGE;
+	else {
+	  printf("vfs: invalid mapping option (%s)\n", &argv[i][2]);
+	  show_usage_and_exit();
+	}
+      } else if (argv[i][1] == 'p') {
+	char *end;
+	long n_blocks = strtol(&argv[i][2], &end, 10);
+	if (argv[i][2] == '\0' || *end != '\0' || n_blocks < 0 || n_blocks > (1L << VFS_MAX_FAT_TYPE)) {
+	  printf("vfs: invalid prefetch distance (%s)\n", &argv[i][2]);
+	  show_usage_and_exit();
+	}
+	prefetch = n_blocks;
+      } else if (argv[i][1] == 'w') {
+	n_workers = atoi(&argv[i][2]);
+	if (n_workers < 1) {
+	  printf("vfs: invalid number of workers (%d)\n", n_workers);
+	  show_usage_and_exit();
+	}
       } else {
 	printf("vfs: invalid argument (%s)\n", argv[i]);
 	show_usage_and_exit();
@@ -154,125 +317,84 @@ void parse_argv(int argc, char *argv[]) {
       show_usage_and_exit();
     }
   }
+  batch_mode = script_name != NULL || !isatty(0);
+  if (check_mode)
+    check_filesystem(argv[argc-1]);
   init_filesystem(block_size, fat_type, argv[argc-1]);
   return;
 }
 
 
 void show_usage_and_exit(void) {
-  printf("Usage: vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] FILESYSTEM\n");
+  printf("Usage: vfs [-b[128|256|512|1024]] [-f[7-28]] [-S] [-c[r]] [-d[none|batch[:OPS:MS]|sync]] [-j[off|op|group]] [-m[populate|huge]] [-pBLOCKS] [-s SCRIPT] [-t] [-wWORKERS] FILESYSTEM\n");
   exit(1);
 }
 
-
-void init_filesystem(int block_size, int fat_type, char *filesystem_name) {
-  int fsd, filesystem_size;
-
-  if ((fsd = open(filesystem_name, O_RDWR)) == -1) {
-    // the file system doesnt exist --> it needs to be created and formatted
-    if ((fsd = open(filesystem_name, O_CREAT | O_TRUNC | O_RDWR, S_IRWXU)) == -1) {
-      printf("vfs: cannot create filesystem (%s)\n", filesystem_name);
-      show_usage_and_exit();
-    }
-
-    // calculates the size of the file system
-    filesystem_size = block_size + FAT_SIZE(fat_type) + FAT_ENTRIES(fat_type) * block_size;
-    printf("vfs: formatting virtual file-system (%d bytes) ... please wait\n", filesystem_size);
-
-    // extends the file system to the desired size
-    lseek(fsd, filesystem_size - 1, SEEK_SET);
-    write(fsd, "", 1);
-
-    // maps the file system and starts the global variables
-    if ((sb = (superblock *) mmap(NULL, filesystem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fsd, 0)) == MAP_FAILED) {
-      close(fsd);
-      printf("vfs: cannot map filesystem (mmap error)\n");
-      exit(1);
-    }
-    fat = (int *) ((unsigned long int) sb + block_size);
-    blocks = (char *) ((unsigned long int) fat + FAT_SIZE(fat_type));
-    
-    // initiates the superblock
-    init_superblock(block_size, fat_type);
-    
-    // initiates FAT
-    init_fat();
-    
-    // starts the root directory block '/'
-    init_dir_block(sb->root_block, sb->root_block);
-  } else {
-    // calculates the size of the file system
-    struct stat buf;
-    stat(filesystem_name, &buf);
-    filesystem_size = buf.st_size;
-
-    // maps the file system and starts the global variables
-    if ((sb = (superblock *) mmap(NULL, filesystem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fsd, 0)) == MAP_FAILED) {
-      close(fsd);
-      printf("vfs: cannot map filesystem (mmap error)\n");
-      exit(1);
-    }
-    fat = (int *) ((unsigned long int) sb + sb->block_size);
-    blocks = (char *) ((unsigned long int) fat + FAT_SIZE(sb->fat_type));
-
-    // test if the file system is valid
-    if (sb->check_number != CHECK_NUMBER || filesystem_size != sb->block_size + FAT_SIZE(sb->fat_type) + FAT_ENTRIES(sb->fat_type) * sb->block_size) {
-      munmap(sb, filesystem_size);
-      close(fsd);
-      printf("vfs: invalid filesystem (%s)\n", filesystem_name);
-      show_usage_and_exit();
-    }
+// -c and -cr - checks (and repairs) the file system without opening it for the commands, and exits with 1 if
+// problems are left
+void check_filesystem(char *filesystem_name) {
+  vfs_fsck_t result;
+  int status = vfs_fsck_image(filesystem_name, check_mode == 2, n_workers, report_fsck_problem, NULL, &result);
+
+  if (status == VFS_ENOENT || status == VFS_EHOST) {
+    printf("vfs: cannot open filesystem (%s)\n", filesystem_name);
+    exit(1);
+  } else if (status != VFS_OK) {
+    printf("vfs: invalid filesystem (%s)\n", filesystem_name);
+    exit(1);
   }
-  close(fsd);
 
-  // starts the current directory
-  current_dir = sb->root_block;
-  return;
+  print_fsck_result(&result);
+  exit(result.n_errors > result.n_repaired);
 }
 
+// closes the file system, which writes the changes that are not on the disk yet (-d), and returns the exit
+// status of the shell: 1 if they couldn't be written
+int close_filesystem(void) {
+  int status = vfs_close(vfs);
 
-void init_superblock(int block_size, int fat_type) {
-  sb->check_number = CHECK_NUMBER;
-  sb->block_size = block_size;
-  sb->fat_type = fat_type;
-  sb->root_block = 0;
-  sb->free_block = 1;
-  sb->n_free_blocks = FAT_ENTRIES(fat_type) - 1;
-  return;
+  if (status != VFS_OK) {
+    printf("vfs: cannot close filesystem (%s)\n", vfs_strerror(status));
+    return 1;
+  }
+  return 0;
 }
 
+void init_filesystem(int block_size, int fat_type, char *filesystem_name) {
+  int status = vfs_open_flags(filesystem_name, &vfs, map_flags);
 
-void init_fat(void) {
-  int i;
-
-  fat[0] = -1;
-  for (i = 1; i < sb->n_free_blocks; i++)
-    fat[i] = i + 1;
-  fat[sb->n_free_blocks] = -1;
-  return;
-}
-
+  if (status == VFS_ENOENT) {
+    // the file system doesnt exist --> it needs to be created and formatted
+    printf("vfs: formatting virtual file-system (%ld bytes) ... please wait\n", vfs_image_size(block_size, fat_type));
+    if (vfs_format_flags(filesystem_name, block_size, fat_type, dir_flags) != VFS_OK) {
+      printf("vfs: cannot create filesystem (%s)\n", filesystem_name);
+      exit(1);
+    }
+    status = vfs_open_flags(filesystem_name, &vfs, map_flags);
+  }
 
-void init_dir_block(int block, int parent_block) {
-  dir_entry *dir = (dir_entry *) BLOCK(block);
-  // the number of entries in the directory (initially 2) is saved in the size field of the entry "."
-  init_dir_entry(&dir[0], TYPE_DIR, ".", 2, block);
-  init_dir_entry(&dir[1], TYPE_DIR, "..", 0, parent_block);
-  return;
-}
+  if (status == VFS_EBADFS) {
+    printf("vfs: invalid filesystem (%s)\n", filesystem_name);
+    show_usage_and_exit();
+  } else if (status != VFS_OK) {
+    printf("vfs: cannot open filesystem (%s)\n", filesystem_name);
+    exit(1);
+  }
 
+  vfs_info_t info;
+  vfs_info(vfs, &info);
+  if (info.n_rolled_back > 0)
+    printf("vfs: rolled back the operations that didn't reach the disk (%d)\n", info.n_rolled_back);
 
-void init_dir_entry(dir_entry *dir, char type, char *name, int size, int first_block) {
-  time_t cur_time = time(NULL);
-  struct tm *cur_tm = localtime(&cur_time);
+  if (journal_mode != VFS_JOURNAL_OFF && (status = vfs_journal(vfs, journal_mode)) != VFS_OK) {
+    printf("vfs: cannot create the journal (%s)\n", vfs_strerror(status));
+    close_filesystem();
+    exit(1);
+  }
 
-  dir->type = type;
-  strcpy(dir->name, name);
-  dir->day = cur_tm->tm_mday;
-  dir->month = cur_tm->tm_mon + 1;
-  dir->year = cur_tm->tm_year;
-  dir->size = size;
-  dir->first_block = first_block;
+  vfs_durability(vfs, durability, batch_ops, batch_ms);
+  if (prefetch >= 0)
+    vfs_prefetch(vfs, prefetch);
   return;
 }
 
@@ -280,787 +402,419 @@ void init_dir_entry(dir_entry *dir, char type, char *name, int size, int first_b
 void exec_com(COMMAND com) {
   // for each command invoke the function that implements it
   if (!strcmp(com.cmd, "exit")) {
-    exit(0);
+    exit(close_filesystem());
   } else if (!strcmp(com.cmd, "ls")) {
-    if (com.argc > 1)
+    char *path = NULL;
+    int offset = 0, max = -1, sorted = 1, i;
+
+    for (i = 1; i < com.argc; i++) {
+      if (!strcmp(com.argv[i], "-U"))
+        sorted = 0;
+      else if (!strcmp(com.argv[i], "-n") && i + 1 < com.argc)
+        max = atoi(com.argv[++i]);
+      else if (!strcmp(com.argv[i], "-o") && i + 1 < com.argc)
+        offset = atoi(com.argv[++i]);
+      else if (!strcmp(com.argv[i], "-n") || !strcmp(com.argv[i], "-o") || path != NULL)
+        break;
+      else
+        path = com.argv[i];
+    }
+
+    if (i < com.argc && path == NULL)
+      printf("ERROR(input: 'ls' - too few arguments)\n");
+    else if (i < com.argc)
       printf("ERROR(input: 'ls' - too many arguments)\n");
     else
-      vfs_ls();
+      print_ls(path != NULL ? path : ".", offset, max, sorted);
   } else if (!strcmp(com.cmd, "mkdir")) {
-    if (com.argc < 2)
+    // mkdir -S dir creates a sorted directory
+    int sorted = com.argc > 1 && !strcmp(com.argv[1], "-S");
+    if (com.argc < 2 + sorted)
       printf("ERROR(input: 'mkdir' - too few arguments)\n");
-    else if (com.argc > 2)
+    else if (com.argc > 2 + sorted)
       printf("ERROR(input: 'mkdir' - too many arguments)\n");
+    else if (sorted)
+      print_error("mkdir", "create directory", com.argv[2], vfs_mkdir_flags(vfs, com.argv[2], VFS_DIR_SORTED));
     else
-      vfs_mkdir(com.argv[1]);
+      print_error("mkdir", "create directory", com.argv[1], vfs_mkdir(vfs, com.argv[1]));
   } else if (!strcmp(com.cmd, "cd")) {
     if (com.argc < 2)
       printf("ERROR(input: 'cd' - too few arguments)\n");
     else if (com.argc > 2)
       printf("ERROR(input: 'cd' - too many arguments)\n");
     else
-      vfs_cd(com.argv[1]);
+      print_error("cd", "cd into", com.argv[1], vfs_cd(vfs, com.argv[1]));
   } else if (!strcmp(com.cmd, "pwd")) {
     if (com.argc != 1)
       printf("ERROR(input: 'pwd' - too many arguments)\n");
     else
-      vfs_pwd();
+      print_pwd();
   } else if (!strcmp(com.cmd, "rmdir")) {
     if (com.argc < 2)
       printf("ERROR(input: 'rmdir' - too few arguments)\n");
     else if (com.argc > 2)
       printf("ERROR(input: 'rmdir' - too many arguments)\n");
     else
-      vfs_rmdir(com.argv[1]);
+      print_error("rmdir", "remove directory", com.argv[1], vfs_rmdir(vfs, com.argv[1]));
   } else if (!strcmp(com.cmd, "get")) {
-    if (com.argc < 3)
+    // get -r copies a tree, and -z compresses the files
+    int tree = 0, flags = 0, i;
+    for (i = 1; i < com.argc && (!strcmp(com.argv[i], "-r") || !strcmp(com.argv[i], "-z")); i++) {
+      if (com.argv[i][1] == 'r')
+        tree = 1;
+      else
+        flags = VFS_FILE_COMPRESSED;
+    }
+
+    if (com.argc < i + 2)
       printf("ERROR(input: 'get' - too few arguments)\n");
-    else if (com.argc > 3)
+    else if (com.argc > i + 2)
       printf("ERROR(input: 'get' - too many arguments)\n");
-    else
-      vfs_get(com.argv[1], com.argv[2]);
+    else if (tree) {
+      // the errors inside the tree are printed as they are found
+      int n_reported = 0, status = vfs_get_tree_flags(vfs, com.argv[i], com.argv[i + 1], n_workers, flags, report_import_error, &n_reported);
+      if (n_reported == 0)
+        print_error("get", "get", com.argv[i], status);
+    } else
+      print_error_dest("get", "get", com.argv[i], com.argv[i + 1], vfs_get_flags(vfs, com.argv[i], com.argv[i + 1], flags));
   } else if (!strcmp(com.cmd, "put")) {
     if (com.argc < 3)
       printf("ERROR(input: 'put' - too few arguments)\n");
     else if (com.argc > 3)
       printf("ERROR(input: 'put' - too many arguments)\n");
     else
-      vfs_put(com.argv[1], com.argv[2]);
+      print_error("put", "put", com.argv[1], vfs_put(vfs, com.argv[1], com.argv[2]));
   } else if (!strcmp(com.cmd, "cat")) {
     if (com.argc < 2)
       printf("ERROR(input: 'cat' - too few arguments)\n");
-    else if (com.argc > 2)
+    else if (com.argc > 4)
       printf("ERROR(input: 'cat' - too many arguments)\n");
     else
-      vfs_cat(com.argv[1]);
+      print_error("cat", "cat", com.argv[1], vfs_cat(vfs, com.argv[1], com.argc > 2 ? atoi(com.argv[2]) : 0, com.argc > 3 ? atoi(com.argv[3]) : -1, 1));
   } else if (!strcmp(com.cmd, "cp")) {
     if (com.argc < 3)
       printf("ERROR(input: 'cp' - too few arguments)\n");
     else if (com.argc > 3)
       printf("ERROR(input: 'cp' - too many arguments)\n");
-    else
-      vfs_cp(com.argv[1], com.argv[2]);
+    else {
+      vfs_entry_t orig, dest;
+      if (vfs_stat(vfs, com.argv[1], &orig) == VFS_OK && orig.type == VFS_TYPE_FILE && strcmp(com.argv[1], com.argv[2]) &&
+          vfs_stat(vfs, com.argv[2], &dest) == VFS_OK && dest.type == VFS_TYPE_FILE)
+        printf("Overwriting existing file with name %s\n", com.argv[2]);
+      print_error_dest("cp", "copy", com.argv[1], com.argv[2], vfs_cp(vfs, com.argv[1], com.argv[2]));
+    }
   } else if (!strcmp(com.cmd, "mv")) {
     if (com.argc < 3)
       printf("ERROR(input: 'mv' - too few arguments)\n");
     else if (com.argc > 3)
       printf("ERROR(input: 'mv' - too many arguments)\n");
     else
-      vfs_mv(com.argv[1], com.argv[2]);
+      print_error_dest("mv", "move", com.argv[1], com.argv[2], vfs_mv(vfs, com.argv[1], com.argv[2]));
   } else if (!strcmp(com.cmd, "rm")) {
     if (com.argc < 2)
       printf("ERROR(input: 'rm' - too few arguments)\n");
     else if (com.argc > 2)
       printf("ERROR(input: 'rm' - too many arguments)\n");
     else
-      vfs_rm(com.argv[1]);
+      print_error("rm", "remove", com.argv[1], vfs_rm(vfs, com.argv[1]));
+  } else if (!strcmp(com.cmd, "defrag")) {
+    // defrag -t MS stops after MS milliseconds, and the next defrag goes on from there
+    int timed = com.argc > 1 && !strcmp(com.argv[1], "-t");
+    if (com.argc < 1 + 2 * timed)
+      printf("ERROR(input: 'defrag' - too few arguments)\n");
+    else if (com.argc > 1 + 2 * timed)
+      printf("ERROR(input: 'defrag' - too many arguments)\n");
+    else
+      print_defrag(timed ? atoi(com.argv[2]) : 0);
+  } else if (!strcmp(com.cmd, "fsck")) {
+    if (com.argc > 1)
+      printf("ERROR(input: 'fsck' - too many arguments)\n");
+    else
+      print_fsck();
+  } else if (!strcmp(com.cmd, "resize")) {
+    if (com.argc < 2)
+      printf("ERROR(input: 'resize' - too few arguments)\n");
+    else if (com.argc > 2)
+      printf("ERROR(input: 'resize' - too many arguments)\n");
+    else
+      print_resize(com.argv[1]);
   } else
     printf("ERROR(input: command not found)\n");
   return;
 }
 
-int get_free_block(){
-  if(sb->n_free_blocks == 0)
-    return -1;
-
-  int free_block = sb->free_block;
-  sb->free_block = fat[free_block];
-  fat[free_block] = -1;
 
-  sb->n_free_blocks--;
-
-  return free_block;
+// prints the error of a command (nothing if status is VFS_OK)
+void print_error(char *cmd, char *action, char *name, int status) {
+  if (status != VFS_OK)
+    printf("ERROR(%s: cannot %s '%s' - %s)\n", cmd, action, name, vfs_strerror(status));
+  return;
 }
 
-void free_block(int block){
-  fat[block] = sb->free_block;
-  sb->free_block = block;
-
-  sb->n_free_blocks++;
 
+// prints the error of a command with a source and a destination (named when its name is too long)
+void print_error_dest(char *cmd, char *action, char *orig, char *dest, int status) {
+  print_error(cmd, action, status == VFS_ENAMETOOLONG ? dest : orig, status);
   return;
 }
 
-//find a directory entry in the directory
-dir_entry* find_dir_entry(dir_entry *base_dir_entry, char* name){
-    int aux_dir = base_dir_entry->first_block;
-
-    unsigned int aux_counter = 0;
-    unsigned int n_of_dir_entries = DIR_ENTRIES_PER_BLOCK;
-
-    while(aux_dir != -1){
-        dir_entry *aux_dir_entry = (dir_entry *)BLOCK(aux_dir);
-        
-        for(short unsigned int i=0; i<n_of_dir_entries && aux_counter<base_dir_entry->size; i++, aux_counter++){
-            if(!strcmp(aux_dir_entry->name, name))
-                return aux_dir_entry;
-
-            aux_dir_entry++;
-        }
-
-        aux_dir = fat[aux_dir];
-    }
 
-    return NULL;
-}
-
-int cstr_cmp(const void *a, const void *b) {
-  const char **ia = (const char **)a;
-  const char **ib = (const char **)b;
-  return strcmp(*ia, *ib);
+// prints the entries of the tree of get -r that are not imported
+void report_import_error(const char *path, int status, void *arg) {
+  (*(int *) arg)++;
+  printf("ERROR(get: cannot get '%s' - %s)\n", path, vfs_strerror(status));
+  return;
 }
 
-const char* getMonthName(unsigned int month){
-   switch (month){
-      case 1: return "Jan";
-      case 2: return "Feb";
-      case 3: return "Mar";
-      case 4: return "Apr";
-      case 5: return "May";
-      case 6: return "Jun";
-      case 7: return "Jul";
-      case 8: return "Aug";
-      case 9: return "Sep";
-      case 10: return "Oct";
-      case 11: return "Nov";
-      case 12: return "Dec";
-      default: return "Undefined";
-   }
 
-   return "Undefined";
+// prints a problem found by fsck, as it is found (the path is empty for the ones of the image itself)
+void report_fsck_problem(const char *path, const char *problem, int repaired, void *arg) {
+  printf("fsck: %s%s%s%s\n", path, path[0] != '\0' ? " - " : "", problem, repaired ? " (repaired)" : "");
+  return;
 }
 
-// ls - list the contents of the current directory
-void vfs_ls(void) {
-  dir_entry *dir = (dir_entry *)BLOCK(current_dir);
-  int n_entries = dir[0].size;
-
-  char type_str[128];
-  char **content = (char **)malloc(n_entries * sizeof(char *));
-  for(int i = 0; i < n_entries; i++)
-    content[i] = (char * )malloc(1024 * sizeof(char *));
-  
-
-  int cur_block = current_dir;
-  for(int i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      cur_block = fat[cur_block];
-      dir = (dir_entry *)BLOCK(cur_block);
-    }
-
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-
-    if(dir[block_i].type == TYPE_DIR)
-      sprintf(type_str, "DIR");
-    else if(dir[block_i].type == TYPE_FILE)
-      sprintf(type_str, "%d", dir[block_i].size);
-    else {
-      printf("ERROR(filesystem: file type not recognized)\n");
-      for(int j = 0; j < n_entries; j++)
-        free(content[j]);
-      free(content);
-      return;
-    }
-    
-    sprintf(content[i], "%*s\t%02d-%s-%04d\t%s", -MAX_NAME_LENGHT, dir[block_i].name, dir[block_i].day, getMonthName(dir[block_i].month), 1900 + dir[block_i].year, type_str);
-  }
-
-  qsort(content, n_entries, sizeof(char *), cstr_cmp);
-
-  for(int i = 0; i < n_entries; i++)
-    printf("%s\n", content[i]);
-
-  for(int i = 0; i < n_entries; i++)
-    free(content[i]);
-  free(content);
 
+void print_fsck_result(vfs_fsck_t *result) {
+  printf("fsck: %d directories, %ld files, %ld blocks in use, %d errors", result->n_dirs, result->n_files,
+         result->n_used_blocks, result->n_errors);
+  if (result->n_repaired > 0)
+    printf(", %d repaired", result->n_repaired);
+  printf("\n");
   return;
 }
 
 
-// mkdir dir - creates a subdirectory named dir in the current directory
-void vfs_mkdir(char *nome_dir) {
-  if(strlen(nome_dir) > MAX_NAME_LENGHT) {
-    printf("ERROR(mkdir: cannot create directory '%s' - name too long (MAX: %d characters))\n", nome_dir, MAX_NAME_LENGHT);
-    return;
-  }
-
-  dir_entry *dir = (dir_entry *)BLOCK(current_dir);
-  int n_entries = dir[0].size;
-
-  if((n_entries % DIR_ENTRIES_PER_BLOCK == 0) + 1 > sb->n_free_blocks) {
-    printf("ERROR(mkdir: cannot create directory '%s' - disk is full)\n", nome_dir);
-    return;
-  }
-
-  if(find_dir_entry(dir, nome_dir) != NULL) {
-    printf("ERROR(mkdir: cannot create directory '%s' - entry exists)\n", nome_dir);
-    return;
-  }
-
-  dir[0].size++;
-
-  int new_block = get_free_block();
-  init_dir_block(new_block, current_dir);
-
-  int cur_block = current_dir;
-  while(fat[cur_block] != -1)
-    cur_block = fat[cur_block];
-
-  if(n_entries % DIR_ENTRIES_PER_BLOCK == 0) {
-    int next_block = get_free_block();
-    fat[cur_block] = next_block;
-    cur_block = next_block;
-  }
-
-  dir = (dir_entry *)BLOCK(cur_block);
-  
-  init_dir_entry(&dir[n_entries % DIR_ENTRIES_PER_BLOCK], TYPE_DIR, nome_dir, 0, new_block);
+// ls [-U] [-n N] [-o OFFSET] [dir] - list the contents of the directory dir (the current directory by default)
+// sorted by name, or in the order of the directory with -U, skipping the first OFFSET entries and listing at most N
+// (a sorted directory is already read in name order, and is listed as it is read)
+void print_ls(char *path, int offset, int max, int sorted) {
+  vfs_entry_t dir;
 
+  if (sorted && !(vfs_stat(vfs, path, &dir) == VFS_OK && dir.type == VFS_TYPE_DIR && (dir.flags & VFS_DIR_SORTED)))
+    ls_sorted(path, offset, max);
+  else
+    ls_unsorted(path, offset, max);
   return;
 }
 
 
-// cd dir - move current directory to dir
-void vfs_cd(char *nome_dir) {
-  dir_entry *aux_dir_entry = find_dir_entry((dir_entry *)BLOCK(current_dir), nome_dir);
+// lists the entries a page at a time, as they are read
+void ls_unsorted(char *path, int offset, int max) {
+  vfs_entry_t page[LS_PAGE];
+  int n, n_listed = 0, want, status;
 
-  if(aux_dir_entry == NULL){
-    printf("ERROR(cd: cannot cd into '%s' - entry doesn't exist)\n", nome_dir);
-    return;
-  }
+  do {
+    want = max < 0 || max - n_listed > LS_PAGE ? LS_PAGE : max - n_listed;
+    status = vfs_list(vfs, path, offset + n_listed, page, want, &n);
 
-  current_dir = aux_dir_entry->first_block;
+    for (int i = 0; i < n; i++)
+      if (print_entry(&page[i]) == -1)
+        return;
+    n_listed += n;
+  } while (status == VFS_OK && n == want && want > 0);
 
+  if (status != VFS_OK && n_listed == 0)
+    print_error("ls", "list", path, status);
   return;
 }
 
 
-// pwd - writes the absolute path of the current directory
-void vfs_pwd(void) {
-  char name[1024], tmp[1024];
-
-  name[0] = '/';
-  name[1] = '\0';
-
-  int tmp_dir = current_dir;
-
-  while(tmp_dir != 0) {
-    dir_entry *dir = (dir_entry *)BLOCK(tmp_dir);
-    
-    int prev_dir = dir[1].first_block;
-    dir = (dir_entry *)BLOCK(prev_dir);
-    
-    int n_entries = dir[0].size;
-
-    int cur_block = prev_dir;
-    for(int i = 0; i < n_entries; i++) {
-      if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-        cur_block = fat[cur_block];
-        dir = (dir_entry *)BLOCK(cur_block);
-      }
-
-      int block_i = i % DIR_ENTRIES_PER_BLOCK;
+// lists the entries sorted by name
+// only the offset + max smallest names read so far are kept, in an arena with a max-heap of keys over
+// it once it is full, so the memory used is proportional to what is listed and not to the directory
+void ls_sorted(char *path, int offset, int max) {
+  int limit = max < 0 || max > __INT_MAX__ - offset ? __INT_MAX__ : offset + max;
+  int n, n_read = 0, n_kept = 0, size = limit < LS_PAGE ? limit : LS_PAGE, status;
+  vfs_entry_t page[LS_PAGE];
+  vfs_entry_t *arena = (vfs_entry_t *) malloc((size > 0 ? size : 1) * sizeof(vfs_entry_t));
+  ls_key *keys = NULL;
+
+  while ((status = vfs_list(vfs, path, n_read, page, LS_PAGE, &n)) == VFS_OK) {
+    for (int i = 0; i < n; i++) {
+      if (n_kept < limit) {
+        if (n_kept == size) {
+          size = size > limit / 2 ? limit : size * 2;
+          arena = (vfs_entry_t *) realloc(arena, size * sizeof(vfs_entry_t));
+        }
+        arena[n_kept++] = page[i];
 
-      if(dir[block_i].first_block == tmp_dir) {
-        strcpy(tmp, dir[block_i].name);
-        strcat(tmp, name);
-        strcpy(name, tmp);
-        strcpy(tmp, "/");
-        strcat(tmp, name);
-        strcpy(name, tmp);
-        break;
+        if (n_kept == limit) {
+          keys = ls_keys(arena, n_kept);
+          for (int j = n_kept / 2 - 1; j >= 0; j--)
+            ls_sift_down(keys, n_kept, j);
+        }
+      } else if (limit > 0 && strcmp(page[i].name, keys[0].name) < 0) {
+        // replaces the largest name kept
+        arena[keys[0].index] = page[i];
+        ls_sift_down(keys, n_kept, 0);
       }
     }
 
-    tmp_dir = prev_dir;
+    n_read += n;
+    if (n < LS_PAGE)
+      break;
   }
 
-  printf("%s\n", name);
-
-  return;
-}
-
-
-// rmdir dir - removes the dir subdirectory (if empty) from the current directory
-void vfs_rmdir(char *nome_dir) {
-  dir_entry *dir = (dir_entry *)BLOCK(current_dir);
-  int n_entries = dir[0].size;
-
-  int cur_block = current_dir;
-  int before_last_block = cur_block;
-  for(int i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      before_last_block = cur_block;
-      cur_block = fat[cur_block];
-      dir = (dir_entry *)BLOCK(cur_block);
-    }
-
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-
-    if(!strcmp(dir[block_i].name, nome_dir)) {
-      if(dir[block_i].type != TYPE_DIR) {
-        printf("ERROR(rmdir: cannot remove directory '%s' - entry not a directory)\n", nome_dir);
-        return;
-      }
-
-      dir_entry *del_dir = (dir_entry *)BLOCK(dir[block_i].first_block);
-
-      if(del_dir[0].size != 2) {
-        printf("ERROR(rmdir: cannot remove directory '%s' - entry not empty)\n", nome_dir);
-        return;
-      }
-
-      int last_block = cur_block;
-      while(fat[last_block] != -1)
-        last_block = fat[last_block];
-
-      dir_entry *last_dir_block = (dir_entry *)BLOCK(last_block);
-      dir_entry last_dir = last_dir_block[(n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK];
-
-      if((n_entries - 1) % DIR_ENTRIES_PER_BLOCK == 0) {
-        free_block(last_block);
-        fat[before_last_block] = -1;
-      }
-      
-      free_block(dir[block_i].first_block);
-
-      dir[block_i].type = last_dir.type;
-      strcpy(dir[block_i].name, last_dir.name);
-      dir[block_i].day = last_dir.day;
-      dir[block_i].month = last_dir.month;
-      dir[block_i].year = last_dir.year;
-      dir[block_i].size = last_dir.size;
-      dir[block_i].first_block = last_dir.first_block;
-
-      dir = (dir_entry *)BLOCK(current_dir);
-      dir[0].size--;
-
-      return;
-    }
+  if (status == VFS_OK && (offset < 0 || offset > n_read))
+    print_error("ls", "list", path, VFS_ERANGE);
+  else if (status != VFS_OK && n_read == 0)
+    print_error("ls", "list", path, status);
+  else {
+    if (keys == NULL)
+      keys = ls_keys(arena, n_kept);
+    qsort(keys, n_kept, sizeof(ls_key), key_cmp);
+
+    for (int i = offset; i < n_kept; i++)
+      if (print_entry(&arena[keys[i].index]) == -1)
+        break;
   }
 
-  printf("ERROR(rmdir: cannot remove directory '%s' - entry doesn't exist)\n", nome_dir);
-
+  free(keys);
+  free(arena);
   return;
 }
 
 
-// get file1 file2 - copies a standard UNIX file file1 to a file in our system file2
-void vfs_get(char *nome_orig, char *nome_dest) {
-  dir_entry *dir = (dir_entry *)BLOCK(current_dir);
-  int n_entries = dir[0].size;
-
-  if(find_dir_entry((dir_entry *)BLOCK(current_dir), nome_dest) != NULL) {
-    printf("ERROR(get: cannot get '%s' - destination file already exists)\n", nome_dest);
-    return;
-  }
-
-  struct stat statbuf;
-  if(stat(nome_orig, &statbuf) == -1) {
-    printf("ERROR(get: cannot get '%s' - input file not found)\n", nome_orig);
-    return;
-  }
-
-  if((statbuf.st_mode & S_IFMT) != S_IFREG) {
-    printf("ERROR(get: cannot get '%s' - file is not a regular file)\n", nome_orig);
-    return;
-  }
-  
-  int req_size = (int)statbuf.st_size;
-  int req_blocks = (n_entries % DIR_ENTRIES_PER_BLOCK == 0) + (req_size + sb->block_size - 1) / sb->block_size;
+// prints an entry of ls (-1 if its type is not recognized)
+int print_entry(vfs_entry_t *entry) {
+  char type_str[16];
 
-  if(sb->n_free_blocks < req_blocks) {
-    printf("ERROR(get: cannot get '%s' - disk space is full)\n", nome_orig);
-    return;
+  if (entry->type == VFS_TYPE_DIR)
+    sprintf(type_str, "DIR");
+  else if (entry->type == VFS_TYPE_FILE)
+    sprintf(type_str, "%d", entry->size);
+  else {
+    printf("ERROR(filesystem: file type not recognized)\n");
+    return -1;
   }
 
-  req_blocks -= (n_entries % DIR_ENTRIES_PER_BLOCK == 0);
-
-  dir[0].size++;
-
-  int first_block = get_free_block();
-  int new_block, next_block = first_block;
-  int f_input = open(nome_orig, O_RDONLY), count_block = 1, n;
-  char msg[4096];
-
-  while((n = read(f_input, msg, sb->block_size)) > 0) {
-    if(count_block != req_blocks) {
-      count_block++;
-      new_block = get_free_block();
-      fat[next_block] = new_block;
-    }
-
-    strcpy(BLOCK(next_block), msg);
+  printf("%*s\t%02d-%s-%04d\t%s\n", -VFS_MAX_NAME, entry->name, entry->day, getMonthName(entry->month), entry->year, type_str);
+  return 0;
+}
 
-    next_block = new_block;
-  }
 
-  int cur_block = current_dir;
-  while(fat[cur_block] != -1)
-    cur_block = fat[cur_block];
+// sort keys of the first n entries of the arena
+ls_key *ls_keys(vfs_entry_t *arena, int n) {
+  ls_key *keys = (ls_key *) malloc((n > 0 ? n : 1) * sizeof(ls_key));
 
-  if(n_entries % DIR_ENTRIES_PER_BLOCK == 0) {
-    int next_block = get_free_block();
-    fat[cur_block] = next_block;
-    cur_block = next_block;
+  for (int i = 0; i < n; i++) {
+    keys[i].name = arena[i].name;
+    keys[i].index = i;
   }
-
-  dir = (dir_entry *)BLOCK(cur_block);
-  init_dir_entry(&dir[n_entries % DIR_ENTRIES_PER_BLOCK], TYPE_FILE, nome_dest, req_size, first_block);
-
-  close(f_input);
-  
-  return;
+  return keys;
 }
 
 
-// put file1 file2 - copy a file from our system file1 to a normal UNIX file file2
-void vfs_put(char *nome_orig, char *nome_dest) {
-  dir_entry *dir = (dir_entry *)BLOCK(current_dir);
-  int n_entries = dir[0].size;
-
-  int cur_block = current_dir;
-  for(int i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      cur_block = fat[cur_block];
-      dir = (dir_entry *)BLOCK(cur_block);
-    }
-
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if(strcmp(dir[block_i].name, nome_orig) == 0) {
-      if(dir[block_i].type != TYPE_FILE) {
-        printf("ERROR(put: cannot put '%s' - entry not a file)\n", nome_orig);
-        return;
-      }
-
-      int f_output = open(nome_dest, O_CREAT|O_TRUNC|O_WRONLY, 0644);
-      int cur = dir[block_i].first_block, size = dir[block_i].size;
-
-      write(f_output, BLOCK(cur), sb->block_size);
-      size -= sb->block_size;
-      while(fat[cur] != -1) {
-        cur = fat[cur];
-        if(size >= sb->block_size)
-          write(f_output, BLOCK(cur), sb->block_size);
-        else
-          write(f_output, BLOCK(cur), size);
-
-        size -= sb->block_size;
-      }
-
-      close(f_output);
+// moves the key at position i of the max-heap down to its place
+void ls_sift_down(ls_key *keys, int n, int i) {
+  while (2 * i + 1 < n) {
+    int child = 2 * i + 1;
+    if (child + 1 < n && strcmp(keys[child + 1].name, keys[child].name) > 0)
+      child++;
+    if (strcmp(keys[i].name, keys[child].name) >= 0)
+      break;
 
-      return;
-    }
+    ls_key tmp = keys[i];
+    keys[i] = keys[child];
+    keys[child] = tmp;
+    i = child;
   }
-
-  printf("ERROR(put: cannot put '%s' - file not found)\n", nome_orig);
-
   return;
 }
 
 
-// cat file - writes the contents of the file file to the screen
-void vfs_cat(char *nome_fich) {
-  dir_entry *dir = (dir_entry *)BLOCK(current_dir);
-  int n_entries = dir[0].size;
-
-  int cur_block = current_dir;
-  for(int i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      cur_block = fat[cur_block];
-      dir = (dir_entry *)BLOCK(cur_block);
-    }
-
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if(strcmp(dir[block_i].name, nome_fich) == 0) {
-      if(dir[block_i].type != TYPE_FILE) {
-        printf("ERROR(cat: cannot cat '%s' - entry not a file)\n", nome_fich);
-        return;
-      }
-
-      int next_block = dir[block_i].first_block;
-      write(1, BLOCK(next_block), sb->block_size);
-
-      while(fat[next_block] != -1) {
-        next_block = fat[next_block];
-
-        int write_size = sb->block_size;
-        if(fat[next_block] == -1)
-          write_size = dir[block_i].size % sb->block_size;
-  
-        write(1, BLOCK(next_block), write_size);
-      }
+// pwd - writes the absolute path of the current directory
+void print_pwd(void) {
+  size_t size = 256;
+  char *path = (char *) malloc(size);
 
-      return;
-    }
-  }
+  while (vfs_pwd(vfs, path, size) == VFS_ERANGE)
+    path = (char *) realloc(path, size *= 2);
 
-  printf("ERROR(cat: cannot cat '%s' - entry not found)\n", nome_fich);
+  printf("%s\n", path);
 
+  free(path);
   return;
 }
 
 
-// cp file1 file2 - copy the file file1 to file2
-// cp file dir - copy the file file to the dir subdirectory
-void vfs_cp(char *nome_orig, char *nome_dest) {
-  dir_entry *dir = (dir_entry *)BLOCK(current_dir);
-  int n_entries = dir[0].size, input_block = -1, exp_dir = current_dir;
+// defrag - lays out the files and directories contiguously, and writes the fragmentation before and after
+void print_defrag(int max_ms) {
+  vfs_defrag_t result;
+  int status = vfs_defrag(vfs, max_ms, &result);
 
-  int block_i;
-  int cur_block = current_dir;
-  for(int i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      cur_block = fat[cur_block];
-      dir = (dir_entry *)BLOCK(cur_block);
-    }
-
-    block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if(strcmp(dir[block_i].name, nome_orig) == 0) {
-      input_block = dir[block_i].first_block;
-      break;
-    }
-  }
-
-  if(input_block == -1) {
-    printf("ERROR(cp: cannot copy '%s' - file not found)\n", nome_orig);
+  if (status != VFS_OK) {
+    printf("ERROR(defrag: cannot defrag '-t %d' - %s)\n", max_ms, vfs_strerror(status));
     return;
   }
 
-  int req_size = dir[block_i].size;
-
-  dir = (dir_entry *)BLOCK(current_dir);
-  cur_block = current_dir;
-  for(int i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      cur_block = fat[cur_block];
-      dir = (dir_entry *)BLOCK(cur_block);
-    }
-
-    block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if(strcmp(dir[block_i].name, nome_dest) == 0) {
-      if(dir[block_i].type == TYPE_DIR) {
-        exp_dir = dir[block_i].first_block;
-        strcpy(nome_dest, nome_orig);
-      }
-      else{
-        printf("Overwriting existing file with name %s\n", nome_dest);
-        vfs_rm(nome_dest);
-      }
+  printf("fragmentation: %.2f%% -> %.2f%% (%d chains, %ld blocks moved)\n", result.score_before, result.score_after,
+         result.n_moved, result.n_blocks_moved);
+  if (!result.done)
+    printf("stopped after %d ms, run defrag again to go on\n", max_ms);
+  return;
+}
 
-      break;
-    }
-  }
 
-  dir_entry *cur_dir = (dir_entry *)BLOCK(exp_dir);
-  n_entries = cur_dir[0].size;
-  int req_blocks = (n_entries % DIR_ENTRIES_PER_BLOCK == 0) + (req_size + sb->block_size - 1) / sb->block_size;
+// fsck - checks the file system (the commands that change it wait until it ends), and writes the problems found
+void print_fsck(void) {
+  vfs_fsck_t result;
+  int status = vfs_fsck(vfs, n_workers, report_fsck_problem, NULL, &result);
 
-  if(sb->n_free_blocks < req_blocks) {
-    printf("ERROR(cp: cannot copy '%s' - disk space is full)\n", nome_orig);
+  if (status != VFS_OK) {
+    printf("ERROR(fsck: cannot check '/' - %s)\n", vfs_strerror(status));
     return;
   }
 
-  req_blocks -= (n_entries % DIR_ENTRIES_PER_BLOCK == 0);
-
-  cur_dir[0].size++;
-
-  int first_block = get_free_block();
-  int new_block, next_block = first_block;
-  int count_block = 1, cur = input_block;
-
-  int tmp_req_size = req_size;
-  if(tmp_req_size >= sb->block_size)
-    strncpy(BLOCK(next_block), BLOCK(cur), sb->block_size);
-  else
-    strncpy(BLOCK(next_block), BLOCK(cur), tmp_req_size);
-  while(fat[cur] != -1) {
-    tmp_req_size -= sb->block_size;
-    if(count_block != req_blocks) {
-      count_block++;
-      new_block = get_free_block();
-      fat[next_block] = new_block;
-    }
-
-    cur = fat[cur];
-    next_block = new_block;
-
-    if(tmp_req_size >= sb->block_size)
-      strncpy(BLOCK(next_block), BLOCK(cur), sb->block_size);
-    else
-      strncpy(BLOCK(next_block), BLOCK(cur), tmp_req_size);
-  }
-
-  cur_block = exp_dir;
-  while(fat[cur_block] != -1)
-    cur_block = fat[cur_block];
-
-  if(n_entries % DIR_ENTRIES_PER_BLOCK == 0) {
-    int next_block = get_free_block();
-    fat[cur_block] = next_block;
-    cur_block = next_block;
-  }
-
-  dir = (dir_entry *)BLOCK(cur_block);
-  init_dir_entry(&dir[n_entries % DIR_ENTRIES_PER_BLOCK], TYPE_FILE, nome_dest, req_size, first_block);
-
+  print_fsck_result(&result);
   return;
 }
 
 
-// mv file1 file2 - move file from file1 to file2
-// mv file dir - move the file file to the dir dir
-void vfs_mv(char *nome_orig, char *nome_dest) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i, inp_block = -1, exp_dir = current_dir, req_size = -1;
+// resize BLOCKS - sets the number of blocks of the file system (it can only shrink if the blocks after the new end
+// are free), and writes the number of blocks before and after
+void print_resize(char *blocks) {
+  vfs_info_t before, after;
+  char *end;
+  long n_blocks = strtol(blocks, &end, 10);
+  int status = *end != '\0' || n_blocks <= 0 || n_blocks > (1L << VFS_MAX_FAT_TYPE) ? VFS_EINVAL : VFS_OK;
 
-  int block_i;
-  int cur_block = current_dir;
-  for(i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
-
-    block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if(strcmp(dir[block_i].name, nome_orig) == 0) {
-      int last_block = cur_block;
-      
-      while(fat[last_block] != -1)
-        last_block = fat[last_block];
-
-      dir_entry *last_dir_block = (dir_entry *)BLOCK(last_block);
-      dir_entry last_dir = last_dir_block[(n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK];
-
-      if((n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK == 0)
-        free_block(last_block);
-
-      req_size = dir[block_i].size;
-
-      dir[block_i].type = last_dir.type;
-      strcpy(dir[block_i].name, last_dir.name);
-      dir[block_i].day = last_dir.day;
-      dir[block_i].month = last_dir.month;
-      dir[block_i].year = last_dir.year;
-      dir[block_i].size = last_dir.size;
-      dir[block_i].first_block = last_dir.first_block;
-
-      dir = (dir_entry *)BLOCK(current_dir);
-      dir[0].size--;
-      
-      inp_block = dir[block_i].first_block;
-      break;
-    }
-  }
-
-  if(inp_block == -1) {
-    printf("ERROR(mv: cannot move '%s' - file not found)\n", nome_orig);
+  vfs_info(vfs, &before);
+  if (status != VFS_OK || (status = vfs_resize(vfs, n_blocks)) != VFS_OK) {
+    printf("ERROR(resize: cannot resize '%s' - %s)\n", blocks, vfs_strerror(status));
     return;
   }
 
-  dir = (dir_entry *)BLOCK(current_dir);
-  cur_block = current_dir;
-  for(i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      cur_block = fat[cur_block];
-      dir = (dir_entry *)BLOCK(cur_block);
-    }
-
-    block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if(strcmp(dir[block_i].name, nome_dest) == 0) {
-      if(dir[block_i].type == TYPE_DIR) {
-        exp_dir = dir[block_i].first_block;
-        strcpy(nome_dest, nome_orig);
-      }
-      else
-        vfs_rm(nome_dest);
-
-      break;
-    }
-  }
-
-  dir_entry *cur_dir = (dir_entry *)BLOCK(exp_dir);
-  n_entries = cur_dir[0].size;
-  cur_dir[0].size++;
-
-  cur_block = exp_dir;
-  while(fat[cur_block] != -1)
-    cur_block = fat[cur_block];
-
-  if(n_entries % DIR_ENTRIES_PER_BLOCK == 0) {
-    int next_block = get_free_block();
-    fat[cur_block] = next_block;
-    cur_block = next_block;
-  }
-
-  dir = (dir_entry *)BLOCK(cur_block);
-  init_dir_entry(&dir[n_entries % DIR_ENTRIES_PER_BLOCK], TYPE_FILE, nome_dest, req_size, inp_block);
-
+  vfs_info(vfs, &after);
+  printf("resize: %d -> %d blocks (%d free, %ld bytes)\n", before.n_blocks, after.n_blocks, after.n_free_blocks,
+         (long)after.n_blocks * after.block_size);
   return;
 }
 
 
-// rm file - removes the file file
-void vfs_rm(char *nome_fich) {
-  dir_entry *dir = (dir_entry *)BLOCK(current_dir);
-  int n_entries = dir[0].size, i;
-
-  int cur_block = current_dir;
-  for(i = 0; i < n_entries; i++) {
-    if(i % DIR_ENTRIES_PER_BLOCK == 0 && i) {
-      cur_block = fat[cur_block];
-      dir = (dir_entry *)BLOCK(cur_block);
-    }
-
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if(dir[block_i].type == TYPE_FILE && strcmp(dir[block_i].name, nome_fich) == 0) {
-      int next_block = dir[block_i].first_block, count = 1;
-
-      while(fat[next_block] != -1) {
-        next_block = fat[next_block];
-        count++;
-      }
-
-      sb->n_free_blocks += count;
-      fat[next_block] = sb->free_block;
-      sb->free_block = dir[block_i].first_block;
-
-      int last_block = cur_block;
-
-      while(fat[last_block] != -1)
-        last_block = fat[last_block];
-      
-      dir_entry *last_dir_block = (dir_entry *)BLOCK(last_block);
-      dir_entry last_dir = last_dir_block[(n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK];
-
-      if((n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK == 0)
-        free_block(last_block);
-
-      dir[block_i].type = last_dir.type;
-      strcpy(dir[block_i].name, last_dir.name);
-      dir[block_i].day = last_dir.day;
-      dir[block_i].month = last_dir.month;
-      dir[block_i].year = last_dir.year;
-      dir[block_i].size = last_dir.size;
-      dir[block_i].first_block = last_dir.first_block;
+int key_cmp(const void *a, const void *b) {
+  const ls_key *ka = (const ls_key *)a;
+  const ls_key *kb = (const ls_key *)b;
+  return strcmp(ka->name, kb->name);
+}
 
-      dir = (dir_entry *)BLOCK(current_dir);
-      dir[0].size--;
 
-      return;
-    }
-  }
+const char *getMonthName(unsigned int month){
+   switch (month){
+      case 1: return "Jan";
+      case 2: return "Feb";
+      case 3: return "Mar";
+      case 4: return "Apr";
+      case 5: return "May";
+      case 6: return "Jun";
+      case 7: return "Jul";
+      case 8: return "Aug";
+      case 9: return "Sep";
+      case 10: return "Oct";
+      case 11: return "Nov";
+      case 12: return "Dec";
+      default: return "Undefined";
+   }
 
-  printf("ERROR(rm: cannot remove '%s' - file not found)\n", nome_fich);
-  
-  return;
+   return "Undefined";
 }
@@ -0,0 +1,160 @@
+///////////////////////////////////////////////////////////////////
+//                                                               //
+//                 libvfs: FAT File System Library               //
+//                                                               //
+// Every function returns VFS_OK or one of the status codes      //
+// below. A handle (vfs_t) has its own current directory, and    //
+// several handles (vfs_dup) can share an image among threads,   //
+// a handle being used by one thread at a time.                  //
+//                                                               //
+///////////////////////////////////////////////////////////////////
+
+#ifndef VFS_H
+#define VFS_H
+
+#include <stddef.h>
+
+#define VFS_MAX_NAME 20     // maximum length of an entry name
+#define VFS_TYPE_DIR 'D'
+#define VFS_TYPE_FILE 'F'
+#define VFS_MIN_FAT_TYPE 7  // FAT types of a new image: the FAT has 2^type entries
+#define VFS_MAX_FAT_TYPE 28
+#define VFS_DIR_SORTED 1    // directory kept sorted by name (vfs_format_flags, vfs_mkdir_flags)
+#define VFS_FILE_SPARSE 2   // file whose blocks of zeros are holes, that take no space (see vfs_get)
+#define VFS_FILE_COMPRESSED 4  // file stored compressed (vfs_get_flags, vfs_get_tree_flags)
+#define VFS_MAP_POPULATE 1  // read the whole image into memory when it is opened (vfs_open_flags)
+#define VFS_MAP_HUGE 2      // back the mapping of the image with huge pages, where the kernel can (vfs_open_flags)
+
+// journal modes (vfs_journal): the operations that change the image are rolled back on open
+// if they didn't reach the disk, which happens at the end of each one (VFS_JOURNAL_OP), or
+// once for the ones that end together (VFS_JOURNAL_GROUP)
+#define VFS_JOURNAL_OFF 0
+#define VFS_JOURNAL_OP 1
+#define VFS_JOURNAL_GROUP 2
+
+// durability modes (vfs_durability): the changes reach the disk when the kernel writes them
+// back (VFS_DURABILITY_NONE), every few operations or milliseconds, from a background thread
+// (VFS_DURABILITY_BATCH), or at the end of each operation that changes the image, which
+// writes the pages it changed (VFS_DURABILITY_SYNC)
+#define VFS_DURABILITY_NONE 0
+#define VFS_DURABILITY_BATCH 1
+#define VFS_DURABILITY_SYNC 2
+
+// status codes
+enum vfs_status {
+  VFS_OK = 0,
+  VFS_ENOENT,        // entry doesn't exist
+  VFS_EEXIST,        // entry exists
+  VFS_ENOTDIR,       // entry not a directory
+  VFS_EISDIR,        // entry not a file
+  VFS_ENOTEMPTY,     // directory not empty
+  VFS_ENAMETOOLONG,  // name longer than VFS_MAX_NAME characters
+  VFS_ENOSPC,        // disk space is full
+  VFS_EINVAL,        // invalid argument ('.' or '..', a directory moved into itself, ...)
+  VFS_ESAME,         // source and destination are the same file
+  VFS_ERANGE,        // offset out of range, or buffer too small
+  VFS_EFBIG,         // host file too large
+  VFS_ENOTREG,       // host file not a regular file
+  VFS_EHOST,         // host file cannot be accessed (errno has the reason)
+  VFS_EBADFS,        // not a valid file system image
+  VFS_EBUSY          // blocks in use after the new end of the image (vfs_resize)
+};
+
+typedef struct vfs vfs_t;
+
+typedef struct vfs_entry {
+  char name[VFS_MAX_NAME + 1];  // entry name
+  char type;                    // VFS_TYPE_DIR or VFS_TYPE_FILE
+  int size;                     // size in bytes (0 for directories)
+  int day;                      // creation date
+  int month;
+  int year;
+  int flags;                    // VFS_DIR_SORTED for a sorted directory, VFS_FILE_SPARSE or VFS_FILE_COMPRESSED for a file
+} vfs_entry_t;
+
+typedef struct vfs_info {
+  int block_size;      // block size in bytes
+  int fat_type;        // the FAT has 2^fat_type entries
+  int n_blocks;        // number of data blocks
+  int n_free_blocks;   // number of free data blocks
+  long n_write_calls;  // system calls used to write file data (vfs_cat and vfs_put)
+  int journal_mode;    // VFS_JOURNAL_OFF, VFS_JOURNAL_OP or VFS_JOURNAL_GROUP
+  long n_commits;      // operations committed to the journal since the image was opened
+  int n_rolled_back;   // operations rolled back when the image was opened
+  int n_journal_overflows;  // operations that failed, without changing anything, because the journal had no room
+  int durability;      // VFS_DURABILITY_NONE, VFS_DURABILITY_BATCH or VFS_DURABILITY_SYNC
+  long n_flushes;      // flushes of the changes to the disk (journal and durability modes)
+  long flush_us;       // time spent in them, in microseconds
+  long max_flush_us;   // longest flush
+  int prefetch_blocks; // blocks of a file read ahead of the ones being read (0 for none)
+  long n_prefetches;   // requests to read blocks ahead (vfs_read, vfs_cat, vfs_put and vfs_cp)
+  long compress_in;    // bytes of the files imported with VFS_FILE_COMPRESSED since the image was opened
+  long compress_out;   // bytes of the blocks they take (the ones that compression doesn't make smaller aren't compressed)
+  long compress_us;    // time spent compressing them
+  long decompress_bytes;  // bytes of compressed files decompressed (vfs_read, vfs_cat and vfs_put)
+  long decompress_us;     // time spent decompressing them
+} vfs_info_t;
+
+typedef struct vfs_defrag {
+  double score_before;  // fragmentation before and after: percentage of the links between the blocks
+  double score_after;   // of the chains that don't go to the next block (0 if every chain is contiguous)
+  int n_moved;          // chains moved (a chain in the way of another one is moved twice)
+  long n_blocks_moved;  // blocks copied
+  int done;             // 0 if it was stopped by the time limit (run it again to continue)
+} vfs_defrag_t;
+
+typedef struct vfs_fsck {
+  int n_dirs;            // directories reached from the root
+  long n_files;          // file entries reached from the root (each copy made by vfs_cp counts)
+  long n_used_blocks;    // blocks of the tree, of the table of shared chains and of the journal
+  long n_leaked_blocks;  // blocks in use that none of them reaches (freed by a repair)
+  int n_errors;          // problems found
+  int n_repaired;        // problems repaired (vfs_fsck_image with repair)
+} vfs_fsck_t;
+
+// called by vfs_get_tree for each host entry that is not imported
+typedef void (*vfs_error_fn)(const char *path, int status, void *arg);
+
+// called by vfs_fsck and vfs_fsck_image for each problem found (path is "" for the image itself)
+typedef void (*vfs_fsck_fn)(const char *path, const char *problem, int repaired, void *arg);
+
+// images and handles
+long vfs_image_size(int block_size, int fat_type);
+int vfs_format(const char *path, int block_size, int fat_type);
+int vfs_format_flags(const char *path, int block_size, int fat_type, int flags);
+int vfs_open(const char *path, vfs_t **vfs);
+int vfs_open_flags(const char *path, vfs_t **vfs, int flags);
+int vfs_dup(vfs_t *vfs, vfs_t **copy);
+int vfs_close(vfs_t *vfs);
+int vfs_info(vfs_t *vfs, vfs_info_t *info);
+int vfs_journal(vfs_t *vfs, int mode);
+int vfs_durability(vfs_t *vfs, int mode, int batch_ops, int batch_ms);
+int vfs_prefetch(vfs_t *vfs, int n_blocks);
+int vfs_defrag(vfs_t *vfs, int max_ms, vfs_defrag_t *result);
+int vfs_resize(vfs_t *vfs, int n_blocks);
+int vfs_fsck(vfs_t *vfs, int n_workers, vfs_fsck_fn report, void *arg, vfs_fsck_t *result);
+int vfs_fsck_image(const char *path, int repair, int n_workers, vfs_fsck_fn report, void *arg, vfs_fsck_t *result);
+const char *vfs_strerror(int status);
+
+// directories (paths are absolute, "/a/b", or relative to the current directory of the handle, "../a")
+int vfs_list(vfs_t *vfs, const char *path, int offset, vfs_entry_t *entries, int max, int *n);
+int vfs_stat(vfs_t *vfs, const char *path, vfs_entry_t *entry);
+int vfs_mkdir(vfs_t *vfs, const char *path);
+int vfs_mkdir_flags(vfs_t *vfs, const char *path, int flags);
+int vfs_cd(vfs_t *vfs, const char *path);
+int vfs_pwd(vfs_t *vfs, char *buf, size_t size);
+int vfs_rmdir(vfs_t *vfs, const char *path);
+
+// files
+int vfs_get(vfs_t *vfs, const char *host_path, const char *path);
+int vfs_get_flags(vfs_t *vfs, const char *host_path, const char *path, int flags);
+int vfs_get_tree(vfs_t *vfs, const char *host_dir, const char *path, int n_workers, vfs_error_fn report, void *arg);
+int vfs_get_tree_flags(vfs_t *vfs, const char *host_dir, const char *path, int n_workers, int flags, vfs_error_fn report, void *arg);
+int vfs_put(vfs_t *vfs, const char *path, const char *host_path);
+int vfs_read(vfs_t *vfs, const char *path, int offset, char *buf, int size, int *n);
+int vfs_cat(vfs_t *vfs, const char *path, int offset, int length, int fd);
+int vfs_cp(vfs_t *vfs, const char *src, const char *dest);
+int vfs_mv(vfs_t *vfs, const char *src, const char *dest);
+int vfs_rm(vfs_t *vfs, const char *path);
+
+#endif